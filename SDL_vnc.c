@@ -19,9 +19,16 @@ Butchered by Vidar Hokstad, vidar@hokstad.com
  /* Prototype for inet_pton */
  int inet_pton(int af, const char *src, void *dst);
 #else
+ /* For clock_gettime() in strict ISO C builds */
+ #ifndef _POSIX_C_SOURCE
+ #define _POSIX_C_SOURCE 200112L
+ #endif
  #include <sys/select.h>
  #include <unistd.h>
  #include <sys/socket.h>
+ #include <sys/uio.h>
+ #include <fcntl.h>
+ #include <time.h>
  #include <netinet/in.h>
  #include <arpa/inet.h>
 
@@ -36,39 +43,10 @@ Butchered by Vidar Hokstad, vidar@hokstad.com
 #include <sys/types.h>
 
 #include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
 #include "d3des.h"
 
-// FIXME: Currently these need to be larger than maximum used buffer
-#define RAWBUFFER_WIDTH 1920
-#define RAWBUFFER_HEIGHT 1024
-
-/* From support.c */
-void blit_raw(tSDL_vnc * vnc, tSDL_vnc_rect rect);
-
-/* Endian dependent routines/data */
-
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-#define swap_16(x) (x)
-	#define swap_32(x) (x)
-	unsigned char bitfield[8]={1,2,4,8,16,32,64,128};
-#else
-	#define swap_16(x) ((((x) & 0xff) << 8) | (((x) >> 8) & 0xff))
-	#define swap_32(x) (((x) >> 24) | (((x) & 0x00ff0000) >> 8)  | (((x) & 0x0000ff00) << 8)  | ((x) << 24))
-	unsigned char bitfield[8]={128,64,32,16,8,4,2,1};
-#endif
-
-/* Define this to generate lots of info while the library is running. */
-//#define DEBUG
-#define TRACE_LAST_ERROR
-
-#ifdef DEBUG
-	#define DBMESSAGE 	printf
-#else
-	#define DBMESSAGE 	//
-#endif
-
 #ifdef TRACE_LAST_ERROR
-	#define DBERROR 	traceError
 	// Debug functionality
 	void traceError(const char * format, ...) {
 		va_list args;
@@ -77,64 +55,406 @@ void blit_raw(tSDL_vnc * vnc, tSDL_vnc_rect rect);
 		printf(">>> Error: "); puts(vncLastError);
 		va_end(args);
 	}
-#else
-	#define DBERROR 	printf(">>> Error: "); printf
 #endif
 
-#define CHECKED_READ(vnc, dest, len, message) { \
-    int result = Recv(vnc->socket, dest, len, 0); \
-    if (result!=len) { \
-    printf("Error reading %s. Got %i of %i bytes.\n", message, result, len); \
-    return 0; \
-    } \
-    }
-
+char *strdup(const char *s);
 
+uint64_t MonotonicMicroseconds(void)
+{
+#if defined(WIN32) || defined(WIN64)
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / (frequency.QuadPart / 1000000.0));
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
 
-char *strdup(const char *s);
+/* The fd that turns readable when server data is waiting: the socket,
+   or the io_uring the socket is received through */
+int ServerDataFd(tSDL_vnc *vnc)
+{
+	int fd = UringFd(vnc);
+	return fd >= 0 ? fd : vnc->socket;
+}
 
 static int WaitForMessage(tSDL_vnc *vnc, unsigned int usecs)
 {
 	fd_set fds;
 	struct timeval timeout;
 	int result;
-	
-	timeout.tv_sec=0;
-	timeout.tv_usec=usecs;
+	int serverfd = ServerDataFd(vnc);
+	int maxfd = serverfd;
+
+	// Data already sitting in the receive buffer counts as a message
+	if (vnc->recvbufferpos < vnc->recvbufferlen) return WAIT_SERVER;
+
+	timeout.tv_sec=usecs / 1000000;
+	timeout.tv_usec=usecs % 1000000;
 	FD_ZERO(&fds);
-	FD_SET(vnc->socket,&fds);
-	result=select(vnc->socket+1, &fds, NULL, NULL, &timeout);
+	FD_SET(serverfd,&fds);
+	// Queued input wakes us up through the pipe
+	if (vnc->wakeup[0] >= 0) {
+		FD_SET(vnc->wakeup[0],&fds);
+		if (vnc->wakeup[0] > maxfd) maxfd = vnc->wakeup[0];
+	}
+	vnc_count(&vnc->stats.waitcalls, 1);
+	result=select(maxfd+1, &fds, NULL, NULL, &timeout);
 #ifdef DEBUG
 	if (result<0) {
 		DBMESSAGE("Waiting for message failed: %d (%s)\n",errno,strerror(errno));
 	}
 #endif
-	
+	if (result <= 0) return result;
+	if (FD_ISSET(serverfd,&fds)) return WAIT_SERVER;
+	return WAIT_INPUT;
+}
+
+/* Create the pipe the input functions use to wake the client thread.
+   Not available on Windows, where queued input goes out between server
+   messages and at the update request timeout only. */
+static void CreateWakeup(tSDL_vnc *vnc)
+{
+	vnc->wakeup[0] = vnc->wakeup[1] = -1;
+#if !defined(WIN32) && !defined(WIN64)
+	if (pipe(vnc->wakeup) != 0) {
+		DBERROR("Could not create wakeup pipe.\n");
+		vnc->wakeup[0] = vnc->wakeup[1] = -1;
+		return;
+	}
+	fcntl(vnc->wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(vnc->wakeup[1], F_SETFL, O_NONBLOCK);
+#endif
+}
+
+static void CloseWakeup(tSDL_vnc *vnc)
+{
+#if !defined(WIN32) && !defined(WIN64)
+	if (vnc->wakeup[0] >= 0) close(vnc->wakeup[0]);
+	if (vnc->wakeup[1] >= 0) close(vnc->wakeup[1]);
+#endif
+	vnc->wakeup[0] = vnc->wakeup[1] = -1;
+}
+
+/* Make the client thread (or event loop) look at the connection */
+void WakeClient(tSDL_vnc *vnc)
+{
+#if !defined(WIN32) && !defined(WIN64)
+	if (vnc->wakeup[1] >= 0) {
+		char byte = 0;
+		if (write(vnc->wakeup[1], &byte, 1) < 0) {
+			DBMESSAGE("Wakeup pipe full.\n");
+		}
+	}
+#endif
+}
+
+static void DrainWakeup(tSDL_vnc *vnc)
+{
+#if !defined(WIN32) && !defined(WIN64)
+	if (vnc->wakeup[0] >= 0) {
+		char drain[64];
+		while (read(vnc->wakeup[0], drain, sizeof(drain)) > 0);
+	}
+#endif
+}
+
+/* Account for an event just appended to clientbuffer and make sure the
+   client thread sends it right away. Called with the mutex held. */
+static void QueueInput(tSDL_vnc *vnc)
+{
+	uint64_t now = MonotonicMicroseconds();
+	if (vnc->inputqueued == 0) vnc->inputqueuedfirst = now;
+	vnc->inputqueued++;
+	vnc->inputqueuedsum += now;
+	if (vnc_atomic_load(&vnc->inputpending)) return;
+	vnc_atomic_store(&vnc->inputpending, 1);
+	WakeClient(vnc);
+}
+
+/* Make room for len more bytes in clientbuffer. Input is never dropped,
+   the buffer grows instead. Called with the mutex held. */
+static char *ReserveClientBuffer(tSDL_vnc *vnc, int len)
+{
+	if (vnc->clientbufferpos + len > vnc->clientbuffersize) {
+		int size = vnc->clientbuffersize * 2;
+		while (vnc->clientbufferpos + len > size) size *= 2;
+		char *buffer = (char *)realloc(vnc->clientbuffer, size);
+		if (!buffer) {
+			DBERROR("Out of memory growing clientbuffer.\n");
+			return NULL;
+		}
+		DBMESSAGE("Client buffer grown to %i bytes.\n", size);
+		vnc->clientbuffer = buffer;
+		vnc->clientbuffersize = size;
+	}
+	return vnc->clientbuffer + vnc->clientbufferpos;
+}
+
+/* send() to the server, counted. Only the thread driving the connection
+   sends. A stream opened with vncParserOpen has nobody to send to, its
+   replies are dropped. */
+static int Send(tSDL_vnc *vnc, const void *buf, int len)
+{
+	if (vnc->socket < 0) return len;
+	int result = send(vnc->socket,(const char *)buf,len,0);
+	vnc_count(&vnc->stats.sendcalls, 1);
+	if (result>0) vnc_count(&vnc->stats.bytessent, result);
 	return result;
 }
 
-int Recv(int s, void *buf, size_t len, int flags)
+/* Send whatever input is queued. The queued bytes are swapped out under
+   the mutex and sent after releasing it, so a full socket buffer blocks
+   neither blits nor the input functions. Returns 0 on a write error. */
+static int FlushClientBuffer(tSDL_vnc *vnc)
+{
+	char *buffer;
+	int len, queued;
+	uint64_t queuedsum, queuedfirst;
+
+	if (!vnc_atomic_load(&vnc->inputpending)) return 1;
+
+	SDL_LockMutex(vnc->mutex);
+	DrainWakeup(vnc);
+	buffer = vnc->clientbuffer;
+	len = vnc->clientbufferpos;
+	queued = vnc->inputqueued;
+	queuedsum = vnc->inputqueuedsum;
+	queuedfirst = vnc->inputqueuedfirst;
+	if (len>0) {
+		int size = vnc->clientbuffersize;
+		vnc->clientbuffer = vnc->clientspare;
+		vnc->clientbuffersize = vnc->clientsparesize;
+		vnc->clientspare = buffer;
+		vnc->clientsparesize = size;
+		vnc->clientbufferpos=0;
+	}
+	vnc->lastpointer = -1;
+	vnc->inputqueued = 0;
+	vnc->inputqueuedsum = 0;
+	vnc_atomic_store(&vnc->inputpending, 0);
+	SDL_UnlockMutex(vnc->mutex);
+
+	if (len==0) return 1;
+	int sent = Send(vnc,buffer,len);
+	if (sent!=len) {
+		DBERROR("vncClientThread: Write error on client-to-server data.\n");
+		return 0;
+	}
+	DBMESSAGE("vncClientThread: Client-to-Server data: %u bytes send\n",sent);
+	uint64_t now = MonotonicMicroseconds();
+	vnc_count(&vnc->stats.inputevents, queued);
+	vnc_count(&vnc->stats.inputlatency, queued * now - queuedsum);
+	vnc_count_max(&vnc->stats.inputlatencymax, now - queuedfirst);
+	return 1;
+}
+
+#define RECV_MAXIOV 64
+
+/*
+  Fill the receive buffer and/or targets.
+
+  When the receive buffer is empty, the remaining part of the request is
+  read straight into the targets (up to RECV_MAXIOV of them, e.g. the rows
+  of a rectangle) and anything the socket has beyond that lands in the
+  receive buffer, so large reads do not pay for an extra copy and small
+  reads are served from memory. Returns the number of bytes read, 0 on
+  EOF and <0 on error. Of those, *direct went into the targets, in order;
+  the rest is left in recvbuffer[recvbufferpos..recvbufferlen].
+*/
+static int RecvFill(tSDL_vnc *vnc, tSDL_vnc_iov *targets, int count, size_t *direct)
+{
+	int result;
+
+	vnc->recvbufferpos=0;
+	vnc->recvbufferlen=0;
+	vnc_count(&vnc->stats.recvcalls, 1);
+	*direct=0;
+#if defined(WIN32) || defined(WIN64)
+	// No scatter reads, only the first target is read into directly
+	if (count>0 && targets[0].len >= VNC_RECVBUFSIZE) {
+		result = recv(vnc->socket,(char *)targets[0].base,targets[0].len,0);
+		if (result>0) {
+			vnc_count(&vnc->stats.bytesreceived, result);
+			*direct=result;
+		}
+		return result;
+	}
+	result = recv(vnc->socket,(char *)vnc->recvbuffer,VNC_RECVBUFSIZE,0);
+	if (result<=0) return result;
+	vnc_count(&vnc->stats.bytesreceived, result);
+	vnc->recvbufferlen=result;
+	if (count>0) {
+		vnc->recvbufferpos=(size_t)result>targets[0].len ? targets[0].len : result;
+		memcpy(targets[0].base,vnc->recvbuffer,vnc->recvbufferpos);
+		*direct=vnc->recvbufferpos;
+	}
+	return result;
+#else
+	struct iovec iov[RECV_MAXIOV+1];
+	size_t len=0;
+	int i;
+	if (count>RECV_MAXIOV) count=RECV_MAXIOV;
+	for (i=0; i<count; i++) {
+		iov[i].iov_base=targets[i].base;
+		iov[i].iov_len=targets[i].len;
+		len += targets[i].len;
+	}
+	iov[count].iov_base=vnc->recvbuffer;
+	iov[count].iov_len=VNC_RECVBUFSIZE;
+	result = readv(vnc->socket,iov,count+1);
+	if (result<=0) return result;
+	vnc_count(&vnc->stats.bytesreceived, result);
+	if ((size_t)result>len) {
+		vnc->recvbufferlen=result-len;
+		*direct=len;
+	} else {
+		*direct=result;
+	}
+	return result;
+#endif
+}
+
+int Recv(tSDL_vnc *vnc, void *buf, size_t len)
 {
 	unsigned char *target=buf;
 	size_t to_read=len;
 	int result;
 
+	/* Once the handshake is done everything arrives through the parser */
+	if (vnc->parser) return ParserRecv(vnc, buf, len);
+
+	vnc->recvrequests++;
 	while (to_read>0) {
-		result = recv(s,target,to_read,flags);
-		if (result<0) return result;
-		if (result==0) return (len-to_read);
+		result = vnc->recvbufferlen - vnc->recvbufferpos;
+		if (result>0) {
+			// Serve from the receive buffer first
+			if ((size_t)result>to_read) result=to_read;
+			memcpy(target,vnc->recvbuffer+vnc->recvbufferpos,result);
+			vnc->recvbufferpos += result;
+		} else {
+			tSDL_vnc_iov iov = { target, to_read };
+			size_t direct;
+			uint64_t waited = MonotonicMicroseconds();
+			result = RecvFill(vnc,&iov,1,&direct);
+			vnc_count(&vnc->stats.recvwait, MonotonicMicroseconds() - waited);
+			if (result<0) return result;
+			if (result==0) return (len-to_read);
+			result=direct;
+		}
 		to_read -= result;
 		target += result;
 	}
 
+	vnc->recvconsumed += len;
 	return len ;
 }
 
+/* Read rows of rowlen bytes that lie pitch bytes apart */
+int RecvRows(tSDL_vnc *vnc, void *dest, size_t pitch, size_t rowlen, int rows)
+{
+	unsigned char *row=dest;
+	int result=0;
+	int i;
+
+	if (vnc->parser) return ParserRecvRows(vnc, row, pitch, rowlen, rows);
+
+	for (i=0; i<rows; i++, row+=pitch) {
+		int got = Recv(vnc, row, rowlen);
+		if (got<0) return got;
+		result += got;
+		if ((size_t)got!=rowlen) break;
+	}
+	return result;
+}
+
+/* Area added by covering a and b with their bounding box */
+static int DamageWaste(SDL_Rect *a, SDL_Rect *b)
+{
+	int x1 = a->x < b->x ? a->x : b->x;
+	int y1 = a->y < b->y ? a->y : b->y;
+	int x2 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+	int y2 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+	return (x2 - x1) * (y2 - y1) - a->w * a->h - b->w * b->h;
+}
+
+static void DamageUnion(SDL_Rect *a, SDL_Rect *b)
+{
+	int x1 = a->x < b->x ? a->x : b->x;
+	int y1 = a->y < b->y ? a->y : b->y;
+	int x2 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+	int y2 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+	a->x = x1;
+	a->y = y1;
+	a->w = x2 - x1;
+	a->h = y2 - y1;
+}
+
+static int DamageContains(SDL_Rect *a, SDL_Rect *b)
+{
+	return b->x >= a->x && b->y >= a->y &&
+		b->x + b->w <= a->x + a->w && b->y + b->h <= a->y + a->h;
+}
+
+/* Merge the cheapest pair of damage rectangles until at most max remain */
+static void ReduceDamage(SDL_Rect *list, int *count, int max)
+{
+	if (max < 1) max = 1;
+	while (*count > max) {
+		int i, j, besti = 0, bestj = 1;
+		int best = DamageWaste(&list[0], &list[1]);
+		for (i = 0; i < *count; i++) {
+			for (j = i + 1; j < *count; j++) {
+				int waste = DamageWaste(&list[i], &list[j]);
+				if (waste < best) {
+					best = waste;
+					besti = i;
+					bestj = j;
+				}
+			}
+		}
+		DamageUnion(&list[besti], &list[bestj]);
+		list[bestj] = list[--(*count)];
+	}
+}
+
+/* Add a rectangle to a damage list of VNC_DAMAGERECTS entries. Rectangles
+   that cover each other or can be joined without adding area (e.g.
+   neighbouring tiles of one row) are merged; when the list is full the
+   cheapest pair is merged. */
+static void AddDamage(SDL_Rect *list, int *count, SDL_Rect *trec)
+{
+	SDL_Rect rect = *trec;
+	int i;
+
+	for (i = 0; i < *count; ) {
+		SDL_Rect *d = &list[i];
+		if (DamageContains(d, &rect)) return;
+		if (DamageContains(&rect, d) || DamageWaste(d, &rect) <= 0) {
+			/* Absorb the old entry and look again, the grown
+			   rectangle may now join another one */
+			DamageUnion(&rect, d);
+			list[i] = list[--(*count)];
+			i = 0;
+			continue;
+		}
+		i++;
+	}
+
+	if (*count == VNC_DAMAGERECTS) ReduceDamage(list, count, VNC_DAMAGERECTS - 1);
+	list[(*count)++] = rect;
+}
+
 void GrowUpdateRegion(tSDL_vnc *vnc, SDL_Rect *trec)
 {
 	Sint16 ax1,ay1,ax2,ay2;
 	Sint16 bx1,by1,bx2,by2;
 
+	if (trec->w == 0 || trec->h == 0) return;
+
 	if (vnc->fbupdated) {
 		/* Original update rectangle */
 		ax1=vnc->updatedRect.x;
@@ -159,28 +479,101 @@ void GrowUpdateRegion(tSDL_vnc *vnc, SDL_Rect *trec)
 	} else {
 		/* Initialize update rectangle */
 		vnc->updatedRect=*trec;
+		vnc->damagecount=0;
 		vnc->fbupdated=1;
 	}
+	AddDamage(vnc->damage, &vnc->damagecount, trec);
+	if (vnc->fed) AddDamage(vnc->feeddamage, &vnc->feeddamagecount, trec);
 }
 
-
-static int handleHextile(tSDL_vnc *vnc) {
-    DBMESSAGE("Hextile encoding.\n");
-    //
-    if (!(vnc->tilebuffer)) {
-        // Create new tilebuffer
-        vnc->tilebuffer = SDL_CreateRGBSurface(SDL_SWSURFACE,16,16,32,vnc->rmask,vnc->gmask,vnc->bmask,0);
-        if (vnc->tilebuffer) {
-            SDL_SetAlpha(vnc->tilebuffer,0,0);
-            DBMESSAGE("Created new tilebuffer.\n");
-        } else {
-            DBERROR("Error creating tilebuffer.\n");
-            return 0;
-        }
-    }
-    return 1;
+/* Create the front buffers for doublebuffer mode. Every front starts out
+   completely stale, so the first publish copies the whole framebuffer. */
+static int CreateFrontBuffers(tSDL_vnc *vnc)
+{
+	int i;
+	for (i = 0; i < VNC_FRONTBUFFERS; i++) {
+		tSDL_vnc_front *front = &vnc->front[i];
+		front->surface = SDL_CreateRGBSurface(SDL_SWSURFACE,vnc->framebuffer->w,vnc->framebuffer->h,32,vnc->rmask,vnc->gmask,vnc->bmask,0);
+		if (front->surface==NULL) {
+			DBERROR("Could not create front buffer.\n");
+			return 0;
+		}
+		SDL_SetAlpha(front->surface,0,0);
+		front->seq = 0;
+		front->stale[0].x = 0;
+		front->stale[0].y = 0;
+		front->stale[0].w = vnc->framebuffer->w;
+		front->stale[0].h = vnc->framebuffer->h;
+		front->stalecount = 1;
+		front->damagecount = 0;
+	}
+	vnc->frontpublished = -1;
+	vnc->frontinuse = -1;
+	vnc->frontconsumed = 0;
+	vnc->unconsumedcount = 0;
+	return 1;
 }
 
+/* Complete a framebuffer update. In doublebuffer mode the damaged parts of
+   the framebuffer are copied into a front buffer that the application is
+   neither blitting nor about to pick up, which is then published with a
+   single atomic store. The application never waits for the decoder and
+   never sees half an update. */
+static void PublishFramebuffer(tSDL_vnc *vnc)
+{
+	SDL_Rect damage[VNC_DAMAGERECTS];
+	int count, i, f;
+	unsigned int seq;
+
+	SDL_LockMutex(vnc->mutex);
+	seq = vnc->frameseq + 1;
+	vnc_atomic_store(&vnc->frameseq, seq);
+	if (!vnc->doublebuffer) {
+		SDL_UnlockMutex(vnc->mutex);
+		return;
+	}
+	count = vnc->fbupdated ? vnc->damagecount : 0;
+	memcpy(damage, vnc->damage, count * sizeof(SDL_Rect));
+	vnc->fbupdated = 0;
+	vnc->damagecount = 0;
+	SDL_UnlockMutex(vnc->mutex);
+	if (count == 0) return;
+
+	for (f = 0; f < VNC_FRONTBUFFERS; f++) {
+		for (i = 0; i < count; i++) {
+			AddDamage(vnc->front[f].stale, &vnc->front[f].stalecount, &damage[i]);
+		}
+	}
+
+	/* With three fronts one is always free: the published one and the
+	   one being blitted (possibly the same) are left alone */
+	int published = vnc_atomic_load(&vnc->frontpublished);
+	int inuse = vnc_atomic_load(&vnc->frontinuse);
+	for (f = 0; f < VNC_FRONTBUFFERS; f++) {
+		if (f != published && f != inuse) break;
+	}
+	tSDL_vnc_front *front = &vnc->front[f];
+
+	for (i = 0; i < front->stalecount; i++) {
+		SDL_Rect dest = front->stale[i];
+		SDL_BlitSurface(vnc->framebuffer, &front->stale[i], front->surface, &dest);
+	}
+	front->stalecount = 0;
+
+	/* Damage of updates the application skipped carries over */
+	if (published < 0 || vnc_atomic_load(&vnc->frontconsumed) == vnc->front[published].seq) {
+		vnc->unconsumedcount = 0;
+	}
+	for (i = 0; i < count; i++) {
+		AddDamage(vnc->unconsumed, &vnc->unconsumedcount, &damage[i]);
+	}
+	memcpy(front->damage, vnc->unconsumed, vnc->unconsumedcount * sizeof(SDL_Rect));
+	front->damagecount = vnc->unconsumedcount;
+	front->seq = seq;
+
+	vnc_atomic_store(&vnc->frontpublished, f);
+	DBMESSAGE("Published update %u in front buffer %i.\n", seq, f);
+}
 
 
 static int read_security_type(tSDL_vnc *vnc) {
@@ -204,7 +597,7 @@ static int read_security_type(tSDL_vnc *vnc) {
     }
         
     // Receive Security Type List (Buffer overflow possible!)
-    int result = Recv(vnc->socket,vnc->buffer,nSecTypes,0);
+    int result = Recv(vnc,vnc->buffer,nSecTypes);
         
     // Find supported one...
     vnc->security_type = 0;
@@ -219,7 +612,7 @@ static int read_security_type(tSDL_vnc *vnc) {
     DBMESSAGE("Security type (select): %i\n", vnc->security_type);
     vnc->buffer[0] = vnc->security_type;
         
-    result = send(vnc->socket,vnc->buffer,1,0);
+    result = Send(vnc,vnc->buffer,1);
     if (result != 1) {
         DBERROR("Write error on security type selection.\n");
         return 0;
@@ -229,26 +622,64 @@ static int read_security_type(tSDL_vnc *vnc) {
 }
 
 
-/* FIXME: Is this valid when we never request a non-truecolor display? */
+#define COLORMAP_BATCH 64
+
+static int RequestRefresh(tSDL_vnc *vnc);
+
+/* Palette entries for colour map mode. Changed colours are redrawn from
+   the framebuffer itself where possible, otherwise fetched again. The
+   whole message is read first, so the framebuffer is recoloured in one
+   pass however many entries it has. */
 static int HandleServerMessage_colormap(tSDL_vnc * vnc)
 {
 	tSDL_vnc_serverColormap serverColormap;
+    unsigned char header[5];
+    unsigned char entries[COLORMAP_BATCH * 6];
+    uint32_t colors[256];
+    int refresh = 0, redrawn = 0;
+    int index, count = 0;
+    SDL_Rect changed;
     DBMESSAGE("Message: colormap\n");
-    // Read data, but ignore it
-    CHECKED_READ(vnc, &serverColormap, 5, "server colormap");
+    CHECKED_READ(vnc, header, 5, "server colormap");
 
-    serverColormap.first=swap_16(serverColormap.first);
-    serverColormap.number=swap_16(serverColormap.number);
+    serverColormap.first=(header[1] << 8) | header[2];
+    serverColormap.number=(header[3] << 8) | header[4];
 
     DBMESSAGE("Server colormap first color: %u\n",serverColormap.first);
     DBMESSAGE("Server colormap number: %u\n",serverColormap.number);
 
+    /* Entries past index 255 cannot occur in 8 bit pixels; they are read
+       and dropped */
+    index = serverColormap.first;
     while (serverColormap.number>0) {
-        CHECKED_READ(vnc, &vnc->buffer, 6, "server colormap color");
-        DBMESSAGE("Got color %u.\n",serverColormap.first);
-        serverColormap.first++;
-        serverColormap.number--;
+        int i, n = serverColormap.number < COLORMAP_BATCH ? serverColormap.number : COLORMAP_BATCH;
+        CHECKED_READ(vnc, entries, n * 6, "server colormap colors");
+        // 16 bit components, of which the framebuffer keeps the top 8
+        for (i = 0; i < n && index < 256; i++, index++) {
+            unsigned char * entry = entries + i * 6;
+            colors[count++] = (entry[0] << 16) | (entry[2] << 8) | entry[4];
+        }
+        serverColormap.number-=n;
+    }
+
+    if (!vnc->pixelformat.truecolor && count > 0) {
+        SDL_LockMutex(vnc->mutex);
+        if (ColormapUpdate(vnc, serverColormap.first, count, colors, &changed) == 0) {
+            refresh = 1;
+        } else if (changed.w > 0) {
+            GrowUpdateRegion(vnc, &changed);
+            redrawn = 1;
+        }
+        SDL_UnlockMutex(vnc->mutex);
+    }
+
+    /* Nothing was shown before the first update */
+    if (refresh && vnc_atomic_load(&vnc->frameseq) > 0) {
+        DBMESSAGE("Colormap change needs a full refresh.\n");
+        if (RequestRefresh(vnc) == 0) return 0;
     }
+    if (!vnc->pixelformat.truecolor && cursor_recolor(vnc) == 0) return 0;
+    if (redrawn) PublishFramebuffer(vnc);
     return 1;
 }
 
@@ -260,15 +691,17 @@ void vnc_to_sdl_rect(tSDL_vnc_rect * src, SDL_Rect * dest)
     dest->h = src->height;
 }
 
-static inline void vnc_hextile_to_sdl_rect(uint8_t xy, uint8_t wh, SDL_Rect * dest)
+/* Decoders that write straight into the framebuffer must not run past it */
+int RectInFramebuffer(tSDL_vnc * vnc, tSDL_vnc_rect * rect)
 {
-    dest->x=(xy >> 4) & 0x0f;
-    dest->y=xy & 0x0f;
-    dest->w=((wh >> 4) & 0x0f)+1;
-    dest->h=(wh & 0x0f)+1;
+    if ((rect->x + rect->width > vnc->framebuffer->w) ||
+        (rect->y + rect->height > vnc->framebuffer->h)) {
+        DBERROR("Rectangle %u,%u size %u,%u outside framebuffer.\n", rect->x, rect->y, rect->width, rect->height);
+        return 0;
+    }
+    return 1;
 }
 
-
 static inline void vnc_rect_swap(tSDL_vnc_rect * rect)
 {
     rect->x = swap_16(rect->x);
@@ -277,37 +710,13 @@ static inline void vnc_rect_swap(tSDL_vnc_rect * rect)
     rect->height = swap_16(rect->height);
 }
 
-static void blit_scratch(tSDL_vnc * vnc, tSDL_vnc_rect rect)
-{
-    SDL_Rect trec;
-    vnc_to_sdl_rect(&rect, &trec);
-    SDL_LockMutex(vnc->mutex);
-    SDL_BlitSurface(vnc->scratchbuffer, NULL, vnc->framebuffer, &trec);
-    GrowUpdateRegion(vnc,&trec);
-    SDL_UnlockMutex(vnc->mutex);
-}
-
-
 static int ServerRectangle_Raw(tSDL_vnc * vnc,
                                tSDL_vnc_rect serverRectangle)
 {
     DBMESSAGE("RAW encoding.\n");
 
-    if (serverRectangle.width > RAWBUFFER_WIDTH ||
-        serverRectangle.height > RAWBUFFER_HEIGHT) {
-        DBERROR("Oops. Too large for buffer. Should fall back on old temporary buffer here");
-    }
-
-    if (serverRectangle.width == vnc->framebuffer->pitch / 4) {
-        if (read_raw(vnc, serverRectangle) == 0) return 0;
-    } else {
-        int bytes_to_read = serverRectangle.width*serverRectangle.height*4;
-        CHECKED_READ(vnc, (unsigned char *)vnc->rawbuffer, bytes_to_read, "pixel data");
-        DBMESSAGE("Blitting %i bytes of raw pixel data.\n",bytes_to_read);
-        blit_raw(vnc,serverRectangle);
-        DBMESSAGE("Blitted raw pixel data.\n");
-    }
-    return 1;
+    if (!RectInFramebuffer(vnc, &serverRectangle)) return 0;
+    return read_raw(vnc, serverRectangle);
 }
 
 
@@ -319,207 +728,416 @@ static int ServerRectangle_CopyRect(tSDL_vnc * vnc,
 	tSDL_vnc_serverCopyrect serverCopyrect;
     CHECKED_READ(vnc, &serverCopyrect, 4, "copyrect");
 
-    SDL_Rect trec, srec;
-    srec.x=swap_16(serverCopyrect.x);
-    srec.y=swap_16(serverCopyrect.y);
-    DBMESSAGE("Copyrect from %u,%u\n",srec.x,srec.y);
-    srec.w=serverRectangle.width;
-    srec.h=serverRectangle.height;
+    tSDL_vnc_rect source = serverRectangle;
+    source.x=swap_16(serverCopyrect.x);
+    source.y=swap_16(serverCopyrect.y);
+    DBMESSAGE("Copyrect from %u,%u\n",source.x,source.y);
+    if (!RectInFramebuffer(vnc, &source) || !RectInFramebuffer(vnc, &serverRectangle)) return 0;
+
+    SDL_Rect trec;
     vnc_to_sdl_rect(&serverRectangle,&trec);
-    
+
     SDL_LockMutex(vnc->mutex);
-    SDL_BlitSurface(vnc->framebuffer, &srec, vnc->scratchbuffer, NULL);
-    SDL_BlitSurface(vnc->scratchbuffer, NULL, vnc->framebuffer, &trec);
+    SDL_LockSurface(vnc->framebuffer);
+
+    /* Copy rows in place. When moving down, go bottom-up so rows that
+       overlap are read before they are overwritten; memmove takes care
+       of horizontal overlap within a row. */
+    uint32_t pitch = vnc->framebuffer->pitch / 4;
+    uint32_t * src = (uint32_t *)vnc->framebuffer->pixels + source.y * pitch + source.x;
+    uint32_t * dest = (uint32_t *)vnc->framebuffer->pixels + serverRectangle.y * pitch + serverRectangle.x;
+    size_t len = serverRectangle.width * 4;
+    int rows = serverRectangle.height;
+    if (serverRectangle.y > source.y) {
+        src += (rows - 1) * pitch;
+        dest += (rows - 1) * pitch;
+        for (; rows > 0; rows--, src -= pitch, dest -= pitch) memmove(dest, src, len);
+    } else {
+        for (; rows > 0; rows--, src += pitch, dest += pitch) memmove(dest, src, len);
+    }
+
     GrowUpdateRegion(vnc,&trec);
+    SDL_UnlockSurface(vnc->framebuffer);
     SDL_UnlockMutex(vnc->mutex);
-    DBMESSAGE("Blitted copyrect pixels.\n");
+    DBMESSAGE("Copied copyrect pixels.\n");
     return 1;
 }
 
 
 
-static int ServerRectangle_Cursor(tSDL_vnc * vnc,
-                                  tSDL_vnc_rect rect)
+#define RRE_BATCH 64
+
+/* RRE with pixels of bpp bytes; one copy per pixel size */
+VNC_INLINE int rre_decode(tSDL_vnc * vnc, tSDL_vnc_rect rect, const int bpp)
 {
-    DBMESSAGE("CURSOR pseudo-encoding.\n");
+	tSDL_vnc_serverRRE serverRRE;
+    unsigned char header[8];
+    unsigned char subrects[RRE_BATCH * 12];
+    tSDL_vnc_span spans[RRE_BATCH];
+    const int size = bpp + 8;
+    CHECKED_READ(vnc, header, 4 + bpp, "RRE header");
+    memcpy(&serverRRE.number, header, 4);
+    serverRRE.number=swap_32(serverRRE.number);
+    serverRRE.background=vnc_pixel(vnc, header + 4, bpp);
 
-    vnc->cursorhotspot.x = rect.x;
-    vnc->cursorhotspot.y = rect.y;
+    DBMESSAGE("RRE of %u rectangles. Background color 0x%06x\n",serverRRE.number,serverRRE.background);
 
-    int bytes_to_read = rect.width*rect.height*4;
-    
-    CHECKED_READ(vnc, (unsigned char *)vnc->scratchbuffer->pixels,bytes_to_read, "cursor data");
-    DBMESSAGE("Read cursor pixel data %u byte.\n",bytes_to_read);
-
-    // Mask data
-    bytes_to_read = (unsigned int)floor((rect.width+7.0)/8.0)*rect.height;
-    unsigned char *cursormask=(unsigned char *)malloc(bytes_to_read);
-    if (!cursormask) {
-        DBERROR("Could not allocate cursor mask.\n");
-        return 0;
-    }
+    if (!RectInFramebuffer(vnc, &rect)) return 0;
 
-    CHECKED_READ(vnc, (unsigned char *)cursormask,bytes_to_read, "cursor mask");
-    DBMESSAGE("Read cursor mask data %u byte.\n",bytes_to_read);
+    SDL_Rect trec;
+    vnc_to_sdl_rect(&rect, &trec);
+    uint32_t pitch = vnc->framebuffer->pitch / 4;
+    uint32_t * base = (uint32_t *)vnc->framebuffer->pixels + rect.y * pitch + rect.x;
+
+    SDL_LockMutex(vnc->mutex);
+    SDL_LockSurface(vnc->framebuffer);
+    vnc_fill_rect(base, pitch, rect.width, rect.height, serverRRE.background);
+    SDL_UnlockSurface(vnc->framebuffer);
+    SDL_UnlockMutex(vnc->mutex);
+
+    /* Draw subrectangles, a batch of them per read. The lock is only held
+       while drawing, never across a read (see parser.c). */
+    unsigned int remaining=serverRRE.number;
+    int result = 1;
+    while (remaining>0) {
+        int count = remaining < RRE_BATCH ? remaining : RRE_BATCH;
+        if (Recv(vnc, subrects, count*size) != count*size) {
+            result = 0;
+            break;
+        }
+        int i, n = 0;
+        for (i = 0; i < count; i++) {
+            tSDL_vnc_serverRREdata serverRREdata;
+            serverRREdata.color = vnc_pixel(vnc, subrects + i*size, bpp);
+            memcpy(&serverRREdata.rect, subrects + i*size + bpp, 8);
+            vnc_rect_swap(&serverRREdata.rect);
+            tSDL_vnc_rect * sub = &serverRREdata.rect;
+            if (sub->x >= rect.width || sub->y >= rect.height) continue;
+            spans[n].x = sub->x;
+            spans[n].y = sub->y;
+            spans[n].w = sub->x + sub->width > rect.width ? rect.width - sub->x : sub->width;
+            spans[n].h = sub->y + sub->height > rect.height ? rect.height - sub->y : sub->height;
+            spans[n].color = serverRREdata.color;
+            n++;
+        }
+        SDL_LockMutex(vnc->mutex);
+        SDL_LockSurface(vnc->framebuffer);
+        vnc_fill_spans(base, pitch, spans, n);
+        SDL_UnlockSurface(vnc->framebuffer);
+        SDL_UnlockMutex(vnc->mutex);
+        remaining -= count;
+    }
 
-    // Blit data into cursor image
     SDL_LockMutex(vnc->mutex);
-    SDL_BlitSurface(vnc->scratchbuffer,NULL,vnc->cursorbuffer,NULL);
-    // Process mask into alpha of cursor image
-    unsigned char * target=(unsigned char *)vnc->cursorbuffer->pixels;
-    target=target + 3;
-    int byteindex=0;
-    int cy, cx;
-    int bitindex;
-    for (cy=0; cy<rect.height; cy++) {
-        for (cx=0; cx<rect.width; cx++) {
-            bitindex=cx % 8;
-            *target = (cursormask[byteindex] & bitfield[bitindex]) ? 255 : 0;
-            if (bitindex==7) byteindex++;
-            target += 4;
-        } // cx loop
-        if (bitindex<7) byteindex++;
-    } // cy loop
-    free(cursormask);
+    GrowUpdateRegion(vnc, &trec);
     SDL_UnlockMutex(vnc->mutex);
+
+    if (!result) {
+        DBERROR("Read error on RRE data.\n");
+        return 0;
+    }
+    DBMESSAGE("Drawn %u subrectangles.\n", serverRRE.number);
     return 1;
 }
 
 
-
 static int ServerRectangle_RRE(tSDL_vnc * vnc,
                                tSDL_vnc_rect rect)
 {
-	tSDL_vnc_serverRRE serverRRE;
-	tSDL_vnc_serverRREdata serverRREdata;
     DBMESSAGE("RRE encoding.\n");
-    CHECKED_READ(vnc, &serverRRE, 8, "RRE header");
-    serverRRE.number=swap_32(serverRRE.number);
+    switch (vnc->bpp) {
+    case 1:
+        return rre_decode(vnc, rect, 1);
+    case 2:
+        return rre_decode(vnc, rect, 2);
+    default:
+        return rre_decode(vnc, rect, 4);
+    }
+}
 
-    DBMESSAGE("RRE of %u rectangles. Background color 0x%06x\n",serverRRE.number,serverRRE.background);
 
-    SDL_FillRect(vnc->scratchbuffer, NULL, serverRRE.background);
-    /* Draw subrectangles */
-    unsigned int num_subrectangles=0;
-    SDL_Rect srec;
-    while (num_subrectangles<serverRRE.number) {
-        num_subrectangles++;
-        CHECKED_READ(vnc, &serverRREdata, 12, "RRE data");
-        vnc_rect_swap(&serverRREdata.rect);
-        vnc_to_sdl_rect(&serverRREdata.rect,&srec);
-        serverRREdata.color = serverRREdata.color;
-        SDL_FillRect(vnc->scratchbuffer,&srec,serverRREdata.color);
+/* Solid fill of a complete 16x16 Hextile tile */
+static inline void fill_tile16(uint32_t * dest, uint32_t pitch, uint32_t color)
+{
+    int y;
+    for (y = 0; y < 16; y++, dest += pitch) {
+        dest[0] = color;  dest[1] = color;  dest[2] = color;  dest[3] = color;
+        dest[4] = color;  dest[5] = color;  dest[6] = color;  dest[7] = color;
+        dest[8] = color;  dest[9] = color;  dest[10] = color; dest[11] = color;
+        dest[12] = color; dest[13] = color; dest[14] = color; dest[15] = color;
     }
-    DBMESSAGE("Drawn %i subrectangles.\n", num_subrectangles);
-    blit_scratch(vnc, rect);
-    DBMESSAGE("Blitted RRE pixels.\n");
-    return 1;
 }
 
 
-static int ServerRectangle_HexTile(tSDL_vnc * vnc,
-                               tSDL_vnc_rect serverRectangle)
+/* Render Hextile tiles straight into the framebuffer. The background and
+   foreground colours carry over from one tile to the next. A tile is read
+   completely, raw tiles included, before the lock is taken to draw it. One
+   copy per pixel size of bpp bytes. */
+VNC_INLINE int hextile_decode(tSDL_vnc * vnc, tSDL_vnc_rect serverRectangle, const int bpp)
 {
-	SDL_Rect trec, srec;
+    unsigned char subrects[255 * 6];
+    unsigned char rawtile[16 * 16 * 4];
+    unsigned char pixel[4];
+    tSDL_vnc_span spans[255];
+    uint32_t background = 0, foreground = 0;
     int bx,by,hx,hy;
-    if (handleHextile(vnc) == 0) return 0;
-    //
+    int result = 1;
+
+    if (!RectInFramebuffer(vnc, &serverRectangle)) return 0;
+
+    SDL_Rect trec;
+    vnc_to_sdl_rect(&serverRectangle, &trec);
+    uint32_t pitch = vnc->framebuffer->pitch / 4;
+    uint32_t * base = (uint32_t *)vnc->framebuffer->pixels + serverRectangle.y * pitch + serverRectangle.x;
+
     // Iterate over all tiles
     // row loop
-    for (hy=0; hy<serverRectangle.height; hy += 16) {
+    for (hy=0; result && hy<serverRectangle.height; hy += 16) {
         // Determine height of tile
-        if ((hy+16)>serverRectangle.height) {
-            by=serverRectangle.height % 16;
-        } else {
-            by=16;
-        }
+        by = serverRectangle.height - hy < 16 ? serverRectangle.height - hy : 16;
         // column loop
-        for (hx=0; hx<serverRectangle.width; hx += 16) {
+        for (hx=0; result && hx<serverRectangle.width; hx += 16) {
             // Determine width of tile
-            if ((hx+16)>serverRectangle.width) {
-                bx = serverRectangle.width % 16;
-            } else {
-                bx = 16;
-            }
-            tSDL_vnc_serverHextile serverHextile;
-            CHECKED_READ(vnc, &serverHextile,1, "hextile header");
-
-            if (serverHextile.mode & 1) {
-                // Read raw data for tile in lines
-                int bytes_to_read = bx*by*4;
-                int result = 0;
-                if ((bx == 16) && (by == 16)) {
-                    // complete tile
-                    result = Recv(vnc->socket,(unsigned char *)vnc->tilebuffer->pixels,bytes_to_read,0);
-                } else {
-                    // partial tile
-                    unsigned char * target =(unsigned char *)vnc->tilebuffer->pixels;
-                    int rowindex=by;
-                    while (rowindex) {
-                        result += Recv(vnc->socket,target,bx*4,0);
-                        target += 16*4;
-                        rowindex--;
+            bx = serverRectangle.width - hx < 16 ? serverRectangle.width - hx : 16;
+            uint32_t * tile = base + hy * pitch + hx;
+            uint8_t mode;
+
+            result = 0;
+            if (Recv(vnc, &mode, 1) != 1) break;
+
+            if (mode & 1) {
+                // Raw tile, read in one go and copied into place
+                int row, rowlen = bx * bpp;
+                if (Recv(vnc, rawtile, rowlen * by) != rowlen * by) break;
+                SDL_LockMutex(vnc->mutex);
+                for (row = 0; row < by; row++) {
+                    if (bpp == 4) {
+                        memcpy(tile + row * pitch, rawtile + row * rowlen, rowlen);
+                    } else {
+                        vnc_expand_pixels(vnc, tile + row * pitch, rawtile + row * rowlen, bx);
                     }
                 }
-                if (result !=bytes_to_read) {
-                    DBERROR("Error on pixel data. Got %i of %i bytes.\n",result,bytes_to_read);
-                    return 0;
+                SDL_UnlockMutex(vnc->mutex);
+                result = 1;
+                continue;
+            }
+
+            if (mode & 2) {
+                if (Recv(vnc, pixel, bpp) != bpp) break;
+                background = vnc_pixel(vnc, pixel, bpp);
+            }
+            if (mode & 4) {
+                if (Recv(vnc, pixel, bpp) != bpp) break;
+                foreground = vnc_pixel(vnc, pixel, bpp);
+            }
+
+            int n = 0;
+            if (mode & 8) {
+                uint8_t count;
+                if (Recv(vnc, &count, 1) != 1) break;
+                // All subrects of the tile arrive in one read
+                int size = (mode & 16) ? bpp + 2 : 2;
+                if (Recv(vnc, subrects, count * size) != count * size) break;
+                unsigned char * sub = subrects;
+                uint32_t color = foreground;
+                int i;
+                for (i = 0; i < count; i++, sub += size) {
+                    if (mode & 16) {
+                        color = vnc_pixel(vnc, sub, bpp);
+                    }
+                    uint8_t xy = sub[size - 2], wh = sub[size - 1];
+                    int sx = xy >> 4, sy = xy & 0x0f;
+                    if (sx >= bx || sy >= by) continue;
+                    spans[n].x = sx;
+                    spans[n].y = sy;
+                    spans[n].w = sx + (wh >> 4) + 1 > bx ? bx - sx : (wh >> 4) + 1;
+                    spans[n].h = sy + (wh & 0x0f) + 1 > by ? by - sy : (wh & 0x0f) + 1;
+                    spans[n].color = color;
+                    n++;
                 }
-                trec.x=hx;
-                trec.y=hy;
-                trec.w=16;
-                trec.h=16;
-                SDL_BlitSurface(vnc->tilebuffer, NULL, vnc->scratchbuffer, &trec);
+            }
+
+            SDL_LockMutex(vnc->mutex);
+            SDL_LockSurface(vnc->framebuffer);
+            if (bx == 16 && by == 16) {
+                fill_tile16(tile, pitch, background);
             } else {
-                tSDL_vnc_serverHextileBg serverHextileBg;
-                tSDL_vnc_serverHextileFg serverHextileFg;
-                
-                // no raw data
-                if (serverHextile.mode & 2) {
-                    CHECKED_READ(vnc, &serverHextileBg, 4, "hextile background");
-                }
-                SDL_FillRect(vnc->tilebuffer,NULL,serverHextileBg.color);
-                if (serverHextile.mode & 4) {
-                    CHECKED_READ(vnc, &serverHextileFg, 4, "hextile foreground");
-                }
-                if (serverHextile.mode & 8) {
-                    tSDL_vnc_serverHextileSubrects serverHextileSubrects;
-                    CHECKED_READ(vnc, &serverHextileSubrects, 1, "hextile subrects");
-                    // Read subrects
-                    int num_subrectangles=0;
-                    while (num_subrectangles<serverHextileSubrects.number) {
-                        num_subrectangles++;
-                        // Check color mode
-                        if (serverHextile.mode & 16) {
-                            tSDL_vnc_serverHextileColored serverHextileColored;
-                            
-                            // Colored subrect
-                            CHECKED_READ(vnc, &serverHextileColored,6, "hextile color subrect data");
-                            vnc_hextile_to_sdl_rect(serverHextileColored.xy, serverHextileColored.wh, &srec);
-                            SDL_FillRect(vnc->tilebuffer,&srec,serverHextileColored.color);
-                        } else {
-                            // Non-colored Subrect
-                            tSDL_vnc_serverHextileRect serverHextileRect;
-                            CHECKED_READ(vnc, &serverHextileRect, 2, "hextile subrect data");
-                                // Render colored subrect
-                            vnc_hextile_to_sdl_rect(serverHextileRect.xy, serverHextileRect.wh, &srec);
-                            SDL_FillRect(vnc->tilebuffer,&srec,serverHextileFg.color);
-                        } // color mode check
-                    } // subrect loop
-                    //
-                } // have subrects
-                // Draw tile
-                trec.x=hx;
-                trec.y=hy;
-                trec.w=16;
-                trec.h=16;
-                SDL_BlitSurface(vnc->tilebuffer, NULL, vnc->scratchbuffer, &trec);
-            } // raw data csheck
+                vnc_fill_rect(tile, pitch, bx, by, background);
+            }
+            vnc_fill_spans(tile, pitch, spans, n);
+            SDL_UnlockSurface(vnc->framebuffer);
+            SDL_UnlockMutex(vnc->mutex);
+            result = 1;
         } // hx loop
     } // hy loop
-    //
-    blit_scratch(vnc,serverRectangle);
-    DBMESSAGE("Blitted Hextile pixels.\n");
+
+    SDL_LockMutex(vnc->mutex);
+    GrowUpdateRegion(vnc, &trec);
+    SDL_UnlockMutex(vnc->mutex);
+
+    if (!result) {
+        DBERROR("Read error on Hextile data.\n");
+        return 0;
+    }
+    DBMESSAGE("Rendered Hextile pixels.\n");
+    return 1;
+}
+
+
+static int ServerRectangle_HexTile(tSDL_vnc * vnc,
+                               tSDL_vnc_rect serverRectangle)
+{
+    switch (vnc->bpp) {
+    case 1:
+        return hextile_decode(vnc, serverRectangle, 1);
+    case 2:
+        return hextile_decode(vnc, serverRectangle, 2);
+    default:
+        return hextile_decode(vnc, serverRectangle, 4);
+    }
+}
+
+
+/* Replace the front buffers after a resize. Nothing is published until the
+   next update, and a front the application is still blitting is waited
+   for; blits are short and never wait for the decoder. */
+static int ResizeFrontBuffers(tSDL_vnc *vnc)
+{
+	int i;
+	vnc_atomic_store(&vnc->frontpublished, -1);
+	/* Blits only take the mutex to signal when they see frontwaiting, so
+	   one that lets go between our check and the wait still wakes us */
+	SDL_LockMutex(vnc->mutex);
+	vnc_atomic_store(&vnc->frontwaiting, 1);
+	while (vnc_atomic_load(&vnc->frontinuse) >= 0) SDL_CondWait(vnc->frontreleased, vnc->mutex);
+	vnc_atomic_store(&vnc->frontwaiting, 0);
+	SDL_UnlockMutex(vnc->mutex);
+	for (i = 0; i < VNC_FRONTBUFFERS; i++) {
+		SDL_FreeSurface(vnc->front[i].surface);
+		vnc->front[i].surface = NULL;
+	}
+	return CreateFrontBuffers(vnc);
+}
+
+/* Follow a change of the desktop size. What fits of the old framebuffer is
+   kept, the rest starts out black, and all of it counts as updated. The
+   next update request asks for the whole new desktop. */
+static int ResizeFramebuffer(tSDL_vnc *vnc, int width, int height)
+{
+	SDL_Surface *old = vnc->framebuffer;
+	SDL_Rect keep, dest;
+
+	if (width <= 0 || height <= 0 || width > VNC_MAXDESKTOP || height > VNC_MAXDESKTOP) {
+		DBERROR("Bad desktop size %ix%i.\n", width, height);
+		return 0;
+	}
+	if (width == old->w && height == old->h) return 1;
+	DBMESSAGE("Desktop resized from %ix%i to %ix%i.\n", old->w, old->h, width, height);
+
+	SDL_Surface *framebuffer = SDL_CreateRGBSurface(SDL_SWSURFACE,width,height,32,vnc->rmask,vnc->gmask,vnc->bmask,0);
+	if (framebuffer==NULL) {
+		DBERROR("Could not create %ix%i framebuffer.\n", width, height);
+		return 0;
+	}
+	SDL_SetAlpha(framebuffer,0,0);
+	keep.x = 0;
+	keep.y = 0;
+	keep.w = width < old->w ? width : old->w;
+	keep.h = height < old->h ? height : old->h;
+	dest = keep;
+	SDL_BlitSurface(old, &keep, framebuffer, &dest);
+
+	SDL_LockMutex(vnc->mutex);
+	vnc->framebuffer = framebuffer;
+	vnc->serverFormat.width = width;
+	vnc->serverFormat.height = height;
+	vnc->fbupdated = 0;
+	dest.x = 0;
+	dest.y = 0;
+	dest.w = width;
+	dest.h = height;
+	GrowUpdateRegion(vnc, &dest);
+
+	/* Continuous updates follow a visible area covering the old desktop
+	   to the new one, and stay inside it otherwise */
+	tSDL_vnc_rect *visible = &vnc->visiblearea;
+	if (visible->x == 0 && visible->y == 0 && visible->width == old->w && visible->height == old->h) {
+		visible->width = width;
+		visible->height = height;
+	}
+	if (visible->x >= width) visible->x = 0;
+	if (visible->y >= height) visible->y = 0;
+	if (visible->x + visible->width > width) visible->width = width - visible->x;
+	if (visible->y + visible->height > height) visible->height = height - visible->y;
+	vnc->visiblechanged = 1;
+	SDL_UnlockMutex(vnc->mutex);
+	SDL_FreeSurface(old);
+	if (vnc->doublebuffer && ResizeFrontBuffers(vnc) == 0) return 0;
+
+	vnc->updateRequest.incremental = 0;
+	vnc->updateRequest.rect.x = 0;
+	vnc->updateRequest.rect.y = 0;
+	vnc->updateRequest.rect.width = width;
+	vnc->updateRequest.rect.height = height;
+	vnc_rect_swap(&vnc->updateRequest.rect);
+	return 1;
+}
+
+
+/* DesktopSize: the rectangle's size is the new desktop, one screen */
+static int ServerRectangle_DesktopSize(tSDL_vnc * vnc, tSDL_vnc_rect rect)
+{
+    DBMESSAGE("DESKTOP pseudo-encoding: %ux%u\n", rect.width, rect.height);
+    if (ResizeFramebuffer(vnc, rect.width, rect.height) == 0) return 0;
+
+    SDL_LockMutex(vnc->mutex);
+    memset(&vnc->screens[0], 0, sizeof(tSDL_vnc_screen));
+    vnc->screens[0].width = rect.width;
+    vnc->screens[0].height = rect.height;
+    vnc->screencount = 1;
+    vnc_atomic_add(&vnc->desktopseq, 1);
+    SDL_UnlockMutex(vnc->mutex);
+    return 1;
+}
+
+
+/* ExtendedDesktopSize: x is the reason for the change, y the result of a
+   layout request of ours, and the size is that of the new desktop; the
+   screens follow */
+static int ServerRectangle_ExtendedDesktopSize(tSDL_vnc * vnc, tSDL_vnc_rect rect)
+{
+    unsigned char header[4];
+    unsigned char data[255 * 16];
+    tSDL_vnc_screen screens[VNC_MAXSCREENS];
+    int count, i;
+
+    DBMESSAGE("EXTENDED DESKTOP pseudo-encoding: %ux%u, reason %u, status %u\n", rect.width, rect.height, rect.x, rect.y);
+    CHECKED_READ(vnc, header, 4, "screen count");
+    count = header[0];
+    CHECKED_READ(vnc, data, count * 16, "screens");
+    if (rect.x == 1 && rect.y != 0) {
+        DBMESSAGE("Server refused the screen layout (status %u).\n", rect.y);
+    }
+
+    if (count > VNC_MAXSCREENS) count = VNC_MAXSCREENS;
+    for (i = 0; i < count; i++) {
+        memcpy(&screens[i], data + i * 16, 16);
+        screens[i].id = swap_32(screens[i].id);
+        screens[i].x = swap_16(screens[i].x);
+        screens[i].y = swap_16(screens[i].y);
+        screens[i].width = swap_16(screens[i].width);
+        screens[i].height = swap_16(screens[i].height);
+        screens[i].flags = swap_32(screens[i].flags);
+        DBMESSAGE("  screen %u @ %u,%u size %ux%u\n", screens[i].id, screens[i].x, screens[i].y, screens[i].width, screens[i].height);
+    }
+
+    if (ResizeFramebuffer(vnc, rect.width, rect.height) == 0) return 0;
+
+    SDL_LockMutex(vnc->mutex);
+    memcpy(vnc->screens, screens, count * sizeof(tSDL_vnc_screen));
+    vnc->screencount = count;
+    vnc_atomic_add(&vnc->desktopseq, 1);
+    SDL_UnlockMutex(vnc->mutex);
     return 1;
 }
 
@@ -527,7 +1145,7 @@ static int ServerRectangle_HexTile(tSDL_vnc * vnc,
 int ReadServerRectangle(tSDL_vnc * vnc,
                         tSDL_vnc_serverRectangle * serverRectangle)
 {
-    int result = Recv(vnc->socket,serverRectangle,12,0);
+    int result = Recv(vnc,serverRectangle,12);
     if (result!=12) return 0;
 
     vnc_rect_swap(&serverRectangle->rect);
@@ -535,7 +1153,10 @@ int ReadServerRectangle(tSDL_vnc * vnc,
 
     DBMESSAGE("    @ %u,%u size %u,%u encoding %u\n",serverRectangle->rect.x,serverRectangle->rect.y,serverRectangle->rect.width,serverRectangle->rect.height,serverRectangle->encoding);
     
-    /* Sanity check values */
+    /* Sanity check values; pseudo-encodings use the fields for other
+       things, and their sizes are checked where they are used (cursor.c,
+       ResizeFramebuffer()) */
+    if ((int32_t)serverRectangle->encoding < 0) return 1;
     if (serverRectangle->rect.x > vnc->serverFormat.width) {
         DBMESSAGE("Bad rectangle: x=%u setting to 0\n",serverRectangle->rect.x);
         serverRectangle->rect.x=0;
@@ -556,36 +1177,75 @@ int ReadServerRectangle(tSDL_vnc * vnc,
 }
 
 
-static int PrepScratchBuffer(tSDL_vnc *vnc, 
-                             tSDL_vnc_rect serverRectangle)
+#define SCRATCH_MINSIZE 4096
+
+/* Count work memory allocated while decoding; may be called from the
+   Tight worker threads */
+void CountAllocation(tSDL_vnc *vnc, size_t bytes)
 {
-    // Do we have a scratchbuffer
-    if (vnc->scratchbuffer) {
-        /* Check size */
-        // FIXME: This seems very wasteful. width and height of scratchbuffer
-        // is used, but should check if any benefits to not continuously redoing this.
-        // Or at least keep a few common sizes.
-        if ((vnc->scratchbuffer->w != serverRectangle.width) || 
-            (vnc->scratchbuffer->h != serverRectangle.height)) {
+    vnc_count_shared(&vnc->stats.allocations, 1);
+    vnc_count_shared(&vnc->stats.allocatedbytes, (uint64_t)bytes);
+}
 
-            DBMESSAGE("Deleting existing scratchbuffer. w=%d,h=%d\n", vnc->scratchbuffer->w, vnc->scratchbuffer->h);
-            SDL_FreeSurface(vnc->scratchbuffer);
-            vnc->scratchbuffer=NULL;
-        }
+
+/* Work memory of at least size bytes in one of the connection's scratch
+   slots, reused by later rectangles. Slots only grow, a size class (a
+   power of two from 4K) at a time, so once they fit the rectangles of a
+   session decoding allocates nothing. The contents do not survive
+   growing. Even a request for 0 bytes (an empty cursor) gets memory, so
+   NULL always means out of memory. */
+void *ScratchBuffer(tSDL_vnc *vnc, int slot, size_t size)
+{
+    if (vnc->scratch[slot] && size <= vnc->scratchsize[slot]) return vnc->scratch[slot];
+
+    size_t class = SCRATCH_MINSIZE;
+    while (class < size) class <<= 1;
+    free(vnc->scratch[slot]);
+    vnc->scratch[slot] = malloc(class);
+    if (!vnc->scratch[slot]) {
+        DBERROR("Out of memory for scratch buffer (%lu bytes).\n", (unsigned long)class);
+        vnc->scratchsize[slot] = 0;
+        return NULL;
     }
-    if (!(vnc->scratchbuffer)) {
-        // Create new scratchbuffer
-        vnc->scratchbuffer = SDL_CreateRGBSurface(SDL_SWSURFACE,serverRectangle.width,serverRectangle.height,32,vnc->rmask,vnc->gmask,vnc->bmask,0);
-        if (vnc->scratchbuffer) {
-            SDL_SetAlpha(vnc->scratchbuffer,0,0);
-            DBMESSAGE("Created new scratchbuffer w=%d,h=%d\n", serverRectangle.width, serverRectangle.height);
-        } else {
-            DBERROR("Error creating scratchbuffer.\n");
-            return 0;
-        }
+    DBMESSAGE("Scratch slot %i grown to %lu bytes.\n", slot, (unsigned long)class);
+    vnc->scratchsize[slot] = class;
+    CountAllocation(vnc, class);
+    return vnc->scratch[slot];
+}
+
+
+/* Encodings with a slot in vnc->stats.encodings, in the order vncGetStats()
+   documents */
+static const int32_t StatsEncodings[VNC_STATS_ENCODINGS] = { 0, 1, 2, 5, 7, 16, -239, -223, -308, -224 };
+
+static int StatsIndex(int32_t encoding)
+{
+    int i;
+    for (i = 0; i < VNC_STATS_ENCODINGS; i++) {
+        if (StatsEncodings[i] == encoding) return i;
     }
+    return -1;
+}
 
-    return 1;
+static void CountRectangle(tSDL_vnc *vnc, int32_t encoding, int pixels, unsigned long bytes, uint64_t decodetime)
+{
+    int i = StatsIndex(encoding);
+    if (i < 0) return;
+
+    tSDL_vnc_encodingStats *stats = &vnc->stats.encodings[i];
+    vnc_count(&stats->rects, 1);
+    if (encoding >= 0) vnc_count(&stats->pixels, pixels);
+    vnc_count(&stats->bytes, bytes);
+    vnc_count(&stats->decodetime, decodetime);
+}
+
+/* Decode time spent off the connection thread (the Tight workers), added
+   to rectangles already counted. Called by the connection thread. */
+void CountDecodeTime(tSDL_vnc *vnc, int32_t encoding, uint64_t decodetime)
+{
+    int i = StatsIndex(encoding);
+    if (i >= 0) vnc_count(&vnc->stats.encodings[i].decodetime, decodetime);
+    if (vnc->tuner) TunerRect(vnc, encoding, 0, 0, decodetime);
 }
 
 
@@ -593,10 +1253,13 @@ static int HandleServerMessage_update(tSDL_vnc *vnc)
 {
     DBMESSAGE("Message: update\n");
 	tSDL_vnc_serverUpdate serverUpdate;
-    CHECKED_READ(vnc, &serverUpdate, 3, "server update");
+    unsigned char header[3];
+    if (vnc->tuner) TunerUpdateStart(vnc);
+    CHECKED_READ(vnc, header, 3, "server update");
 
-    /* ??? Protocol sais U16, TightVNC server sends U8 */
-    serverUpdate.rectangles=serverUpdate.rectangles & 0x00ff;
+    /* Padding, then a big-endian U16 count; 0xffff with LastRect means
+       the count is not known up front */
+    serverUpdate.rectangles=(header[1] << 8) | header[2];
     DBMESSAGE("Number of rectangles: %u (%04x)\n",serverUpdate.rectangles,serverUpdate.rectangles);
     
     int num_rectangles=0;
@@ -609,38 +1272,64 @@ static int HandleServerMessage_update(tSDL_vnc *vnc)
             return 0;
         }
 
+        /* Queued Tight rectangles must land before anything else is drawn */
+        if (serverRectangle.encoding != 7 && tight_flush(vnc) == 0) return 0;
+
+        uint64_t rectstart = MonotonicMicroseconds();
+        uint64_t rectwait = vnc_counter(&vnc->stats.recvwait);
+        unsigned long rectbytes = vnc->recvconsumed;
+
         /* Rectangle Data */
         switch (serverRectangle.encoding) {
         case 0:
             if (ServerRectangle_Raw(vnc, serverRectangle.rect) == 0) return 0;
             break;
         case 1:
-            if (PrepScratchBuffer(vnc, serverRectangle.rect) == 0) return 0;
             if (ServerRectangle_CopyRect(vnc, serverRectangle.rect) == 0) return 0;
             break;
         case 2:
-            if (PrepScratchBuffer(vnc, serverRectangle.rect) == 0) return 0;
             if (ServerRectangle_RRE(vnc, serverRectangle.rect) == 0) return 0;
             break;
         case 5:
-            if (PrepScratchBuffer(vnc, serverRectangle.rect) == 0) return 0;
             if (ServerRectangle_HexTile(vnc, serverRectangle.rect) == 0) return 0;
             break;
+        case 7:
+            if (ServerRectangle_Tight(vnc, serverRectangle.rect) == 0) return 0;
+            break;
         case 16:
-            DBERROR("ZRLE encoding - ignored.\n");
-            return 0;
+            if (ServerRectangle_ZRLE(vnc, serverRectangle.rect) == 0) return 0;
             break;
             
         case 0xffffff11:
             if (ServerRectangle_Cursor(vnc, serverRectangle.rect) == 0) return 0;
             break;
             
+        case 0xffffff20:
+            DBMESSAGE("LASTRECT pseudo-encoding.\n");
+            num_rectangles=serverUpdate.rectangles;
+            break;
+
         case 0xffffff21:
-            DBMESSAGE("DESKTOP pseudo-encoding (ignored).\n");
+            if (ServerRectangle_DesktopSize(vnc, serverRectangle.rect) == 0) return 0;
+            break;
+
+        case 0xfffffecc:
+            if (ServerRectangle_ExtendedDesktopSize(vnc, serverRectangle.rect) == 0) return 0;
             break;
             
         }
+
+        /* Decode time is what the rectangle took less waiting for data */
+        uint64_t decodetime = MonotonicMicroseconds() - rectstart - (vnc_counter(&vnc->stats.recvwait) - rectwait);
+        int pixels = serverRectangle.rect.width * serverRectangle.rect.height;
+        CountRectangle(vnc, serverRectangle.encoding, pixels, vnc->recvconsumed - rectbytes, decodetime);
+        if (vnc->tuner) {
+            TunerRect(vnc, serverRectangle.encoding, pixels, vnc->recvconsumed - rectbytes, decodetime);
+        }
     } // while
+    if (tight_flush(vnc) == 0) return 0;
+    PublishFramebuffer(vnc);
+    if (vnc->tuner) TunerUpdateEnd(vnc);
     return 1;
 }
 
@@ -652,30 +1341,304 @@ static int HandleServerMessage_text(tSDL_vnc *vnc)
     DBMESSAGE("Message: text\n");
 	tSDL_vnc_serverText serverText;
 
-    CHECKED_READ(vnc, &serverText,5, "text");
-    serverText.length=swap_32(serverText.length);
+    CHECKED_READ(vnc, &serverText,5, "text");
+    serverText.length=swap_32(serverText.length);
+
+    DBMESSAGE("Server text length: %u\n",serverText.length);
+    // ??? Protocol sais U16 is length to read
+    // TightVNC server sends a byte on empty string
+    if (serverText.length==0) {
+            serverText.length=1;
+    }
+    while (serverText.length>0) {
+        int result = Recv(vnc,vnc->buffer,serverText.length % VNC_BUFSIZE);
+        if (result <= 0) {
+            serverText.length=0;
+        } else {
+            DBMESSAGE("Read %i bytes of text.\n",result);
+            serverText.length -= result;
+        }
+    }
+    return 0;
+}
+
+
+
+/* ContinuousUpdates states. The extension is running once the server has
+   confirmed it with an EndOfContinuousUpdates message. It is paused while
+   our fence takes too long to come back, i.e. too much is queued, and
+   resumed once both the fence and the server's acknowledgement of the
+   pause have arrived. */
+#define CU_OFF		0
+#define CU_REQUESTED	1
+#define CU_RUNNING	2
+#define CU_PAUSING	3
+#define CU_PAUSED	4
+
+#define FENCE_BLOCKBEFORE	0x00000001
+#define FENCE_BLOCKAFTER	0x00000002
+#define FENCE_SYNCNEXT		0x00000004
+#define FENCE_REQUEST		0x80000000
+
+static int SendContinuousUpdates(tSDL_vnc *vnc, int enable)
+{
+	tSDL_vnc_clientContinuousUpdates message;
+
+	message.messagetype = 150;
+	message.enable = enable;
+	SDL_LockMutex(vnc->mutex);
+	message.rect = vnc->visiblearea;
+	vnc->visiblechanged = 0;
+	SDL_UnlockMutex(vnc->mutex);
+	DBMESSAGE("%s continuous updates for %ix%i at %i,%i\n", enable ? "Enabling" : "Disabling",
+		message.rect.width, message.rect.height, message.rect.x, message.rect.y);
+	vnc_rect_swap(&message.rect);
+	if (Send(vnc,&message,10)!=10) {
+		DBERROR("Write error on continuous updates request.\n");
+		return 0;
+	}
+	return 1;
+}
+
+static int SendFence(tSDL_vnc *vnc, uint32_t flags, unsigned char *payload, int length)
+{
+	unsigned char message[9 + 64];
+
+	memset(message, 0, 4);
+	message[0] = 248;
+	flags = swap_32(flags);
+	memcpy(&message[4], &flags, 4);
+	message[8] = length;
+	memcpy(&message[9], payload, length);
+	if (Send(vnc,message,9 + length)!=9 + length) {
+		DBERROR("Write error on fence.\n");
+		return 0;
+	}
+	return 1;
+}
+
+static int HandleServerMessage_endOfContinuousUpdates(tSDL_vnc *vnc)
+{
+	DBMESSAGE("Message: end of continuous updates\n");
+	switch (vnc->continuous) {
+	case CU_REQUESTED:
+		// The server understands the extension, switch it on
+		if (SendContinuousUpdates(vnc, 1) == 0) return 0;
+		vnc->continuous = CU_RUNNING;
+		break;
+	case CU_RUNNING:
+		// Ended by the server, go back to requesting updates
+		vnc->continuous = CU_OFF;
+		vnc->nextrequest = MonotonicMicroseconds();
+		break;
+	case CU_PAUSING:
+		// Acknowledges our pause
+		vnc->continuous = CU_PAUSED;
+		if (!vnc->fencepending) {
+			if (SendContinuousUpdates(vnc, 1) == 0) return 0;
+			vnc->continuous = CU_RUNNING;
+		}
+		break;
+	}
+	return 1;
+}
+
+static int HandleServerMessage_fence(tSDL_vnc *vnc)
+{
+	unsigned char header[8];
+	unsigned char payload[64];
+	uint32_t flags;
+
+	DBMESSAGE("Message: fence\n");
+	CHECKED_READ(vnc, header, 8, "fence");
+	memcpy(&flags, &header[3], 4);
+	flags = swap_32(flags);
+	if (header[7] > 64) {
+		DBERROR("Fence payload too long (%u bytes).\n", header[7]);
+		return 0;
+	}
+	CHECKED_READ(vnc, payload, header[7], "fence payload");
+	vnc->fencesupported = 1;
+
+	if (flags & FENCE_REQUEST) {
+		// Messages are handled strictly in order, so every flag is honoured already
+		return SendFence(vnc, flags & (FENCE_BLOCKBEFORE | FENCE_BLOCKAFTER | FENCE_SYNCNEXT), payload, header[7]);
+	}
+
+	// Our own fence coming back, with its send time as payload
+	if (!vnc->fencepending || header[7] != sizeof(uint64_t)) return 1;
+	uint64_t sent;
+	memcpy(&sent, payload, sizeof(sent));
+	vnc->fencertt = MonotonicMicroseconds() - sent;
+	if (vnc->fencertmin == 0 || vnc->fencertt < vnc->fencertmin) vnc->fencertmin = vnc->fencertt;
+	vnc->fencepending = 0;
+	DBMESSAGE("Fence round trip %u us\n", (unsigned int)vnc->fencertt);
+
+	// Whatever was queued at the server has drained
+	if (vnc->continuous == CU_PAUSED) {
+		if (SendContinuousUpdates(vnc, 1) == 0) return 0;
+		vnc->continuous = CU_RUNNING;
+	}
+	return 1;
+}
+
+/* With continuous updates the server pushes and no requests are sent.
+   While updates arrive, a fence with its send time as payload goes out
+   once per frame; when it takes more than two frames longer than the
+   fastest round trip seen, updates are queueing up at the server and are
+   paused until it returns. */
+static int ScheduleContinuousUpdates(tSDL_vnc *vnc, uint64_t now)
+{
+	uint64_t interval = 1000000 / vnc->framerate;
+
+	if (vnc->continuous == CU_RUNNING && vnc->visiblechanged) {
+		if (SendContinuousUpdates(vnc, 1) == 0) return 0;
+	}
+	if (!vnc->fencesupported) return 1;
+
+	if (!vnc->fencepending) {
+		if (now < vnc->fencesent + interval || vnc->fenceseq == vnc->frameseq) return 1;
+		if (SendFence(vnc, FENCE_REQUEST, (unsigned char *)&now, sizeof(now)) == 0) return 0;
+		vnc->fencesent = now;
+		vnc->fenceseq = vnc->frameseq;
+		vnc->fencepending = 1;
+	} else if (vnc->continuous == CU_RUNNING && now - vnc->fencesent > vnc->fencertmin + 2 * interval) {
+		DBMESSAGE("Fence overdue, pausing continuous updates\n");
+		if (SendContinuousUpdates(vnc, 0) == 0) return 0;
+		vnc->continuous = CU_PAUSING;
+		vnc_count(&vnc->stats.fencepauses, 1);
+	}
+	return 1;
+}
+
+void vncSetVisibleArea(tSDL_vnc *vnc, int x, int y, int w, int h)
+{
+	if (!vnc || !vnc->mutex) return;
+	SDL_LockMutex(vnc->mutex);
+	vnc->visiblearea.x = x;
+	vnc->visiblearea.y = y;
+	vnc->visiblearea.width = w;
+	vnc->visiblearea.height = h;
+	vnc->visiblechanged = 1;
+	SDL_UnlockMutex(vnc->mutex);
+	WakeClient(vnc);
+}
+
+/* Send vnc->updateRequest and remember when, to measure the latency of the
+   answer. Updates are assumed to answer requests in order. Without
+   pipelining the server folds repeated requests into one pending request,
+   so only the first unanswered one is timed. */
+static int SendUpdateRequest(tSDL_vnc *vnc)
+{
+	int result = Send(vnc,&vnc->updateRequest,10);
+	if (result!=10) {
+		DBERROR("Write error on update request.\n");
+		return 0;
+	}
+	vnc_count(&vnc->stats.requests, 1);
+	vnc->updateRequest.incremental = 1;
+	if (vnc->pipeline == 0 && vnc->requestsinflight > 0) return 1;
+	if (vnc->requestsinflight == VNC_MAXPIPELINE) {
+		memmove(&vnc->requesttimes[0], &vnc->requesttimes[1], (VNC_MAXPIPELINE - 1) * sizeof(uint64_t));
+		vnc->requestsinflight--;
+	}
+	vnc->requesttimes[vnc->requestsinflight++] = MonotonicMicroseconds();
+	return 1;
+}
+
+/* Ask for the whole desktop again. The next scheduled request carries it,
+   but while continuous updates run none is scheduled, so it is sent right
+   away. */
+static int RequestRefresh(tSDL_vnc *vnc)
+{
+	vnc->updateRequest.incremental = 0;
+	vnc->updateRequest.rect.x = 0;
+	vnc->updateRequest.rect.y = 0;
+	vnc->updateRequest.rect.width = swap_16(vnc->serverFormat.width);
+	vnc->updateRequest.rect.height = swap_16(vnc->serverFormat.height);
+	if (vnc->continuous >= CU_RUNNING) return SendUpdateRequest(vnc);
+	return 1;
+}
+
+/* First byte of a framebuffer update: it answers the oldest request */
+static void UpdateArrived(tSDL_vnc *vnc)
+{
+	uint64_t now = MonotonicMicroseconds();
+
+	if (vnc->requestsinflight > 0) {
+		vnc->requestlatencylast = now - vnc->requesttimes[0];
+		vnc_count(&vnc->stats.requestlatency, vnc->requestlatencylast);
+		vnc_count_max(&vnc->stats.requestlatencymax, vnc->requestlatencylast);
+		vnc_count(&vnc->stats.requestsanswered, 1);
+		vnc->requestsinflight--;
+		memmove(&vnc->requesttimes[0], &vnc->requesttimes[1], vnc->requestsinflight * sizeof(uint64_t));
+	}
+
+	vnc->updateratecount++;
+	if (now - vnc->updateratestart >= 1000000) {
+		vnc_counter_set(&vnc->stats.updaterate, (vnc->updateratecount * 1000000ULL + (now - vnc->updateratestart) / 2) / (now - vnc->updateratestart));
+		vnc->updateratestart = now;
+		vnc->updateratecount = 0;
+	}
+}
+
+/* Send the encodings the tuner switched to, ahead of the next request */
+static int SendTunedEncodings(tSDL_vnc *vnc)
+{
+	unsigned char message[4 + 4 * VNC_MAXENCODINGS];
+	int len = TunerPendingEncodings(vnc, message);
+	if (len == 0) return 1;
+	int result = Send(vnc,message,len);
+	if (result!=len) {
+		DBERROR("Write error on encodings update.\n");
+		return 0;
+	}
+	DBMESSAGE("Encodings updated by the tuner\n");
+	return 1;
+}
 
-    DBMESSAGE("Server text length: %u\n",serverText.length);
-    // ??? Protocol sais U16 is length to read
-    // TightVNC server sends a byte on empty string
-    if (serverText.length==0) {
-            serverText.length=1;
-    }
-    while (serverText.length>0) {
-        int result = Recv(vnc->socket,vnc->buffer,serverText.length % VNC_BUFSIZE,0);
-        if (result <= 0) {
-            serverText.length=0;
-        } else {
-            DBMESSAGE("Read %i bytes of text.\n",result);
-            serverText.length -= result;
-        }
-    }
-    return 0;
+/* Issue the update requests that are due. Pipelining keeps up to
+   vnc->pipeline requests in flight, paced by vnc->maxrate; otherwise one
+   request goes out whenever the framerate timer expires without traffic
+   (idle). Returns 0 on a write error. */
+static int ScheduleUpdateRequests(tSDL_vnc *vnc, uint64_t now, int idle)
+{
+	if (vnc->tuner && SendTunedEncodings(vnc) == 0) return 0;
+	if (vnc->continuous >= CU_RUNNING) return ScheduleContinuousUpdates(vnc, now);
+	if (vnc->pipeline == 0) {
+		if (!idle) return 1;
+		vnc->nextrequest = now + 1000000 / vnc->framerate;
+		return SendUpdateRequest(vnc);
+	}
+	while (vnc->requestsinflight < vnc->pipeline && now >= vnc->nextrequest) {
+		if (SendUpdateRequest(vnc) == 0) return 0;
+		if (vnc->maxrate > 0) {
+			// Pace from the previous slot, so a late request does not shift the schedule
+			uint64_t interval = 1000000 / vnc->maxrate;
+			vnc->nextrequest = (vnc->nextrequest + interval > now ? vnc->nextrequest : now) + interval;
+		}
+	}
+	return 1;
 }
 
+/* Time at which ScheduleUpdateRequests() has work to do without any
+   traffic happening first, 0 if only traffic can create more work */
+uint64_t UpdateRequestDeadline(tSDL_vnc *vnc)
+{
+	uint64_t interval = 1000000 / vnc->framerate;
 
+	if (vnc->continuous >= CU_RUNNING) {
+		if (!vnc->fencesupported) return 0;
+		if (vnc->fencepending) {
+			return vnc->continuous == CU_RUNNING ? vnc->fencesent + vnc->fencertmin + 2 * interval + 1 : 0;
+		}
+		return vnc->fenceseq != vnc->frameseq ? vnc->fencesent + interval : 0;
+	}
+	if (vnc->pipeline > 0 && vnc->requestsinflight >= vnc->pipeline) return 0;
+	return vnc->nextrequest;
+}
 
-static int HandleServerMessage(tSDL_vnc *vnc)
+int HandleServerMessage(tSDL_vnc *vnc)
 {
 	tSDL_vnc_serverMessage serverMessage;
 	DBMESSAGE("HandleServerMessage\n");
@@ -683,21 +1646,36 @@ static int HandleServerMessage(tSDL_vnc *vnc)
 
     switch (serverMessage.messagetype) {
     case 0:
+        vnc_count(&vnc->stats.messages[0], 1);
+        UpdateArrived(vnc);
         if (HandleServerMessage_update(vnc) == 0) return 0;
         break;
 
     case 1:
+        vnc_count(&vnc->stats.messages[1], 1);
         if (HandleServerMessage_colormap(vnc) == 0) return 0;
         break;
 
     case 2:
+        vnc_count(&vnc->stats.messages[2], 1);
         DBMESSAGE("Message: bell - ignored\n");
         // we are done reading
         break;
 
     case 3:
+        vnc_count(&vnc->stats.messages[3], 1);
         if (HandleServerMessage_text(vnc) == 0) return 0;
         break;
+
+    case 150:
+        vnc_count(&vnc->stats.messages[4], 1);
+        if (HandleServerMessage_endOfContinuousUpdates(vnc) == 0) return 0;
+        break;
+
+    case 248:
+        vnc_count(&vnc->stats.messages[5], 1);
+        if (HandleServerMessage_fence(vnc) == 0) return 0;
+        break;
         
     default:
         DBERROR("Unknown message error: message=%u\n",serverMessage.messagetype);
@@ -717,17 +1695,101 @@ int HandleClientMessage(tSDL_vnc *vnc) {
 	return 0;
 }
 
+/* Get the connection going once the handshake is done */
+static int StartClient(tSDL_vnc *vnc)
+{
+	uint64_t now = MonotonicMicroseconds();
+	vnc->nextrequest = vnc->pipeline > 0 ? now : now + 1000000 / vnc->framerate;
+	vnc->updateratestart = now;
+	vnc->reading = 1;
+
+	// From here on the server's messages go through the parser, run by
+	// the thread driving the connection (see StartReceiving())
+	if (ParserCreate(vnc) == 0) return 0;
+	return ScheduleUpdateRequests(vnc, now, 0);
+}
+
+/* Receive what the server has sent and run the parser over it. The read
+   the parser is blocked on continues straight into its target (several
+   rows of it for Raw), so large rectangles skip the receive buffer. */
+static int ReceiveServerData(tSDL_vnc *vnc)
+{
+	if (vnc->uring) return UringReceive(vnc);
+
+	tSDL_vnc_iov targets[RECV_MAXIOV];
+	size_t direct;
+	int count = ParserTargets(vnc, targets, RECV_MAXIOV);
+	int result = RecvFill(vnc, targets, count, &direct);
+	if (result <= 0) {
+		DBERROR("vncClientThread: Read error on server data.\n");
+		return 0;
+	}
+	result = ParserFill(vnc, direct, vnc->recvbuffer + vnc->recvbufferpos, vnc->recvbufferlen - vnc->recvbufferpos);
+	vnc->recvbufferpos = vnc->recvbufferlen;
+	return result;
+}
+
+/* One round of client work after event, a WaitForMessage() result: send
+   queued input, parse what the server sent, then issue update requests that
+   are due (on a timeout, the ones only sent when idle). Shared by
+   vncClientThread and the event loop in loop.c. Returns 0 once the
+   connection is finished. */
+int ServiceConnection(tSDL_vnc *vnc, int event)
+{
+	if (event == WAIT_INPUT) DrainWakeup(vnc);
+
+	// Client Messages, sent whatever woke us up
+	if (FlushClientBuffer(vnc) == 0) return 0;
+
+	if (event == WAIT_SERVER) {
+		if (ReceiveServerData(vnc) == 0) return 0;
+	}
+
+	// Framebuffer update request
+	if (ScheduleUpdateRequests(vnc, MonotonicMicroseconds(), event <= 0) == 0) {
+		DBERROR("vncClientThread: Write error on update request.\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* Called by the thread driving the connection before it waits for server
+   data. The parser first runs here, over anything read along with the
+   handshake, so it is only ever resumed by this thread: a decoder may hold
+   the mutex across a read. io_uring requests belong to the thread that
+   submits them too: their completion work interrupts it and they are
+   cancelled when it exits, so the ring is set up here rather than by
+   vncConnect. Returns 0 if the connection is finished. */
+int StartReceiving(tSDL_vnc *vnc)
+{
+	int result = 1;
+
+	if (vnc->receiving) return 1;
+	vnc->receiving=1;
+	if (vnc->wanturing) {
+		vnc->wanturing=0;
+		if (UringCreate(vnc) == 0) {
+			DBMESSAGE("io_uring not available, receiving with recv().\n");
+		}
+	}
+	if (vnc->recvbufferpos < vnc->recvbufferlen) {
+		result = ParserFill(vnc, 0, vnc->recvbuffer + vnc->recvbufferpos, vnc->recvbufferlen - vnc->recvbufferpos);
+		vnc->recvbufferpos = vnc->recvbufferlen;
+	}
+	return result;
+}
+
 int vncClientThread (void *data) {
 	tSDL_vnc *vnc = (tSDL_vnc *)data;
+	uint64_t now, deadline;
 	unsigned int usvalue;
-	int result;
 
 	// Set framerate
 	DBMESSAGE("vncClientThread: Started, Polling updates at rate %iHz.\n",vnc->framerate);
 	usvalue = (unsigned int)1000000 / vnc->framerate;
+	vnc->reading = StartReceiving(vnc);
 
 	// Processing loop
-	vnc->reading = 1;
 	while (vnc->reading) {
 		//DBMESSAGE("vncClientThread: WaitForMessage...\n");
 		
@@ -736,34 +1798,13 @@ int vncClientThread (void *data) {
 			SDL_Delay(vnc->delay);
 		}
 		
-		if ((result = WaitForMessage(vnc,usvalue))<=0) {
-			// Client Messages
-			SDL_LockMutex(vnc->mutex);
-			if (vnc->clientbufferpos>0) {
-				result = send(vnc->socket,vnc->clientbuffer,vnc->clientbufferpos,0);
-				if (result==vnc->clientbufferpos) {
-					DBMESSAGE("vncClientThread: Client-to-Server data: %u bytes send\n",result);
-				} else {
-					DBERROR("vncClientThread: Write error on client-to-server data.\n");
-					vnc->reading=0;
-				}
-				vnc->clientbufferpos=0;
-			}
-			SDL_UnlockMutex(vnc->mutex);
-			
-			// Framebuffer update request
-			//DBMESSAGE("vncClientThread: Sending Update Request...\n",result);
-			result = send(vnc->socket,(const char *)&vnc->updateRequest,10,0);
-			if (result==10) {
-				//DBMESSAGE("vncClientThread: Incremental Framebuffer Update Request: send\n");
-			} else {
-				DBERROR("vncClientThread: Write error on update request.\n");
-				vnc->reading=0;
-			}
-		} else {
-			//DBMESSAGE("vncClientThread: HandleServerMessage()...\n");
-			vnc->reading = HandleServerMessage(vnc);
+		// Wake-ups for input must not push back the next update request
+		now = MonotonicMicroseconds();
+		deadline = UpdateRequestDeadline(vnc);
+		if (deadline == 0) {
+			deadline = now + usvalue;
 		}
+		vnc->reading = ServiceConnection(vnc, WaitForMessage(vnc, deadline > now ? (unsigned int)(deadline - now) : 0));
 	}
 
 	DBMESSAGE("vncClientThread: VNC client thread done.\n");
@@ -776,10 +1817,21 @@ int vncClientThread (void *data) {
 // ================
 
 
+/* Append an encoding to the SetEncodings message being built in buffer */
+static void AddEncoding(unsigned char *buffer, int32_t encoding)
+{
+	buffer[3]++;
+	buffer[0+4*buffer[3]]=(encoding >> 24) & 0xff;
+	buffer[1+4*buffer[3]]=(encoding >> 16) & 0xff;
+	buffer[2+4*buffer[3]]=(encoding >> 8) & 0xff;
+	buffer[3+4*buffer[3]]=encoding & 0xff;
+}
+
+
 
 static int vncReadServerFormat(tSDL_vnc *vnc) {
     // Server Initialiazation
-    int result = Recv(vnc->socket,&vnc->serverFormat,24,0);
+    int result = Recv(vnc,&vnc->serverFormat,24);
     if (result==24) {
         // Swap format numbers
         vnc->serverFormat.width      =swap_16(vnc->serverFormat.width);
@@ -809,13 +1861,19 @@ static int vncReadServerFormat(tSDL_vnc *vnc) {
 
 	
     
+    if (vnc->serverFormat.width==0 || vnc->serverFormat.height==0 ||
+        vnc->serverFormat.width>VNC_MAXDESKTOP || vnc->serverFormat.height>VNC_MAXDESKTOP) {
+        DBERROR("Bad desktop size %ux%u.\n",vnc->serverFormat.width,vnc->serverFormat.height);
+        return 0;
+    }
+
     // Desktop Name
     if (vnc->serverFormat.namelength>(VNC_BUFSIZE-1)) {
         DBERROR("Desktop name too long: %i\n",vnc->serverFormat.namelength);
         return 0;
     }
     if (vnc->serverFormat.namelength>1) {
-        result = Recv(vnc->socket,vnc->serverFormat.name,vnc->serverFormat.namelength,0);
+        result = Recv(vnc,vnc->serverFormat.name,vnc->serverFormat.namelength);
         if (result==vnc->serverFormat.namelength) {
             vnc->serverFormat.name[vnc->serverFormat.namelength]=0;
             DBMESSAGE("Desktop name: %s\n",vnc->serverFormat.name);
@@ -831,43 +1889,85 @@ static int vncReadServerFormat(tSDL_vnc *vnc) {
 }
 
 
-int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password, int framerate) {
-	struct sockaddr_in address;
-	int result;
-	unsigned char *curpos, *newpos, *modestring;
-	unsigned int security_result;
-	unsigned char security_key[8];
-	unsigned char security_challenge[16];
-	unsigned char security_response[16];
-	tSDL_vnc_pixelFormat pixel_format;
-	struct hostent *he;
-	struct in_addr **addr_list;
-	int i = -1;
+/* Allocate the buffers of a connection and reset its state */
+static int InitConnection(tSDL_vnc *vnc, int framerate)
+{
+	int i;
 
-	// Initialize variables
+	// Initialize variables; -1 is no socket
+	vnc->socket=-1;
 	vnc->buffer=(unsigned char *)malloc(VNC_BUFSIZE);
 	if (!vnc->buffer) {
 		DBERROR("Out of memory allocating workbuffer.\n");
 		return 0;
 	}
 	vnc->clientbuffer=(char *)malloc(VNC_BUFSIZE);
-	if (!vnc->clientbuffer) {
+	vnc->clientbuffersize=VNC_BUFSIZE;
+	vnc->clientspare=(char *)malloc(VNC_BUFSIZE);
+	vnc->clientsparesize=VNC_BUFSIZE;
+	if (!vnc->clientbuffer || !vnc->clientspare) {
 		DBERROR("Out of memory allocating clientbuffer.\n");
 		return 0;
 	}
+	vnc->recvbuffer=(unsigned char *)malloc(VNC_RECVBUFSIZE);
+	if (!vnc->recvbuffer) {
+		DBERROR("Out of memory allocating recvbuffer.\n");
+		return 0;
+	}
+	vnc->recvbufferpos=0;
+	vnc->recvbufferlen=0;
+	vnc->recvrequests=0;
+	vnc->recvconsumed=0;
+	memset(&vnc->stats, 0, sizeof(vnc->stats));
+	for (i=0; i<VNC_STATS_ENCODINGS; i++) vnc->stats.encodings[i].encoding=StatsEncodings[i];
 	vnc->framebuffer=NULL;
-	vnc->scratchbuffer=NULL;
-	vnc->tilebuffer=NULL;
+	vnc->desktopseq=0;
+	vnc->screencount=0;
+	memset(vnc->scratch, 0, sizeof(vnc->scratch));
+	memset(vnc->scratchsize, 0, sizeof(vnc->scratchsize));
 	vnc->cursorbuffer=NULL;
-
-    DBMESSAGE("Allocating %ld bytes for rawbuffer\n", RAWBUFFER_WIDTH * 4 * RAWBUFFER_HEIGHT);
-    vnc->rawbuffer = malloc(RAWBUFFER_WIDTH * 4 * RAWBUFFER_HEIGHT);
+	vnc->zrle=NULL;
+	vnc->tight=NULL;
+	vnc->cursor=NULL;
+	vnc->tuner=NULL;
+	vnc->wanturing=0;
+	vnc->receiving=0;
+	vnc->decodethreads=0;
+	vnc->bpp=4;
+	vnc->colormap=0;
+	vnc->doublebuffer=0;
+	vnc->pipeline=0;
+	vnc->continuous=CU_OFF;
+	vnc->fenceseq=0;
+	vnc->visiblechanged=0;
+	vnc->fencesupported=0;
+	vnc->fencepending=0;
+	vnc->fencesent=0;
+	vnc->fencertt=0;
+	vnc->fencertmin=0;
+	vnc->requestsinflight=0;
+	vnc->updateratecount=0;
+	vnc->requestlatencylast=0;
+	vnc->frameseq=0;
+	vnc->blitseq=0;
+	memset(vnc->front, 0, sizeof(vnc->front));
 
 	vnc->fbupdated=0;
+	vnc->damagecount=0;
+	vnc->fed=0;
+	vnc->feeddamagecount=0;
 	vnc->gotcursor=0;
 	vnc->mutex=SDL_CreateMutex();
+	vnc->frontreleased=SDL_CreateCond();
+	vnc->frontwaiting=0;
 	vnc->thread=NULL;
 	vnc->clientbufferpos=0;
+	vnc->lastpointer=-1;
+	vnc->pointermask=-1;
+	vnc->inputpending=0;
+	vnc->inputqueued=0;
+	vnc->inputqueuedsum=0;
+	CreateWakeup(vnc);
 	vnc->delay=0;
 
 	// Set framerate
@@ -878,10 +1978,221 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
 	} else {
 		vnc->framerate=framerate;
 	}
+	vnc->maxrate=vnc->framerate;
+	return 1;
+}
+
+/* Apply the options of a mode string (see vncConnect) and build the
+   SetEncodings message it asks for in vnc->buffer */
+static void ParseMode(tSDL_vnc *vnc, char *mode, int *nothread, int *autotune)
+{
+	unsigned char *curpos, *newpos, *modestring;
+	int i;
+
+	// Set encodings
+	memset(vnc->buffer,0,VNC_BUFSIZE);
+	vnc->buffer[0]=2; // message type
+	// Count number of encodings
+	vnc->buffer[3]=0; // number of encodings
+	modestring=(unsigned char *)strdup(mode);
+	curpos=modestring;
+	while ((curpos) && (*curpos)) {
+		if (strncasecmp((const char *)curpos,"raw",3)==0) {
+			DBMESSAGE("Requesting mode: RAW\n");
+			AddEncoding(vnc->buffer,0);
+		} else
+		if (strncasecmp((const char *)curpos,"copyrect",8)==0) {
+			DBMESSAGE("Requesting mode: COPYRECT\n");
+			AddEncoding(vnc->buffer,1);
+		} else
+		if (strncasecmp((const char *)curpos,"rre",3)==0) {
+			DBMESSAGE("Requesting mode: RRE\n");
+			AddEncoding(vnc->buffer,2);
+		} else
+		if (strncasecmp((const char *)curpos,"hextile",7)==0) {
+			DBMESSAGE("Requesting mode: HEXTILE\n");
+			AddEncoding(vnc->buffer,5);
+		} else
+		if (strncasecmp((const char *)curpos,"zrle",4)==0) {
+			DBMESSAGE("Requesting mode: ZRLE\n");
+			AddEncoding(vnc->buffer,16);
+		} else
+		if (strncasecmp((const char *)curpos,"tight",5)==0) {
+			DBMESSAGE("Requesting mode: TIGHT\n");
+			AddEncoding(vnc->buffer,7);
+		} else
+		if (strncasecmp((const char *)curpos,"compress=",9)==0) {
+			DBMESSAGE("Requesting pseudoencoding: COMPRESSION LEVEL %i\n",atoi((const char *)curpos+9));
+			AddEncoding(vnc->buffer,-256+(atoi((const char *)curpos+9) & 0x0f));
+		} else
+		if (strncasecmp((const char *)curpos,"quality=",8)==0) {
+			DBMESSAGE("Requesting pseudoencoding: JPEG QUALITY %i\n",atoi((const char *)curpos+8));
+			AddEncoding(vnc->buffer,-32+(atoi((const char *)curpos+8) & 0x0f));
+		} else
+		if (strncasecmp((const char *)curpos,"colormap",8)==0) {
+			vnc->bpp=1;
+			vnc->colormap=1;
+			DBMESSAGE("Requesting colour map\n");
+		} else
+		if (strncasecmp((const char *)curpos,"bpp=",4)==0) {
+			vnc->bpp=atoi((const char *)curpos+4)/8;
+			vnc->colormap=0;
+			if (vnc->bpp!=1 && vnc->bpp!=2) vnc->bpp=4;
+			DBMESSAGE("Requesting %i bits per pixel\n",vnc->bpp*8);
+		} else
+		if (strncasecmp((const char *)curpos,"threads=",8)==0) {
+			vnc->decodethreads=atoi((const char *)curpos+8);
+			if (vnc->decodethreads<0) vnc->decodethreads=0;
+			DBMESSAGE("Decoding on %i worker threads\n",vnc->decodethreads);
+		} else
+		if (strncasecmp((const char *)curpos,"pipeline",8)==0) {
+			vnc->pipeline = curpos[8]=='=' ? atoi((const char *)curpos+9) : 1;
+			if (vnc->pipeline<1) vnc->pipeline=1;
+			if (vnc->pipeline>VNC_MAXPIPELINE) vnc->pipeline=VNC_MAXPIPELINE;
+			DBMESSAGE("Pipelining %i update requests\n", vnc->pipeline);
+		} else
+		if (strncasecmp((const char *)curpos,"maxrate=",8)==0) {
+			vnc->maxrate=atoi((const char *)curpos+8);
+			if (vnc->maxrate<0) vnc->maxrate=0;
+		} else
+		if (strncasecmp((const char *)curpos,"continuous",10)==0) {
+			DBMESSAGE("Requesting pseudoencodings: CONTINUOUSUPDATES, FENCE\n");
+			AddEncoding(vnc->buffer,-313);
+			AddEncoding(vnc->buffer,-312);
+			vnc->continuous=CU_REQUESTED;
+		} else
+		if (strncasecmp((const char *)curpos,"nothread",8)==0) {
+			*nothread=1;
+		} else
+		if (strncasecmp((const char *)curpos,"uring",5)==0) {
+			vnc->wanturing=1;
+		} else
+		if (strncasecmp((const char *)curpos,"doublebuffer",12)==0) {
+			DBMESSAGE("Publishing updates through front buffers\n");
+			vnc->doublebuffer=1;
+		} else
+		if (strncasecmp((const char *)curpos,"cursor",6)==0) {
+			DBMESSAGE("Requesting pseudoencoding: CURSOR\n");
+			AddEncoding(vnc->buffer,-239);
+		} else
+		if (strncasecmp((const char *)curpos,"desktop",7)==0) {
+			DBMESSAGE("Requesting pseudoencodings: EXTENDEDDESKTOPSIZE, DESKTOP\n");
+			AddEncoding(vnc->buffer,-308);
+			AddEncoding(vnc->buffer,-223);
+		} else
+		if (strncasecmp((const char *)curpos,"auto",4)==0) {
+			DBMESSAGE("Tuning encodings by measured cost\n");
+			*autotune=1;
+		} else {
+			DBERROR("Unknown mode.\n");
+		}
+		if ((newpos=(unsigned char *)strstr((const char *)curpos,","))) {
+			curpos=newpos+1;
+		} else {
+			*curpos=0;
+		}
+	}
+	if (modestring) free(modestring);
+	// Lets the server send rectangles before it knows how many there are
+	DBMESSAGE("Requesting pseudoencoding: LASTRECT\n");
+	AddEncoding(vnc->buffer,-224);
+	vnc->encodingcount=0;
+	for (i=0; i<vnc->buffer[3] && i<VNC_MAXENCODINGS; i++) {
+		unsigned char *e=vnc->buffer+4+4*i;
+		vnc->encodings[vnc->encodingcount++]=(int32_t)(((uint32_t)e[0]<<24) | (e[1]<<16) | (e[2]<<8) | e[3]);
+	}
+}
+
+/* The wire pixel format the mode asked for */
+static void ModePixelFormat(tSDL_vnc *vnc)
+{
+	PixelFormatFor(vnc->bpp*8,&vnc->pixelformat);
+	if (vnc->colormap) {
+		memset(&vnc->pixelformat,0,sizeof(vnc->pixelformat));
+		vnc->pixelformat.bpp=8;
+		vnc->pixelformat.depth=8;
+	}
+}
+
+/* Create the framebuffer and what goes with it for the desktop size in
+   vnc->serverFormat and the wire format in vnc->pixelformat */
+static int CreateFramebuffer(tSDL_vnc *vnc, int autotune)
+{
+	// Create framebuffer
+	#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+		DBMESSAGE("Client is: big-endian\n");
+		vnc->rmask = 0xff000000;
+		vnc->gmask = 0x00ff0000;
+		vnc->bmask = 0x0000ff00;
+		vnc->amask = 0x000000ff;
+	#else
+		// Pre
+		DBMESSAGE("Client is: little-endian\n");
+		//@FIXME: Strange... Palm Pre needs reversed R <-> B order! Maybe check "if(SDL_BYTEORDER == SDL_LIL_ENDIAN)"
+		vnc->rmask = 0x00ff0000;
+		vnc->gmask = 0x0000ff00;
+		vnc->bmask = 0x000000ff;
+		vnc->amask = 0xff000000;
+
+	#endif
+	PixelFormatTables(vnc);
+	if (autotune && TunerCreate(vnc) == 0) return 0;
+	vnc->framebuffer = SDL_CreateRGBSurface(SDL_SWSURFACE,vnc->serverFormat.width,vnc->serverFormat.height,32,vnc->rmask,vnc->gmask,vnc->bmask,0);
+	SDL_SetAlpha(vnc->framebuffer,0,0);
+	if (vnc->framebuffer==NULL) {
+		DBERROR("Could not create framebuffer.\n");
+		return 0;
+	} else {
+		DBMESSAGE("Framebuffer created.\n");
+	}
+
+	// One screen covering the desktop until the server tells otherwise
+	memset(&vnc->screens[0], 0, sizeof(tSDL_vnc_screen));
+	vnc->screens[0].width=vnc->serverFormat.width;
+	vnc->screens[0].height=vnc->serverFormat.height;
+	vnc->screencount=1;
+
+	if (vnc->doublebuffer && CreateFrontBuffers(vnc) == 0) return 0;
+
+	// Initial fb update flag is whole screen
+	vnc->fbupdated=0;
+	vnc->updatedRect.x=0;
+	vnc->updatedRect.y=0;
+	vnc->updatedRect.w=vnc->serverFormat.width;
+	vnc->updatedRect.h=vnc->serverFormat.height;
+
+	// Create initial 32x32 cursorbuffer (with alpha), grown by cursor.c as needed
+	vnc->cursorbuffer = SDL_CreateRGBSurface(SDL_SWSURFACE,32,32,32,vnc->rmask,vnc->gmask,vnc->bmask,vnc->amask);
+	SDL_SetAlpha(vnc->cursorbuffer,SDL_SRCALPHA,0);
+	if (vnc->cursorbuffer==NULL) {
+		DBERROR("Could not create cursorbuffer.\n");
+		return 0;
+	} else {
+		DBMESSAGE("Cursorbuffer created.\n");
+	}
+	return 1;
+}
+
+
+int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password, int framerate) {
+	struct sockaddr_in address;
+	int result;
+	unsigned int security_result;
+	unsigned char security_key[8];
+	unsigned char security_challenge[16];
+	unsigned char security_response[16];
+	tSDL_vnc_pixelFormat pixel_format;
+	struct hostent *he;
+	struct in_addr **addr_list;
+	int i = -1;
+	int nothread = 0;
+	int autotune = 0;
+
+	if (InitConnection(vnc, framerate) == 0) return 0;
 
 	// Connect
 	DBMESSAGE("Creating socket...");
-	if ((vnc->socket = socket(AF_INET,SOCK_STREAM,0)) > 0) {
+	if ((vnc->socket = socket(AF_INET,SOCK_STREAM,0)) >= 0) {
 		DBMESSAGE("Converting address...\n");
 		address.sin_family = AF_INET;
 		address.sin_port = htons(port);
@@ -917,7 +2228,7 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
 			// Server startup
 			
 			// Version handshaking
-			result = Recv(vnc->socket,vnc->buffer,12,0);
+			result = Recv(vnc,vnc->buffer,12);
 			if (result==12) {
 				vnc->buffer[12]=0;
 				DBMESSAGE("Server Version: %s",vnc->buffer);
@@ -937,7 +2248,7 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
 			}
 			
 			// Send same version back
-			result = send(vnc->socket,vnc->buffer,12,0);
+			result = Send(vnc,vnc->buffer,12);
 			if (result==12) {
 				DBMESSAGE("Requested Version (clone): %s",vnc->buffer);
 			} else {
@@ -959,7 +2270,7 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
 				DBMESSAGE("Security: VNC Authentication\n");
 				
 				// Security Handshaking
-				result = Recv(vnc->socket,&security_challenge,16,0);
+				result = Recv(vnc,&security_challenge,16);
 				if (result==16) {
 					DBMESSAGE("Security Challenge: received\n");
 				} else {
@@ -975,7 +2286,7 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
 				des(&security_challenge[8],&security_response[8]);
 				
 				// Send response
-				result = send(vnc->socket,(char *)security_response,16,0);
+				result = Send(vnc,security_response,16);
 				if (result==16) {
 					DBMESSAGE("Security Response: sent\n");
 				} else {
@@ -984,7 +2295,7 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
 				}
 				
 				// Security Result
-				result = Recv(vnc->socket,vnc->buffer,4,0);
+				result = Recv(vnc,vnc->buffer,4);
 				if (result==4) {
 					security_result=vnc->buffer[0];
 					DBMESSAGE("Security Result: %i\n",security_result);
@@ -1005,7 +2316,7 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
 			
 			// Send Client Initialization
 			vnc->buffer[0]=1;
-			result = send(vnc->socket,vnc->buffer,1,0);
+			result = Send(vnc,vnc->buffer,1);
 			if (result==1) {
 				DBMESSAGE("Client Initialization: shared\n");
 			} else {
@@ -1015,90 +2326,8 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
 			
             if (vncReadServerFormat(vnc) == 0) return 0;
 
-			// Set pixel format
-			memset(vnc->buffer,0,20);
-			vnc->buffer[0]=0;
-			pixel_format.bpp=32;
-			pixel_format.depth=32;
-			pixel_format.bigendian=0;
-			pixel_format.truecolor=1;
-			pixel_format.redmax=swap_16(255);
-			pixel_format.greenmax=swap_16(255);
-			pixel_format.bluemax=swap_16(255);
-
-            /* FIXME: These depends on endianness; current values below works for
-               little endian */
-			pixel_format.redshift=16; // Was 0, which doesn't match vnc->rmask
-			pixel_format.greenshift=8;
-			pixel_format.blueshift=0; // Was 16, which doesn't match vnc->bmask
-			memcpy((void *)&vnc->buffer[4],(void *)&pixel_format,16);
-			result = send(vnc->socket,vnc->buffer,20,0);
-			if (result == 20) {
-				DBMESSAGE("Pixel format set.\n");
-			} else {
-				DBERROR("Error setting pixel format.\n");
-				return(0);
-			}
-
-			// Set encodings
-			memset(vnc->buffer,0,VNC_BUFSIZE);
-			vnc->buffer[0]=2; // message type
-			// Count number of encodings
-			vnc->buffer[3]=0; // number of encodings
-			modestring=(unsigned char *)strdup(mode);
-			curpos=modestring;
-			while ((curpos) && (*curpos)) {
-				if (strncasecmp((const char *)curpos,"raw",3)==0) {
-					DBMESSAGE("Requesting mode: RAW\n");
-					vnc->buffer[3]++;
-					vnc->buffer[3+4*vnc->buffer[3]]=0;
-				} else
-				if (strncasecmp((const char *)curpos,"copyrect",8)==0) {
-					DBMESSAGE("Requesting mode: COPYRECT\n");
-					vnc->buffer[3]++;
-					vnc->buffer[3+4*vnc->buffer[3]]=1;
-				} else
-				if (strncasecmp((const char *)curpos,"rre",3)==0) {
-					DBMESSAGE("Requesting mode: RRE\n");
-					vnc->buffer[3]++;
-					vnc->buffer[3+4*vnc->buffer[3]]=2;
-				} else
-				if (strncasecmp((const char *)curpos,"hextile",7)==0) {
-					DBMESSAGE("Requesting mode: HEXTILE\n");
-					vnc->buffer[3]++;
-					vnc->buffer[3+4*vnc->buffer[3]]=5;
-				} else
-				if (strncasecmp((const char *)curpos,"zrle",4)==0) {
-					DBMESSAGE("Requesting mode: ZRLE\n");
-					vnc->buffer[3]++;
-					vnc->buffer[3+4*vnc->buffer[3]]=16;
-				} else
-				if (strncasecmp((const char *)curpos,"cursor",6)==0) {
-					DBMESSAGE("Requesting pseudoencoding: CURSOR\n");
-					vnc->buffer[3]++;
-					vnc->buffer[0+4*vnc->buffer[3]]=0xff;
-					vnc->buffer[1+4*vnc->buffer[3]]=0xff;
-					vnc->buffer[2+4*vnc->buffer[3]]=0xff;
-					vnc->buffer[3+4*vnc->buffer[3]]=0x11;
-				} else
-				if (strncasecmp((const char *)curpos,"desktop",7)==0) {
-					DBMESSAGE("Requesting pseudoencoding: DESKTOP\n");
-					vnc->buffer[3]++;
-					vnc->buffer[0+4*vnc->buffer[3]]=0xff;
-					vnc->buffer[1+4*vnc->buffer[3]]=0xff;
-					vnc->buffer[2+4*vnc->buffer[3]]=0xff;
-					vnc->buffer[3+4*vnc->buffer[3]]=0x21;
-				} else {
-					DBERROR("Unknown mode.\n");
-				}
-				if ((newpos=(unsigned char *)strstr((const char *)curpos,","))) {
-					curpos=newpos+1;
-				} else {
-					*curpos=0;
-				}
-			}
-			if (modestring) free(modestring);
-			result = send(vnc->socket,vnc->buffer,4+4*vnc->buffer[3],0);
+			ParseMode(vnc, mode, &nothread, &autotune);
+			result = Send(vnc,vnc->buffer,4+4*vnc->buffer[3]);
 			if (result==(4+4*vnc->buffer[3])) {
 				DBMESSAGE("Mode request: send\n");
 			} else {
@@ -1106,48 +2335,24 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
 				return 0;
 			}
 
-			// Create framebuffer
-			#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-				DBMESSAGE("Client is: big-endian\n");
-				vnc->rmask = 0xff000000;
-				vnc->gmask = 0x00ff0000;
-				vnc->bmask = 0x0000ff00;
-				vnc->amask = 0x000000ff;
-			#else
-				// Pre
-				DBMESSAGE("Client is: little-endian\n");
-				//@FIXME: Strange... Palm Pre needs reversed R <-> B order! Maybe check "if(SDL_BYTEORDER == SDL_LIL_ENDIAN)"
-				vnc->rmask = 0x00ff0000;
-				vnc->gmask = 0x0000ff00;
-				vnc->bmask = 0x000000ff;
-				vnc->amask = 0xff000000;
-
-			#endif
-			vnc->framebuffer = SDL_CreateRGBSurface(SDL_SWSURFACE,vnc->serverFormat.width,vnc->serverFormat.height,32,vnc->rmask,vnc->gmask,vnc->bmask,0);
-			SDL_SetAlpha(vnc->framebuffer,0,0);
-			if (vnc->framebuffer==NULL) {
-				DBERROR("Could not create framebuffer.\n");
-				return 0;
+			// Set pixel format, as chosen by the mode
+			ModePixelFormat(vnc);
+			pixel_format=vnc->pixelformat;
+			pixel_format.redmax=swap_16(pixel_format.redmax);
+			pixel_format.greenmax=swap_16(pixel_format.greenmax);
+			pixel_format.bluemax=swap_16(pixel_format.bluemax);
+			memset(vnc->buffer,0,20);
+			vnc->buffer[0]=0;
+			memcpy((void *)&vnc->buffer[4],(void *)&pixel_format,16);
+			result = Send(vnc,vnc->buffer,20);
+			if (result == 20) {
+				DBMESSAGE("Pixel format set: %i bpp.\n",vnc->bpp*8);
 			} else {
-				DBMESSAGE("Framebuffer created.\n");
+				DBERROR("Error setting pixel format.\n");
+				return(0);
 			}
 
-			// Initial fb update flag is whole screen
-			vnc->fbupdated=0;
-			vnc->updatedRect.x=0;
-			vnc->updatedRect.y=0;
-			vnc->updatedRect.w=vnc->serverFormat.width;
-			vnc->updatedRect.h=vnc->serverFormat.height;
-
-			// Create 32x32 cursorbuffer (with alpha)
-			vnc->cursorbuffer = SDL_CreateRGBSurface(SDL_SWSURFACE,32,32,32,vnc->rmask,vnc->gmask,vnc->bmask,vnc->amask);
-			SDL_SetAlpha(vnc->cursorbuffer,SDL_SRCALPHA,0);
-			if (vnc->cursorbuffer==NULL) {
-				DBERROR("Could not create cursorbuffer.\n");
-				return 0;
-			} else {
-				DBMESSAGE("Cursorbuffer created.\n");
-			}
+			if (CreateFramebuffer(vnc, autotune) == 0) return 0;
 
 			// Create standard update request
 			vnc->updateRequest.messagetype = 3;
@@ -1159,18 +2364,29 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
             vnc_rect_swap(&vnc->updateRequest.rect);
 
 			// Initial framebuffer update request
-			result = send(vnc->socket,(const char *)&vnc->updateRequest,10,0);
-			if (result==10) {
+			if (SendUpdateRequest(vnc)) {
 				DBMESSAGE("Initial Framebuffer Update Request: send\n");
 			} else {
 				DBERROR("Write error on initial update request.\n");
 				return 0;
 			}
 
+			// Continuous updates cover the whole framebuffer until told otherwise
+			vnc->visiblearea.x=0;
+			vnc->visiblearea.y=0;
+			vnc->visiblearea.width=vnc->serverFormat.width;
+			vnc->visiblearea.height=vnc->serverFormat.height;
+
 			// Modify update request for incremental updates
 			vnc->updateRequest.incremental = 1;
 
-			// Start client thread
+			if (StartClient(vnc) == 0) return 0;
+
+			// Start client thread, unless an event loop will drive the connection
+			if (nothread) {
+				DBMESSAGE("Leaving connection to an event loop.\n");
+				return 1;
+			}
 			DBMESSAGE("Starting Thread...\n");
 			vnc->thread =  SDL_CreateThread(vncClientThread,(void *)vnc);
 			return 1;
@@ -1185,7 +2401,147 @@ int vncConnect(tSDL_vnc *vnc, char *host, int port, char *mode, char *password,
 	}
 }
 
+int vncParserOpen(tSDL_vnc *vnc, int width, int height, tSDL_vnc_pixelFormat *format, char *mode) {
+	int nothread = 0;
+	int autotune = 0;
+
+	if (InitConnection(vnc, 1) == 0) return 0;
+	if (width<1 || height<1 || width>VNC_MAXDESKTOP || height>VNC_MAXDESKTOP) {
+		DBERROR("Bad desktop size %ix%i.\n",width,height);
+		return 0;
+	}
+	memset(&vnc->serverFormat, 0, sizeof(vnc->serverFormat));
+	vnc->serverFormat.width=width;
+	vnc->serverFormat.height=height;
+
+	ParseMode(vnc, mode, &nothread, &autotune);
+	vnc->wanturing=0;
+	if (format) {
+		// 8 or 16 bit true colour or colour map, or the 32 bit format vncConnect asks for
+		tSDL_vnc_pixelFormat full;
+		PixelFormatFor(32,&full);
+		if (format->bigendian ||
+		    (format->bpp==32 && memcmp(format,&full,sizeof(full)-sizeof(full.padding))!=0) ||
+		    (format->bpp!=32 && format->bpp!=16 && format->bpp!=8) ||
+		    (!format->truecolor && format->bpp!=8)) {
+			DBERROR("Unsupported pixel format.\n");
+			return 0;
+		}
+		vnc->pixelformat=*format;
+		vnc->bpp=format->bpp/8;
+		vnc->colormap=!format->truecolor;
+	} else {
+		ModePixelFormat(vnc);
+	}
+	if (CreateFramebuffer(vnc, autotune) == 0) return 0;
+
+	vnc->fed=1;
+	vnc->reading=1;
+	return ParserCreate(vnc);
+}
+
+int vncParserDamage(tSDL_vnc *vnc, SDL_Rect *rects, int max) {
+	SDL_Rect list[VNC_DAMAGERECTS];
+	int count;
+
+	if (!vnc->mutex || max<1) return 0;
+	SDL_LockMutex(vnc->mutex);
+	count=vnc->feeddamagecount;
+	memcpy(list,vnc->feeddamage,count*sizeof(SDL_Rect));
+	vnc->feeddamagecount=0;
+	SDL_UnlockMutex(vnc->mutex);
+
+	ReduceDamage(list,&count,max);
+	memcpy(rects,list,count*sizeof(SDL_Rect));
+	return count;
+}
+
+/* What a blit sees: the surface to copy from and the regions that changed.
+   Normally that is the framebuffer itself under the mutex; in doublebuffer
+   mode it is the newest published front buffer, claimed without locking. */
+typedef struct tSDL_vnc_view {
+	SDL_Surface *surface;
+	SDL_Rect *damage;
+	int *damagecount;
+	SDL_Rect bounds;
+	unsigned int seq;
+	int updated;
+	int front;
+} tSDL_vnc_view;
+
+static void BeginBlit(tSDL_vnc *vnc, tSDL_vnc_view *view)
+{
+	vnc_count_shared(&vnc->stats.blits, 1);
+	if (!vnc->doublebuffer) {
+		uint64_t start = MonotonicMicroseconds();
+		SDL_LockMutex(vnc->mutex);
+		uint64_t wait = MonotonicMicroseconds() - start;
+		vnc_count_shared(&vnc->stats.blitwait, wait);
+		vnc_count_max(&vnc->stats.blitwaitmax, wait);
+		view->surface = vnc->framebuffer;
+		view->damage = vnc->damage;
+		view->damagecount = &vnc->damagecount;
+		view->bounds = vnc->updatedRect;
+		view->seq = vnc->frameseq;
+		view->updated = vnc->fbupdated;
+		view->front = -1;
+		return;
+	}
+
+	/* Announce the front we are about to read, then make sure it was not
+	   replaced meanwhile; the decoder never reuses a front marked in use */
+	int f;
+	do {
+		f = vnc_atomic_load(&vnc->frontpublished);
+		vnc_atomic_store(&vnc->frontinuse, f);
+	} while (f != vnc_atomic_load(&vnc->frontpublished));
+
+	view->front = f;
+	view->updated = 0;
+	if (f < 0) {
+		view->surface = NULL;
+		return;
+	}
+
+	tSDL_vnc_front *front = &vnc->front[f];
+	view->surface = front->surface;
+	view->damage = front->damage;
+	view->damagecount = &front->damagecount;
+	view->seq = front->seq;
+	view->updated = (front->seq != vnc->blitseq) && front->damagecount > 0;
+	view->bounds.x = 0;
+	view->bounds.y = 0;
+	view->bounds.w = front->surface->w;
+	view->bounds.h = front->surface->h;
+	if (view->updated) {
+		int i;
+		view->bounds = front->damage[0];
+		for (i = 1; i < front->damagecount; i++) DamageUnion(&view->bounds, &front->damage[i]);
+	}
+}
+
+static void EndBlit(tSDL_vnc *vnc, tSDL_vnc_view *view, int blitted)
+{
+	if (blitted) vnc->blitseq = view->seq;
+	if (!vnc->doublebuffer) {
+		if (blitted) {
+			vnc->fbupdated=0;
+			vnc->damagecount=0;
+		}
+		SDL_UnlockMutex(vnc->mutex);
+		return;
+	}
+	if (blitted) vnc_atomic_store(&vnc->frontconsumed, view->seq);
+	vnc_atomic_store(&vnc->frontinuse, -1);
+	if (vnc_atomic_load(&vnc->frontwaiting)) {
+		SDL_LockMutex(vnc->mutex);
+		SDL_CondSignal(vnc->frontreleased);
+		SDL_UnlockMutex(vnc->mutex);
+	}
+}
+
 int vncBlitFramebuffer(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *urec) {
+	tSDL_vnc_view view;
 	int result;
 
 	if (!vnc) return 0;
@@ -1193,23 +2549,53 @@ int vncBlitFramebuffer(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *urec) {
 	if (!vnc->framebuffer) return 0;
 
 	result = 0;
-	SDL_LockMutex(vnc->mutex);
-	if (vnc->fbupdated) {
-		DBMESSAGE("Blitting framebuffer: updated region @ %i,%i size %ix%i\n",vnc->updatedRect.x,vnc->updatedRect.y,vnc->updatedRect.w,vnc->updatedRect.h);
-		SDL_BlitSurface(vnc->framebuffer, &vnc->updatedRect, target, &vnc->updatedRect);
-		//  SDL_BlitSurface(vnc->framebuffer, NULL, target, trec);
+	BeginBlit(vnc, &view);
+	if (view.updated) {
+		DBMESSAGE("Blitting framebuffer: updated region @ %i,%i size %ix%i\n",view.bounds.x,view.bounds.y,view.bounds.w,view.bounds.h);
+		// Only the damaged parts need copying; urec still reports their bounding box
+		int i;
+		for (i = 0; i < *view.damagecount; i++) {
+			SDL_Rect rect = view.damage[i];
+			SDL_BlitSurface(view.surface, &view.damage[i], target, &rect);
+		}
 		if (urec) {
-			*urec=vnc->updatedRect;
+			*urec=view.bounds;
 		}
-		vnc->fbupdated=0;
 		result=1;
 	}
-	SDL_UnlockMutex(vnc->mutex);
+	EndBlit(vnc, &view, result);
+	return result;
+}
+
+int vncBlitFramebufferRects(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *rects, int maxrects) {
+	tSDL_vnc_view view;
+	int result;
+
+	if (!vnc) return 0;
+	if (!vnc->mutex) return 0;
+	if (!vnc->framebuffer) return 0;
+	if (!rects || maxrects < 1) return 0;
+
+	result = 0;
+	BeginBlit(vnc, &view);
+	if (view.updated) {
+		ReduceDamage(view.damage, view.damagecount, maxrects);
+		DBMESSAGE("Blitting framebuffer: %i updated regions\n", *view.damagecount);
+		int i;
+		for (i = 0; i < *view.damagecount; i++) {
+			// SDL_BlitSurface clips rects[i] to the target, as SDL_UpdateRects needs
+			rects[i] = view.damage[i];
+			SDL_BlitSurface(view.surface, &view.damage[i], target, &rects[i]);
+		}
+		result = *view.damagecount;
+	}
+	EndBlit(vnc, &view, result > 0);
 	return result;
 }
 
 // Advanced blitting, especially for full-screen and scrolling updates
 int vncBlitFramebufferAdvanced(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *urec, int outx, int outy, float outScale, int fullRefresh) {
+	tSDL_vnc_view view;
 	int result;
 
 	if (!vnc) return 0;
@@ -1217,9 +2603,9 @@ int vncBlitFramebufferAdvanced(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *ure
 	if (!vnc->framebuffer) return 0;
 
 	result = 0;
-	SDL_LockMutex(vnc->mutex);
-	if ((fullRefresh > 0) || vnc->fbupdated) {
-		DBMESSAGE("Blitting framebuffer: updated region @ %i,%i size %ix%i\n",vnc->updatedRect.x,vnc->updatedRect.y,vnc->updatedRect.w,vnc->updatedRect.h);
+	BeginBlit(vnc, &view);
+	if (view.surface && ((fullRefresh > 0) || view.updated)) {
+		DBMESSAGE("Blitting framebuffer: updated region @ %i,%i size %ix%i\n",view.bounds.x,view.bounds.y,view.bounds.w,view.bounds.h);
 		
 		if (fullRefresh > 0) {
 			SDL_Rect srcrec;
@@ -1253,28 +2639,120 @@ int vncBlitFramebufferAdvanced(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *ure
 				srcrec.h = h - outy;
 				dstrec.h = h - outy;
 			}
-			SDL_BlitSurface(vnc->framebuffer, &srcrec, target, &dstrec);
+			SDL_BlitSurface(view.surface, &srcrec, target, &dstrec);
 			
 		} else {
 			// Incremental update
 			SDL_Rect dstrec;
-			dstrec.x = vnc->updatedRect.x + outx;
-			dstrec.y = vnc->updatedRect.y + outy;
-			dstrec.w = (Uint16)(vnc->updatedRect.w * outScale);
-			dstrec.h = (Uint16)(vnc->updatedRect.h * outScale);
-			SDL_BlitSurface(vnc->framebuffer, &vnc->updatedRect, target, &dstrec);
+			dstrec.x = view.bounds.x + outx;
+			dstrec.y = view.bounds.y + outy;
+			dstrec.w = (Uint16)(view.bounds.w * outScale);
+			dstrec.h = (Uint16)(view.bounds.h * outScale);
+			SDL_BlitSurface(view.surface, &view.bounds, target, &dstrec);
 		}
 		
 		if (urec) {
-			*urec=vnc->updatedRect;
+			*urec=view.bounds;
 		}
-		vnc->fbupdated=0;
 		result=1;
 	}
-	SDL_UnlockMutex(vnc->mutex);
+	EndBlit(vnc, &view, result);
 	return result;
 }
 
+unsigned int vncFrameSequence(tSDL_vnc *vnc) {
+	return vnc_atomic_load(&vnc->frameseq);
+}
+
+unsigned int vncBlitSequence(tSDL_vnc *vnc) {
+	return vnc->blitseq;
+}
+
+/* Copies without locking: each counter is read whole with vnc_counter(),
+   and taking the mutex here would stall the decoder for the sake of
+   statistics. Counters are read one by one, so they may be from slightly
+   different moments. */
+int vncGetStats(tSDL_vnc *vnc, tSDL_vnc_stats *stats)
+{
+	const tSDL_vnc_stats *counters;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if ((!vnc) || (!vnc->mutex)) return 0;
+
+	counters = &vnc->stats;
+	stats->bytesreceived = vnc_counter(&counters->bytesreceived);
+	stats->bytessent = vnc_counter(&counters->bytessent);
+	stats->recvcalls = vnc_counter(&counters->recvcalls);
+	stats->sendcalls = vnc_counter(&counters->sendcalls);
+	stats->waitcalls = vnc_counter(&counters->waitcalls);
+	stats->recvwait = vnc_counter(&counters->recvwait);
+	for (i=0; i<VNC_STATS_MESSAGES; i++) {
+		stats->messages[i] = vnc_counter(&counters->messages[i]);
+	}
+	for (i=0; i<VNC_STATS_ENCODINGS; i++) {
+		stats->encodings[i].encoding = counters->encodings[i].encoding;
+		stats->encodings[i].rects = vnc_counter(&counters->encodings[i].rects);
+		stats->encodings[i].pixels = vnc_counter(&counters->encodings[i].pixels);
+		stats->encodings[i].bytes = vnc_counter(&counters->encodings[i].bytes);
+		stats->encodings[i].decodetime = vnc_counter(&counters->encodings[i].decodetime);
+	}
+	stats->requests = vnc_counter(&counters->requests);
+	stats->requestsanswered = vnc_counter(&counters->requestsanswered);
+	stats->requestlatency = vnc_counter(&counters->requestlatency);
+	stats->requestlatencymax = vnc_counter(&counters->requestlatencymax);
+	stats->inputevents = vnc_counter(&counters->inputevents);
+	stats->inputcoalesced = vnc_counter(&counters->inputcoalesced);
+	stats->inputlatency = vnc_counter(&counters->inputlatency);
+	stats->inputlatencymax = vnc_counter(&counters->inputlatencymax);
+	stats->blits = vnc_counter(&counters->blits);
+	stats->blitwait = vnc_counter(&counters->blitwait);
+	stats->blitwaitmax = vnc_counter(&counters->blitwaitmax);
+	stats->fencepauses = vnc_counter(&counters->fencepauses);
+	stats->updaterate = vnc_counter(&counters->updaterate);
+	stats->allocations = vnc_counter(&counters->allocations);
+	stats->allocatedbytes = vnc_counter(&counters->allocatedbytes);
+	return 1;
+}
+
+unsigned int vncDesktopSequence(tSDL_vnc *vnc) {
+	return vnc_atomic_load(&vnc->desktopseq);
+}
+
+SDL_Rect vncDesktopSize(tSDL_vnc *vnc)
+{
+	SDL_Rect size;
+	size.x=0;
+	size.y=0;
+	size.w=0;
+	size.h=0;
+
+	if ((!vnc) || (!vnc->mutex)) return size;
+
+	SDL_LockMutex(vnc->mutex);
+	if (vnc->framebuffer) {
+		size.w=vnc->framebuffer->w;
+		size.h=vnc->framebuffer->h;
+	}
+	SDL_UnlockMutex(vnc->mutex);
+	return size;
+}
+
+int vncDesktopScreens(tSDL_vnc *vnc, tSDL_vnc_screen *screens, int max)
+{
+	int count;
+
+	if ((!vnc) || (!vnc->mutex)) return 0;
+
+	SDL_LockMutex(vnc->mutex);
+	count = vnc->screencount;
+	if (screens && max > 0) {
+		memcpy(screens, vnc->screens, (count < max ? count : max) * sizeof(tSDL_vnc_screen));
+	}
+	SDL_UnlockMutex(vnc->mutex);
+	return count;
+}
+
 int vncBlitCursor(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *trec) {
 	int result;
 
@@ -1284,7 +2762,12 @@ int vncBlitCursor(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *trec) {
 	result=0;
 	SDL_LockMutex(vnc->mutex);
 	if ((vnc->cursorbuffer) && (vnc->gotcursor)) {
-		SDL_BlitSurface(vnc->cursorbuffer, NULL, target, trec);
+		SDL_Rect srec;
+		srec.x=0;
+		srec.y=0;
+		srec.w=vnc->cursorhotspot.w;
+		srec.h=vnc->cursorhotspot.h;
+		SDL_BlitSurface(vnc->cursorbuffer, &srec, target, trec);
 		result=1;
 	}
 	SDL_UnlockMutex(vnc->mutex);
@@ -1318,15 +2801,17 @@ int vncClientKeyevent(tSDL_vnc *vnc, unsigned char downflag, unsigned int key)
 	int result=0;
 
 	SDL_LockMutex(vnc->mutex);
-	if (vnc->clientbufferpos<(VNC_BUFSIZE-8)) {
+	char *dest = ReserveClientBuffer(vnc, 8);
+	if (dest) {
+		memset(&clientKeyevent,0,sizeof(clientKeyevent));
 		clientKeyevent.messagetype=4;
 		clientKeyevent.downflag=downflag;
 		clientKeyevent.key=swap_32(key);
-		memcpy(&vnc->clientbuffer[vnc->clientbufferpos],&clientKeyevent,8);
+		memcpy(dest,&clientKeyevent,8);
 		vnc->clientbufferpos += 8;
+		vnc->lastpointer = -1;
+		QueueInput(vnc);
 		result = 1;
-	} else {
-		DBMESSAGE("CLient buffer full - ignoring keyevent.");
 	}
 	SDL_UnlockMutex(vnc->mutex);
 
@@ -1338,17 +2823,28 @@ int vncClientPointerevent(tSDL_vnc *vnc, unsigned char buttonmask, unsigned shor
 	tSDL_vnc_clientPointerevent clientPointerevent;
 	int result=0;
 
+	clientPointerevent.messagetype=5;
+	clientPointerevent.buttonmask=buttonmask;
+	clientPointerevent.x=swap_16(x);
+	clientPointerevent.y=swap_16(y);
+
 	SDL_LockMutex(vnc->mutex);
-	if (vnc->clientbufferpos<(VNC_BUFSIZE-6)) {
-		clientPointerevent.messagetype=5;
-		clientPointerevent.buttonmask=buttonmask;
-		clientPointerevent.x=swap_16(x);
-		clientPointerevent.y=swap_16(y);
-		memcpy(&vnc->clientbuffer[vnc->clientbufferpos],&clientPointerevent,6);
-		vnc->clientbufferpos += 6;
+	if (vnc->lastpointer >= 0 && buttonmask == vnc->pointermask) {
+		// Motion right after queued motion: only the latest position matters
+		memcpy(&vnc->clientbuffer[vnc->lastpointer],&clientPointerevent,6);
+		vnc_count_shared(&vnc->stats.inputcoalesced, 1);
 		result = 1;
 	} else {
-		DBMESSAGE("CLient buffer full - ignoring mouseevent.");
+		char *dest = ReserveClientBuffer(vnc, 6);
+		if (dest) {
+			memcpy(dest,&clientPointerevent,6);
+			// Button transitions are kept as they are; the motion after them may be merged
+			vnc->lastpointer = buttonmask == vnc->pointermask ? vnc->clientbufferpos : -1;
+			vnc->pointermask = buttonmask;
+			vnc->clientbufferpos += 6;
+			QueueInput(vnc);
+			result = 1;
+		}
 	}
 	SDL_UnlockMutex(vnc->mutex);
 
@@ -1361,18 +2857,27 @@ void vncDisconnect(tSDL_vnc *vnc)
 		SDL_KillThread(vnc->thread);
 		vnc->thread=NULL;
 	}
+	ParserFree(vnc);
+	UringFree(vnc);
+	// Stop the Tight workers while the mutex they draw under still exists
+	tight_free(vnc);
 	if (vnc->mutex) {
 		SDL_DestroyMutex(vnc->mutex);
 		vnc->mutex=NULL;
 	}
-	if (vnc->socket) {
+	if (vnc->frontreleased) {
+		SDL_DestroyCond(vnc->frontreleased);
+		vnc->frontreleased=NULL;
+	}
+	if (vnc->socket >= 0) {
 #ifdef WIN32
 		closesocket(vnc->socket);
 #else
 		close(vnc->socket);
 #endif
-		vnc->socket=0;
+		vnc->socket=-1;
 	}
+	CloseWakeup(vnc);
 	if (vnc->buffer) {
 		free(vnc->buffer);
 		vnc->buffer=NULL;
@@ -1381,25 +2886,32 @@ void vncDisconnect(tSDL_vnc *vnc)
 		free(vnc->clientbuffer);
 		vnc->clientbuffer=NULL;
 	}
+	if (vnc->clientspare) {
+		free(vnc->clientspare);
+		vnc->clientspare=NULL;
+	}
+	if (vnc->recvbuffer) {
+		free(vnc->recvbuffer);
+		vnc->recvbuffer=NULL;
+	}
 	if (vnc->framebuffer) {
 		SDL_FreeSurface(vnc->framebuffer);
 		vnc->framebuffer=NULL;
 	}
-	if (vnc->scratchbuffer) {
-		SDL_FreeSurface(vnc->scratchbuffer);
-		vnc->scratchbuffer=NULL;
-	}
-    if (vnc->rawbuffer) {
-        free(vnc->rawbuffer);
-        vnc->rawbuffer=NULL;
-    }
-
-	if (vnc->tilebuffer) {
-		SDL_FreeSurface(vnc->tilebuffer);
-		vnc->tilebuffer=NULL;
+	int i;
+	for (i = 0; i < VNC_FRONTBUFFERS; i++) {
+		if (vnc->front[i].surface) {
+			SDL_FreeSurface(vnc->front[i].surface);
+			vnc->front[i].surface=NULL;
+		}
 	}
-	if (vnc->cursorbuffer) {
-		SDL_FreeSurface(vnc->cursorbuffer);
-		vnc->cursorbuffer=NULL;
+	for (i = 0; i < VNC_SCRATCHSLOTS; i++) {
+		free(vnc->scratch[i]);
+		vnc->scratch[i]=NULL;
+		vnc->scratchsize[i]=0;
 	}
+
+	cursor_free(vnc);
+	zrle_free(vnc);
+	TunerFree(vnc);
 }
@@ -43,6 +43,18 @@ char vncLastError[512];
 	/* ---- Defines */
 
 #define VNC_BUFSIZE	1024
+#define VNC_RECVBUFSIZE	65536
+#define VNC_DAMAGERECTS	32
+#define VNC_FRONTBUFFERS	3
+#define VNC_MAXPIPELINE	8
+#define VNC_SCRATCHSLOTS	4
+#define VNC_MAXSCREENS	16
+#define VNC_MAXDESKTOP	16384
+#define VNC_MAXCURSOR	1024
+#define VNC_MAXENCODINGS	64
+#define VNC_TUNER_ENCODINGS	5
+#define VNC_STATS_ENCODINGS	10
+#define VNC_STATS_MESSAGES	6
 
 	/* ---- VNC Protocol Structures */
 
@@ -163,6 +175,12 @@ char vncLastError[512];
 		uint32_t  key;
 	} tSDL_vnc_clientKeyevent;
 
+	typedef struct tSDL_vnc_clientContinuousUpdates {
+		uint8_t messagetype;
+		uint8_t enable;
+		tSDL_vnc_rect rect;
+	} tSDL_vnc_clientContinuousUpdates;
+
 	typedef struct tSDL_vnc_clientPointerevent {
 		uint8_t messagetype;
 		uint8_t buttonmask;
@@ -170,10 +188,90 @@ char vncLastError[512];
 		uint16_t y;
 	} tSDL_vnc_clientPointerevent;
 	
+	/* ---- one screen of the desktop (ExtendedDesktopSize) ---- */
+
+	typedef struct tSDL_vnc_screen {
+		uint32_t id;
+		uint16_t x;
+		uint16_t y;
+		uint16_t width;
+		uint16_t height;
+		uint32_t flags;
+	} tSDL_vnc_screen;
+
+	/* ---- published copy of the framebuffer (doublebuffer mode) ---- */
+
+	typedef struct tSDL_vnc_front {
+		SDL_Surface *surface;			// complete framebuffer as of update seq
+		unsigned int seq;			// update sequence number held in surface
+		SDL_Rect stale[VNC_DAMAGERECTS];	// regions the decoder changed since surface was synced
+		int stalecount;
+		SDL_Rect damage[VNC_DAMAGERECTS];	// regions changed since the consumer's last blit
+		int damagecount;
+	} tSDL_vnc_front;
+
+	/* ---- encoding tuner (auto mode), see vncTunerState ---- */
+
+	typedef struct tSDL_vnc_tunerEncoding {
+		int32_t encoding;
+		int allowed;				// flag: listed in the mode, so it may be chosen
+		double decode;				// estimated decode time (us per pixel)
+		double wire;				// estimated size on the wire (bytes per pixel)
+		uint64_t measured;			// pixels the estimates are based on, 0 = typical values
+	} tSDL_vnc_tunerEncoding;
+
+	typedef struct tSDL_vnc_tunerState {
+		int enabled;				// flag: the connection is tuned
+		int32_t encoding;			// encoding preferred now
+		int compress;				// compression level requested, -1 if none
+		int quality;				// JPEG quality requested, -1 if none
+		double bandwidth;			// estimated link throughput (bytes per second), 0 = unknown
+		uint64_t rtt;				// round trip time (us), 0 = unknown
+		unsigned long switches;			// number of changes made
+		char reason[160];			// why the latest change was made
+		tSDL_vnc_tunerEncoding encodings[VNC_TUNER_ENCODINGS];
+	} tSDL_vnc_tunerState;
+
+	/* ---- performance counters, see vncGetStats ---- */
+
+	typedef struct tSDL_vnc_encodingStats {
+		int32_t encoding;
+		uint64_t rects;				// rectangles received
+		uint64_t pixels;			// pixels they covered (not counted for pseudo-encodings)
+		uint64_t bytes;				// their data on the wire, after the rectangle header
+		uint64_t decodetime;			// time spent on them less waiting for data (us)
+	} tSDL_vnc_encodingStats;
+
+	typedef struct tSDL_vnc_stats {
+		uint64_t bytesreceived;			// from the socket
+		uint64_t bytessent;			// to the socket
+		uint64_t recvcalls;			// recv()/readv() syscalls or io_uring submissions
+		uint64_t sendcalls;			// send() syscalls
+		uint64_t waitcalls;			// select() syscalls of the client thread
+		uint64_t recvwait;			// time the decoders waited for data (us)
+		uint64_t messages[VNC_STATS_MESSAGES];	// server messages: update, colour map, bell, text, end of continuous updates, fence
+		tSDL_vnc_encodingStats encodings[VNC_STATS_ENCODINGS];	// raw, copyrect, rre, hextile, tight, zrle, cursor, desktop size, extended desktop size, last rect
+		uint64_t requests;			// update requests sent
+		uint64_t requestsanswered;		// updates that answered one
+		uint64_t requestlatency;		// total request to first byte latency of those (us)
+		uint64_t requestlatencymax;		// worst of those latencies (us)
+		uint64_t inputevents;			// key/pointer events sent
+		uint64_t inputcoalesced;		// pointer motions merged into a queued event instead
+		uint64_t inputlatency;			// total queue-to-send latency of those (us)
+		uint64_t inputlatencymax;		// worst of those latencies (us)
+		uint64_t blits;				// blits made by vncBlitFramebuffer*()
+		uint64_t blitwait;			// time those waited for the framebuffer mutex (us)
+		uint64_t blitwaitmax;			// longest of those waits (us)
+		uint64_t fencepauses;			// times continuous updates were paused for queueing
+		uint64_t updaterate;			// framebuffer updates per second, measured each second
+		uint64_t allocations;			// work memory (re)allocations made while decoding
+		uint64_t allocatedbytes;		// bytes allocated by those
+	} tSDL_vnc_stats;
+
 	/* ---- main SDL_vnc structure ---- */
 
 	typedef struct tSDL_vnc {
-		int socket;				// socket to server
+		int socket;				// socket to server, -1 if none
 		int versionMajor;				// current VNC version
 		int versionMinor;				// current VNC version
 		unsigned int security_type;		// current security type
@@ -182,9 +280,28 @@ char vncLastError[512];
 		
 		int reading;				// flag indicating we are reading
 		int framerate;				// current framerate for update requests
+		int pipeline;				// update requests kept in flight, 0 = request when idle
+		int maxrate;				// max update requests per second when pipelining, 0 = no limit
+		int requestsinflight;			// update requests not answered yet
+		uint64_t requesttimes[VNC_MAXPIPELINE];	// send times of those requests (us), oldest first
+		uint64_t nextrequest;			// time the next update request is due (us)
+
+		int continuous;				// ContinuousUpdates state, see SDL_vnc.c
+		tSDL_vnc_rect visiblearea;		// area continuous updates are enabled for
+		int visiblechanged;			// flag: visiblearea must be resent to the server
+		int fencesupported;			// flag: server sent a Fence, so it understands ours
+		int fencepending;			// flag: our fence has not come back yet
+		uint64_t fencesent;			// when it was sent (us)
+		unsigned int fenceseq;			// frameseq when it was sent
+		uint64_t fencertt;			// latest fence round trip time (us)
+		uint64_t fencertmin;			// smallest fence round trip time seen (us)
 		int delay;					// Throttle down main thread (power saving)
 		
 		Uint32 rmask, gmask, bmask, amask;	// current RGBA mask
+		int bpp;				// bytes per pixel on the wire: 4, 2 or 1 (the framebuffer is always 32bpp)
+		int colormap;				// flag: 8 bit indices into the palette in pixellut[0]
+		tSDL_vnc_pixelFormat pixelformat;	// format requested from the server (host byte order)
+		uint32_t pixellut[2][256];		// framebuffer colour of each byte of a wire pixel, see pixel.c
 		
 		
 		SDL_Thread *thread;			// VNC client thread
@@ -194,22 +311,73 @@ char vncLastError[512];
 		// and need to be mutex locked if accessed externally
 		
 		unsigned char *buffer;				// general IO buffer
+
+		unsigned char *recvbuffer;		// buffered data received from the socket
+		int recvbufferpos;			// read position in recvbuffer
+		int recvbufferlen;			// number of valid bytes in recvbuffer
+		unsigned long recvrequests;		// number of reads served by Recv()
+		unsigned long recvconsumed;		// bytes handed out to the decoders
+		tSDL_vnc_stats stats;			// performance counters, each kept by one thread, see vncGetStats()
+		struct tSDL_vnc_parser *parser;		// push parser server data is fed to, see parser.c
+		void *uring;				// io_uring receive state, see uring.c
+		int wanturing;				// set up io_uring once the connection is driven
+		int receiving;				// flag: StartReceiving() ran on the driving thread
 		
 		char *clientbuffer;			// buffer for client-to-server data
 		int clientbufferpos;			// current position in buffer
+		int clientbuffersize;			// allocated size of clientbuffer (grows as needed)
+		char *clientspare;			// swapped with clientbuffer while its input is sent
+		int clientsparesize;			// allocated size of clientspare
+		int lastpointer;			// position of a trailing motion event in clientbuffer, -1 if none
+		int pointermask;			// button mask of the last pointer event queued, -1 if none
+		int inputpending;			// flag: clientbuffer holds data not yet sent (atomic)
+		int wakeup[2];				// pipe waking the client thread when input is queued
+		int inputqueued;			// events in clientbuffer
+		uint64_t inputqueuedsum;		// sum of their queue times (us)
+		uint64_t inputqueuedfirst;		// queue time of the oldest one (us)
 		
+		unsigned int frameseq;			// number of completed framebuffer updates
+		unsigned int blitseq;			// update sequence number of the last blit
+		uint64_t updateratestart;		// start of the current measuring interval (us)
+		unsigned int updateratecount;		// updates received in the current interval
+		uint64_t requestlatencylast;		// update request to first byte latency of the latest answered request (us)
+
+		int doublebuffer;			// flag: decode into framebuffer, blit from front buffers
+		tSDL_vnc_front front[VNC_FRONTBUFFERS];
+		int frontpublished;			// front holding the newest complete update, -1 if none (atomic)
+		int frontinuse;				// front being blitted by the application, -1 if none (atomic)
+		int frontwaiting;			// flag: a resize waits for frontreleased (atomic)
+		SDL_cond *frontreleased;		// signalled when a blit lets go of its front during a resize
+		unsigned int frontconsumed;		// sequence number of the last front blitted (atomic)
+		SDL_Rect unconsumed[VNC_DAMAGERECTS];	// damage published but not yet blitted
+		int unconsumedcount;
+
 		int fbupdated;				// flag indicating that the framebuffer was updated
 		SDL_Rect updatedRect;			// rectangle that was updated
+		SDL_Rect damage[VNC_DAMAGERECTS];	// individual updated rectangles
+		int damagecount;			// number of valid entries in damage
+		int fed;				// flag: fed by the application, collect feeddamage
+		SDL_Rect feeddamage[VNC_DAMAGERECTS];	// regions decoded since the last vncParserDamage
+		int feeddamagecount;			// number of valid entries in feeddamage
 		
-		SDL_Surface *framebuffer;		// RGB surface of framebuffer
-		SDL_Surface *scratchbuffer;		// workbuffer for encodings
-		SDL_Surface *tilebuffer;		// workbuffer for encodings
-
-        uint32_t * rawbuffer;           // Raw pixel buffer. To replace scratchbuffer
+		SDL_Surface *framebuffer;		// RGB surface of framebuffer (replaced when the desktop is resized)
+		unsigned int desktopseq;		// number of desktop size or layout changes (atomic)
+		tSDL_vnc_screen screens[VNC_MAXSCREENS];	// screens making up the desktop
+		int screencount;			// number of valid entries in screens
+		void *scratch[VNC_SCRATCHSLOTS];	// grow-only work memory of the decoders, see ScratchBuffer()
+		size_t scratchsize[VNC_SCRATCHSLOTS];	// allocated size of each slot
+
+		void *zrle;				// ZRLE decoder state (zlib stream), see zrle.c
+		void *tight;				// Tight decoder state (zlib streams), see tight.c
+		void *cursor;				// cache of decoded cursor shapes, see cursor.c
+		void *tuner;				// encoding tuner, NULL unless in auto mode, see tune.c
+		int32_t encodings[VNC_MAXENCODINGS];	// SetEncodings list the mode asked for
+		int encodingcount;
+		int decodethreads;			// worker threads for Tight decoding (0 = decode serially)
 		
 		int gotcursor;				// flag indicating that the cursor was updated
-		SDL_Surface *cursorbuffer;		// RGBA surface of cursor (fixed at 32x32)
-		SDL_Rect cursorhotspot;			// hotspot location of cursor (only .x and .y are used)
+		SDL_Surface *cursorbuffer;		// RGBA surface of cursor (at least the cursor size)
+		SDL_Rect cursorhotspot;			// hotspot location of cursor in .x/.y, cursor size in .w/.h
 		
 	} tSDL_vnc;
 
@@ -244,9 +412,22 @@ char vncLastError[512];
 	copyrect | 
 	rre | 
 	hextile | 
-	zrle(unimplemented) | 
-	cursor(ignored) | 
-	desktop(ignored)
+	zrle | 
+	tight | 
+	compress=0..9 (Tight compression level) | 
+	quality=0..9 (Tight JPEG quality, enables JPEG) | 
+	threads=N (decode Tight on N worker threads) | 
+	bpp=32|16|8 (pixel size on the wire: true colour, RGB565 or BGR233; default 32) | 
+	colormap (8 bit pixels through a palette set by the server) | 
+	doublebuffer (blit complete updates without blocking the decoder; Raw is then received straight into the framebuffer) | 
+	pipeline[=N] (request the next update as soon as one arrives, N in flight) | 
+	maxrate=N (at most N requests per second when pipelining, 0 = no limit; default framerate) | 
+	continuous (let the server push updates, bounded by Fence round trips) | 
+	nothread (no client thread, the connection is driven by a vncLoop) | 
+	uring (experimental, off unless given: receive through io_uring where the kernel has it, set up by the client thread or loop thread, Linux; every byte is copied out of its buffers, so it is not faster than the default recv()/readv(), which reads large rectangles in place) | 
+	cursor (the server sends its cursor shape instead of drawing it into the framebuffer; the shape is decoded to an RGBA image drawn with vncBlitCursor, with its hotspot from vncCursorHotspot and gotcursor set when it changes; the last 4 shapes stay decoded, so switching back to one costs no decoding) | 
+	desktop (follow desktop resizes and screen layouts, see vncDesktopSequence) | 
+	auto (reorder the listed encodings and compression by measured cost, see vncTunerState) 
 	password = text
 	framerate = 1 to 100
 
@@ -268,6 +449,76 @@ char vncLastError[512];
 	SDL_VNC_SCOPE int vncBlitFramebuffer(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *urec);
 	SDL_VNC_SCOPE int vncBlitFramebufferAdvanced(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *urec, int outx, int outy, float outScale, int fullRefresh);
 
+	/*
+	Blit only the updated rectangles of the framebuffer to target
+
+	Up to maxrects updated rectangles are stored in rects, ready to be
+	passed to SDL_UpdateRects(); if more regions changed, neighbouring
+	ones are merged until they fit.
+
+	Returns the number of rectangles stored, 0 if nothing was updated.
+	*/
+
+	SDL_VNC_SCOPE int vncBlitFramebufferRects(tSDL_vnc *vnc, SDL_Surface *target, SDL_Rect *rects, int maxrects);
+
+	/*
+	Return framebuffer update sequence numbers
+
+	vncFrameSequence() counts the framebuffer updates received so far.
+	vncBlitSequence() returns the update shown by the last blit; in
+	doublebuffer mode that blit holds exactly this update, never a partial one.
+	*/
+
+	SDL_VNC_SCOPE unsigned int vncFrameSequence(tSDL_vnc *vnc);
+	SDL_VNC_SCOPE unsigned int vncBlitSequence(tSDL_vnc *vnc);
+
+	/*
+	Set the part of the framebuffer that is visible
+
+	With continuous updates the server only pushes changes in this area.
+	Defaults to the whole framebuffer.
+	*/
+
+	SDL_VNC_SCOPE void vncSetVisibleArea(tSDL_vnc *vnc, int x, int y, int w, int h);
+
+	/*
+	Follow desktop resizes (desktop mode)
+
+	vncDesktopSequence() counts the size and layout changes the server
+	announced; when it moves, vncDesktopSize() has the new size in .w/.h
+	and vncDesktopScreens() copies up to max screens of the layout into
+	screens, returning how many there are. The framebuffer keeps the part
+	of its old content that still fits and is reported updated in full.
+	Resize the target surface when the sequence moves, then repaint it with
+	vncBlitFramebufferAdvanced(..., fullRefresh=1), since a blit made just
+	before noticing may already have used up that update.
+	*/
+
+	SDL_VNC_SCOPE unsigned int vncDesktopSequence(tSDL_vnc *vnc);
+	SDL_VNC_SCOPE SDL_Rect vncDesktopSize(tSDL_vnc *vnc);
+	SDL_VNC_SCOPE int vncDesktopScreens(tSDL_vnc *vnc, tSDL_vnc_screen *screens, int max);
+	/*
+	Encoding tuner (auto mode)
+	Copies the tuner's measurements and current choice into state: the
+	estimated bandwidth and round trip time, and per encoding the decode
+	time and wire size per pixel it compares them by. reason tells why
+	the latest change of encoding or compression level was made.
+	Returns 0 (and a zeroed state) if the connection is not tuned.
+	*/
+	SDL_VNC_SCOPE int vncTunerState(tSDL_vnc *vnc, tSDL_vnc_tunerState *state);
+
+	/*
+	Performance counters
+	Copies the connection's counters, cumulative since vncConnect() (but
+	for updaterate and the maxima), into stats. Each counter is kept by the
+	threads doing the work (traffic and decoding by the one driving the
+	connection, blits by those blitting) without taking the mutex, so they
+	are cheap enough to always be on; read while the connection runs, they
+	may be a moment apart from each other.
+	Returns 0 (and zeroed stats) if vnc is not connected.
+	*/
+	SDL_VNC_SCOPE int vncGetStats(tSDL_vnc *vnc, tSDL_vnc_stats *stats);
+
 	/*
 	Blit current cursor to target
 	
@@ -282,7 +533,7 @@ char vncLastError[512];
 	/*
 	Return cursor hotspot
 
-	(Note: Only returned .x and .y are used.)
+	(Note: .x and .y are the hotspot, .w and .h the cursor size.)
 	*/
 
 	SDL_VNC_SCOPE SDL_Rect vncCursorHotspot(tSDL_vnc *vnc);
@@ -300,6 +551,59 @@ char vncLastError[512];
 	SDL_VNC_SCOPE void vncDisconnect(tSDL_vnc *vnc);
 
 
+	/*
+	Drive many connections from a few threads (Linux only)
+
+	Connections opened with the nothread mode have no client thread of their
+	own; add them to a loop instead. The loop threads sleep in epoll until a
+	socket, queued input or an update request deadline needs them, so with
+	pipeline or continuous an idle connection costs no CPU time. Each
+	connection goes to the thread with the fewest and stays there, so it is
+	always decoded on the same thread. Remove a connection from its loop
+	before calling vncDisconnect on it.
+	vncLoopCreate returns NULL and vncLoopAdd 0 on failure.
+	*/
+
+	typedef struct tSDL_vnc_loop tSDL_vnc_loop;
+
+	SDL_VNC_SCOPE tSDL_vnc_loop *vncLoopCreate(int threads);
+	SDL_VNC_SCOPE int vncLoopAdd(tSDL_vnc_loop *loop, tSDL_vnc *vnc);
+	SDL_VNC_SCOPE void vncLoopRemove(tSDL_vnc_loop *loop, tSDL_vnc *vnc);
+	SDL_VNC_SCOPE void vncLoopDestroy(tSDL_vnc_loop *loop);
+
+
+	/*
+	Decode server data handed in by the application
+
+	vncParserOpen sets up a decoder without a connection, for a recording or
+	a fuzzer: the stream starts after the handshake (with the first server
+	message), the desktop is width x height and the rectangles use format,
+	which is 8 or 16 bit true colour (little endian), an 8 bit colour map,
+	or the 32 bit format vncConnect asks for; NULL takes the format the
+	mode's bpp= or colormap picks. Of the mode only the decoding options
+	count (threads=, doublebuffer, auto). Messages to the server, such as
+	Fence replies, are dropped. Returns 0 on failure; vncDisconnect frees
+	it either way.
+
+	vncParserFeed also takes the data of a nothread connection that is not
+	in a loop, received by the application from any transport; update
+	requests and input then still need sending by a client thread or loop.
+	Chunks may be any size: decoding picks up where the previous chunk
+	ended, even in the middle of a rectangle. A len of 0 marks the end of
+	the stream. Returns the number of framebuffer updates completed by this
+	chunk, -1 once the stream is broken. Feed a stream from one thread.
+
+	vncParserDamage stores the regions decoded since its previous call (or
+	since feeding started) in rects, merged down to at most max, and
+	returns their number. Damage is also collected as usual for
+	vncBlitFramebufferRects.
+	*/
+
+	SDL_VNC_SCOPE int vncParserOpen(tSDL_vnc *vnc, int width, int height, tSDL_vnc_pixelFormat *format, char *mode);
+	SDL_VNC_SCOPE int vncParserFeed(tSDL_vnc *vnc, const void *data, int len);
+	SDL_VNC_SCOPE int vncParserDamage(tSDL_vnc *vnc, SDL_Rect *rects, int max);
+
+
 	/* Ends C function definitions when using C++ */
 #ifdef __cplusplus
 };
@@ -0,0 +1,210 @@
+/*
+
+SDL_vnc_internal.h - Definitions shared between the SDL_vnc modules
+
+Not part of the public interface; only included by the library sources.
+
+*/
+
+#ifndef _SDL_vnc_internal_h
+#define _SDL_vnc_internal_h
+
+#include <stdio.h>
+#include <string.h>
+
+#include "SDL_vnc.h"
+
+/* Define this to generate lots of info while the library is running. */
+//#define DEBUG
+#define TRACE_LAST_ERROR
+
+#ifdef DEBUG
+	#define DBMESSAGE 	printf
+#else
+	#define DBMESSAGE 	//
+#endif
+
+#ifdef TRACE_LAST_ERROR
+	#define DBERROR 	traceError
+	void traceError(const char * format, ...);
+#else
+	#define DBERROR 	printf(">>> Error: "); printf
+#endif
+
+/* Endian dependent routines */
+
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+	#define swap_16(x) (x)
+	#define swap_32(x) (x)
+#else
+	#define swap_16(x) ((((x) & 0xff) << 8) | (((x) >> 8) & 0xff))
+	#define swap_32(x) (((x) >> 24) | (((x) & 0x00ff0000) >> 8)  | (((x) & 0x0000ff00) << 8)  | ((x) << 24))
+#endif
+
+/* Atomic access to ints shared between the client thread and the application */
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+	#define vnc_atomic_load(p) 	_InterlockedCompareExchange((long volatile *)(p), 0, 0)
+	#define vnc_atomic_store(p, v) 	_InterlockedExchange((long volatile *)(p), (long)(v))
+	#define vnc_atomic_add(p, v) 	_InterlockedExchangeAdd((long volatile *)(p), (long)(v))
+#else
+	#define vnc_atomic_load(p) 	__atomic_load_n((p), __ATOMIC_SEQ_CST)
+	#define vnc_atomic_store(p, v) 	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+	#define vnc_atomic_add(p, v) 	__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+/* Performance counters in vnc->stats, read by vncGetStats() from any
+   thread, so values are loaded and stored whole (no torn 64 bit values on
+   32 bit targets). Most have a single writer thread and are added to with
+   vnc_count(), which needs no locked read-modify-write; those written by
+   several threads (blits, Tight workers) use vnc_count_shared(). */
+
+#if defined(_MSC_VER)
+	#define vnc_counter(p) 	((uint64_t)_InterlockedCompareExchange64((__int64 volatile *)(p), 0, 0))
+	#define vnc_counter_set(p, v) 	((void)_InterlockedExchange64((__int64 volatile *)(p), (__int64)(v)))
+	#define vnc_count_shared(p, v) 	((void)_InterlockedExchangeAdd64((__int64 volatile *)(p), (__int64)(v)))
+	static __forceinline void vnc_count_max(uint64_t *p, uint64_t v)
+	{
+		__int64 old = _InterlockedCompareExchange64((__int64 volatile *)p, 0, 0), seen;
+		while (v > (uint64_t)old) {
+			seen = _InterlockedCompareExchange64((__int64 volatile *)p, (__int64)v, old);
+			if (seen == old) break;
+			old = seen;
+		}
+	}
+#else
+	#define vnc_counter(p) 	__atomic_load_n((p), __ATOMIC_RELAXED)
+	#define vnc_counter_set(p, v) 	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+	#define vnc_count_shared(p, v) 	((void)__atomic_fetch_add((p), (v), __ATOMIC_RELAXED))
+	static inline void vnc_count_max(uint64_t *p, uint64_t v)
+	{
+		uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+		while (v > old && !__atomic_compare_exchange_n(p, &old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+#endif
+#define vnc_count(p, v) 	vnc_counter_set((p), vnc_counter(p) + (v))
+
+/* For decoders instantiated once per pixel size: with a constant bpp the
+   per-pixel conversions below fold away */
+#if defined(__GNUC__)
+	#define VNC_INLINE	static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+	#define VNC_INLINE	static __forceinline
+#else
+	#define VNC_INLINE	static inline
+#endif
+
+/* Framebuffer colour of the bpp byte wire pixel at p (see pixel.c) */
+VNC_INLINE uint32_t vnc_pixel(const tSDL_vnc *vnc, const unsigned char *p, int bpp)
+{
+	uint32_t color;
+	switch (bpp) {
+	case 1:
+		return vnc->pixellut[0][p[0]];
+	case 2:
+		return vnc->pixellut[0][p[0]] | vnc->pixellut[1][p[1]];
+	default:
+		memcpy(&color, p, 4);
+		return color;
+	}
+}
+
+#define CHECKED_READ(vnc, dest, len, message) { \
+    int result = Recv(vnc, dest, len); \
+    if (result!=len) { \
+    printf("Error reading %s. Got %i of %i bytes.\n", message, result, len); \
+    return 0; \
+    } \
+    }
+
+/* A piece of memory a read can land in */
+typedef struct tSDL_vnc_iov {
+    unsigned char *base;
+    size_t len;
+} tSDL_vnc_iov;
+
+/* From SDL_vnc.c */
+int Recv(tSDL_vnc *vnc, void *buf, size_t len);
+int RecvRows(tSDL_vnc *vnc, void *dest, size_t pitch, size_t rowlen, int rows);
+void vnc_to_sdl_rect(tSDL_vnc_rect * src, SDL_Rect * dest);
+void GrowUpdateRegion(tSDL_vnc *vnc, SDL_Rect *trec);
+int RectInFramebuffer(tSDL_vnc * vnc, tSDL_vnc_rect * rect);
+uint64_t MonotonicMicroseconds(void);
+
+/* Slots of the scratch pool, one per piece of work memory a decoder
+   needs at the same time */
+#define SCRATCH_CURSOR		0
+#define SCRATCH_RAW		1
+
+void *ScratchBuffer(tSDL_vnc *vnc, int slot, size_t size);
+void CountAllocation(tSDL_vnc *vnc, size_t bytes);
+void CountDecodeTime(tSDL_vnc *vnc, int32_t encoding, uint64_t decodetime);
+
+/* Events for ServiceConnection(), as returned by WaitForMessage(); 0 is a
+   timeout, <0 an error */
+#define WAIT_SERVER	1
+#define WAIT_INPUT	2
+
+int ServiceConnection(tSDL_vnc *vnc, int event);
+uint64_t UpdateRequestDeadline(tSDL_vnc *vnc);
+int HandleServerMessage(tSDL_vnc *vnc);
+int ServerDataFd(tSDL_vnc *vnc);
+void WakeClient(tSDL_vnc *vnc);
+int StartReceiving(tSDL_vnc *vnc);
+
+/* From parser.c */
+int ParserCreate(tSDL_vnc *vnc);
+void ParserFree(tSDL_vnc *vnc);
+int ParserRecv(tSDL_vnc *vnc, void *buf, size_t len);
+int ParserRecvRows(tSDL_vnc *vnc, unsigned char *dest, size_t pitch, size_t rowlen, int rows);
+int ParserTargets(tSDL_vnc *vnc, tSDL_vnc_iov *iov, int max);
+int ParserFill(tSDL_vnc *vnc, size_t direct, const void *data, size_t len);
+
+/* From support.c */
+int read_raw(tSDL_vnc * vnc, tSDL_vnc_rect rect);
+
+/* From uring.c */
+int UringCreate(tSDL_vnc *vnc);
+void UringFree(tSDL_vnc *vnc);
+int UringFd(tSDL_vnc *vnc);
+int UringReceive(tSDL_vnc *vnc);
+
+/* From pixel.c */
+void PixelFormatFor(int bpp, tSDL_vnc_pixelFormat * pf);
+void PixelFormatTables(tSDL_vnc * vnc);
+void vnc_expand_pixels(tSDL_vnc * vnc, uint32_t * dest, const unsigned char * src, int count);
+int ColormapUpdate(tSDL_vnc * vnc, int first, int count, const uint32_t * colors, SDL_Rect * changed);
+
+/* From fill.c */
+typedef struct tSDL_vnc_span {
+    uint16_t x, y, w, h;
+    uint32_t color;
+} tSDL_vnc_span;
+
+void vnc_fill_rect(uint32_t * dest, uint32_t pitch, int w, int h, uint32_t color);
+void vnc_fill_spans(uint32_t * base, uint32_t pitch, const tSDL_vnc_span * spans, int count);
+
+/* From tune.c */
+int TunerCreate(tSDL_vnc * vnc);
+void TunerFree(tSDL_vnc * vnc);
+void TunerRect(tSDL_vnc * vnc, int32_t encoding, int pixels, unsigned long bytes, uint64_t us);
+void TunerUpdateStart(tSDL_vnc * vnc);
+void TunerUpdateEnd(tSDL_vnc * vnc);
+int TunerPendingEncodings(tSDL_vnc * vnc, unsigned char * message);
+
+/* From cursor.c */
+int ServerRectangle_Cursor(tSDL_vnc * vnc, tSDL_vnc_rect rect);
+void cursor_free(tSDL_vnc * vnc);
+int cursor_recolor(tSDL_vnc * vnc);
+
+/* From zrle.c */
+int ServerRectangle_ZRLE(tSDL_vnc * vnc, tSDL_vnc_rect rect);
+void zrle_free(tSDL_vnc * vnc);
+
+/* From tight.c */
+int ServerRectangle_Tight(tSDL_vnc * vnc, tSDL_vnc_rect rect);
+int tight_flush(tSDL_vnc * vnc);
+void tight_free(tSDL_vnc * vnc);
+
+#endif				/* _SDL_vnc_internal_h */
@@ -0,0 +1,118 @@
+/*
+
+      BenchFill.c - Solid fill kernels against SDL_FillRect
+
+      GPL (c) A. Schiffler, aschiffler at ferzkopp dot net
+
+      Fills rectangles of the sizes RRE and Hextile subrectangles come in,
+      at scattered positions of a 32bpp surface, through SDL_FillRect()
+      and through the library's kernels (one rectangle per call, and as
+      span lists of a tile's worth), and prints fills per second.
+
+*/
+
+#if defined(WIN32) || defined(WIN64)
+ #define _CRT_SECURE_NO_DEPRECATE
+ #define _CRT_NONSTDC_NO_DEPRECATE
+ #include <windows.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
+
+#define SURFACE_W	1024
+#define SURFACE_H	768
+#define POSITIONS	4096
+#define SPANS		16
+#define RUN_MS		500
+
+static const int sizes[][2] = { {1,1}, {2,2}, {4,1}, {4,4}, {8,8}, {16,1}, {16,16}, {64,64} };
+
+static SDL_Rect positions[POSITIONS];
+
+static void make_positions(int w, int h)
+{
+ int i;
+ srand(1);
+ for (i=0; i<POSITIONS; i++) {
+  positions[i].x = rand() % (SURFACE_W - w + 1);
+  positions[i].y = rand() % (SURFACE_H - h + 1);
+  positions[i].w = w;
+  positions[i].h = h;
+ }
+}
+
+/* Fills per second of one method, run for about RUN_MS */
+static double bench(SDL_Surface *surface, int method)
+{
+ uint32_t *pixels = (uint32_t *)surface->pixels;
+ uint32_t pitch = surface->pitch / 4;
+ tSDL_vnc_span spans[SPANS];
+ unsigned long fills = 0;
+ Uint32 start = SDL_GetTicks(), elapsed;
+ int i, k;
+
+ do {
+  for (i=0; i<POSITIONS; i+=SPANS) {
+   switch (method) {
+    case 0:
+     for (k=0; k<SPANS; k++) {
+      SDL_Rect rect = positions[i+k];
+      SDL_FillRect(surface, &rect, i+k);
+     }
+     break;
+    case 1:
+     for (k=0; k<SPANS; k++) {
+      SDL_Rect *rect = &positions[i+k];
+      vnc_fill_rect(pixels + rect->y * pitch + rect->x, pitch, rect->w, rect->h, i+k);
+     }
+     break;
+    default:
+     for (k=0; k<SPANS; k++) {
+      spans[k].x = positions[i+k].x;
+      spans[k].y = positions[i+k].y;
+      spans[k].w = positions[i+k].w;
+      spans[k].h = positions[i+k].h;
+      spans[k].color = i+k;
+     }
+     vnc_fill_spans(pixels, pitch, spans, SPANS);
+     break;
+   }
+  }
+  fills += POSITIONS;
+  elapsed = SDL_GetTicks() - start;
+ } while (elapsed < RUN_MS);
+
+ return fills * 1000.0 / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+ SDL_Surface *surface;
+ unsigned int i;
+
+ surface = SDL_CreateRGBSurface(SDL_SWSURFACE, SURFACE_W, SURFACE_H, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+ if (!surface) {
+  fprintf(stderr, "Could not create %ix%i surface.\n", SURFACE_W, SURFACE_H);
+  exit(1);
+ }
+
+ printf("%-8s %16s %16s %16s %8s\n", "size", "SDL_FillRect/s", "vnc_fill_rect/s", "vnc_fill_spans/s", "speedup");
+ for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+  double sdl, rect, spans;
+  char name[16];
+  make_positions(sizes[i][0], sizes[i][1]);
+  sdl = bench(surface, 0);
+  rect = bench(surface, 1);
+  spans = bench(surface, 2);
+  snprintf(name, sizeof(name), "%ix%i", sizes[i][0], sizes[i][1]);
+  printf("%-8s %16.0f %16.0f %16.0f %7.1fx\n", name, sdl, rect, spans, (rect > spans ? rect : spans) / sdl);
+ }
+
+ SDL_FreeSurface(surface);
+ return 0;
+}
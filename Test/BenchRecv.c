@@ -0,0 +1,186 @@
+/*
+
+      BenchRecv.c - CPU time per GB received, recv() against io_uring
+
+      GPL (c) A. Schiffler, aschiffler at ferzkopp dot net
+
+      Forks a minimal RFB 3.3 server on the loopback interface that streams
+      full-screen Raw updates and closes the connection, connects to it
+      with "raw" and with "raw,uring", and prints the CPU time the client
+      process (its client thread, the server runs in the child) spent per
+      GB received. Linux only.
+
+      Usage: benchrecv [MB to stream per run, default 1024]
+
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "SDL_vnc.h"
+
+#define SCREEN_W	1024
+#define SCREEN_H	768
+
+static const char *modes[] = { "raw", "raw,uring" };
+
+/* Send all of buf, 0 once the client is gone */
+static int send_all(int fd, const void *buf, size_t len)
+{
+ const char *p = (const char *)buf;
+ while (len > 0) {
+  ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+  if (n <= 0) return 0;
+  p += n;
+  len -= n;
+ }
+ return 1;
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+ p[0] = v >> 8;
+ p[1] = v;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+ p[0] = v >> 24;
+ p[1] = v >> 16;
+ p[2] = v >> 8;
+ p[3] = v;
+}
+
+/* The child: handshake, then stream megabytes of Raw updates. Leaves
+   with _exit(), the parent's buffered output is not its to flush. */
+static void serve(int listener, long megabytes)
+{
+ unsigned char msg[64], drain[4096];
+ size_t framelen = (size_t)SCREEN_W * SCREEN_H * 4;
+ unsigned char *frame;
+ long long left = megabytes * 1024LL * 1024LL;
+ int fd, i;
+
+ fd = accept(listener, NULL, NULL);
+ if (fd < 0) _exit(1);
+
+ frame = (unsigned char *)malloc(16 + framelen);
+ if (!frame) _exit(1);
+ for (i = 0; (size_t)i < framelen; i++) frame[16 + i] = rand();
+
+ /* Version, no security, ClientInit */
+ if (!send_all(fd, "RFB 003.003\n", 12)) _exit(1);
+ if (recv(fd, msg, 12, MSG_WAITALL) != 12) _exit(1);
+ put32(msg, 1);
+ if (!send_all(fd, msg, 4)) _exit(1);
+ if (recv(fd, msg, 1, MSG_WAITALL) != 1) _exit(1);
+
+ /* ServerInit: 32bpp true colour, little endian, empty name */
+ memset(msg, 0, sizeof(msg));
+ put16(msg, SCREEN_W);
+ put16(msg + 2, SCREEN_H);
+ msg[4] = 32;
+ msg[5] = 24;
+ msg[7] = 1;
+ put16(msg + 8, 255);
+ put16(msg + 10, 255);
+ put16(msg + 12, 255);
+ msg[14] = 16;
+ msg[15] = 8;
+ if (!send_all(fd, msg, 24)) _exit(1);
+
+ /* One Raw rectangle covering the screen per update; requests are
+    read and ignored */
+ memset(frame, 0, 16);
+ put16(frame + 2, 1);
+ put16(frame + 8, SCREEN_W);
+ put16(frame + 10, SCREEN_H);
+ while (left > 0) {
+  while (recv(fd, drain, sizeof(drain), MSG_DONTWAIT) > 0);
+  if (!send_all(fd, frame, 16 + framelen)) break;
+  left -= 16 + framelen;
+ }
+ close(fd);
+ free(frame);
+ _exit(0);
+}
+
+static double seconds(struct timeval *t)
+{
+ return t->tv_sec + t->tv_usec / 1000000.0;
+}
+
+/* Run one mode, returns 0 if it could not connect */
+static int bench(const char *mode, long megabytes)
+{
+ struct sockaddr_in address;
+ socklen_t addrlen = sizeof(address);
+ struct rusage before, after;
+ struct timeval start, end;
+ tSDL_vnc vnc;
+ tSDL_vnc_stats stats;
+ pid_t server;
+ int listener, uring;
+
+ listener = socket(AF_INET, SOCK_STREAM, 0);
+ memset(&address, 0, sizeof(address));
+ address.sin_family = AF_INET;
+ address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+ if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 1) != 0 ||
+     getsockname(listener, (struct sockaddr *)&address, &addrlen) != 0) {
+  fprintf(stderr, "Could not listen on the loopback interface.\n");
+  return 0;
+ }
+ server = fork();
+ if (server == 0) serve(listener, megabytes);
+ close(listener);
+
+ memset(&vnc, 0, sizeof(vnc));
+ getrusage(RUSAGE_SELF, &before);
+ gettimeofday(&start, NULL);
+ if (!vncConnect(&vnc, "127.0.0.1", ntohs(address.sin_port), (char *)mode, "", 12)) {
+  fprintf(stderr, "Could not connect with mode %s.\n", mode);
+  waitpid(server, NULL, 0);
+  return 0;
+ }
+ while (vnc.reading) SDL_Delay(10);
+ gettimeofday(&end, NULL);
+ getrusage(RUSAGE_SELF, &after);
+ vncGetStats(&vnc, &stats);
+ uring = vnc.uring != NULL;
+ vncDisconnect(&vnc);
+ waitpid(server, NULL, 0);
+
+ {
+  double gb = stats.bytesreceived / 1e9;
+  double cpu = seconds(&after.ru_utime) - seconds(&before.ru_utime) + seconds(&after.ru_stime) - seconds(&before.ru_stime);
+  double sys = seconds(&after.ru_stime) - seconds(&before.ru_stime);
+  printf("%-10s %10.0f %10.3f %10.3f %10.3f %12lu %s\n", mode, stats.bytesreceived / 1e6,
+         seconds(&end) - seconds(&start), cpu / gb, sys / gb, (unsigned long)stats.recvcalls,
+         uring ? "" : "(no io_uring)");
+ }
+ return 1;
+}
+
+int main(int argc, char *argv[])
+{
+ long megabytes = argc > 1 ? atol(argv[1]) : 1024;
+ unsigned int i;
+
+ if (megabytes < 1) megabytes = 1;
+ printf("%-10s %10s %10s %10s %10s %12s\n", "mode", "MB", "seconds", "cpu s/GB", "sys s/GB", "recv calls");
+ for (i=0; i<sizeof(modes)/sizeof(modes[0]); i++) {
+  if (!bench(modes[i], megabytes)) return 1;
+ }
+ return 0;
+}
@@ -0,0 +1,214 @@
+/*
+
+      BenchTight.c - Tight JPEG decoding on 0 to 4 worker threads
+
+      GPL (c) A. Schiffler, aschiffler at ferzkopp dot net
+
+      Encodes a few JPEG tiles, feeds a stream of full-screen updates made
+      of Tight JPEG rectangles to a parser opened with vncParserOpen(),
+      once decoding on the parser's thread and once each on 1, 2 and 4
+      worker threads, while another thread keeps blitting the framebuffer.
+      Prints frames and megapixels per second and how long the blits
+      waited for the framebuffer.
+
+      Usage: benchtight [frames per run, default 50]
+
+*/
+
+#if defined(WIN32) || defined(WIN64)
+ #define _CRT_SECURE_NO_DEPRECATE
+ #define _CRT_NONSTDC_NO_DEPRECATE
+ #include <windows.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#include "SDL_vnc.h"
+
+#define SCREEN_W	1024
+#define SCREEN_H	768
+#define TILE		128
+#define TILES		8
+#define FEED		65536
+
+static const char *modes[] = { "tight", "tight,threads=1", "tight,threads=2", "tight,threads=4" };
+
+static unsigned char *jpegs[TILES];
+static unsigned long jpeglens[TILES];
+
+static volatile int blitting;
+
+/* A smooth gradient with some noise, so the tiles decode like a photo
+   rather than a flat colour */
+static int make_tiles(void)
+{
+ unsigned char row[TILE * 3];
+ int i, x, y;
+
+ srand(1);
+ for (i=0; i<TILES; i++) {
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr err;
+  JSAMPROW rows[1];
+
+  cinfo.err = jpeg_std_error(&err);
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &jpegs[i], &jpeglens[i]);
+  cinfo.image_width = TILE;
+  cinfo.image_height = TILE;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 80, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  for (y=0; y<TILE; y++) {
+   for (x=0; x<TILE; x++) {
+    row[x*3] = (x * 2 + i * 30) & 0xff;
+    row[x*3+1] = (y * 2 + (rand() & 15)) & 0xff;
+    row[x*3+2] = ((x + y) + i * 50 + (rand() & 31)) & 0xff;
+   }
+   rows[0] = row;
+   jpeg_write_scanlines(&cinfo, rows, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  if (!jpegs[i]) return 0;
+ }
+ return 1;
+}
+
+static unsigned char *put16(unsigned char *p, unsigned int v)
+{
+ p[0] = v >> 8;
+ p[1] = v;
+ return p + 2;
+}
+
+/* One FramebufferUpdate covering the screen with Tight JPEG rectangles */
+static size_t make_update(unsigned char *p, int frame)
+{
+ unsigned char *start = p;
+ int x, y, n = 0;
+
+ *p++ = 0;
+ *p++ = 0;
+ p = put16(p, (SCREEN_W / TILE) * (SCREEN_H / TILE));
+ for (y=0; y<SCREEN_H; y+=TILE) {
+  for (x=0; x<SCREEN_W; x+=TILE, n++) {
+   int tile = (n + frame) % TILES;
+   unsigned long len = jpeglens[tile];
+   p = put16(p, x);
+   p = put16(p, y);
+   p = put16(p, TILE);
+   p = put16(p, TILE);
+   p = put16(p, 0);
+   p = put16(p, 7);
+   *p++ = 0x90;
+   // Compact length: 7 bits per byte, up to 22 bits
+   *p++ = (len & 0x7f) | (len > 0x7f ? 0x80 : 0);
+   if (len > 0x7f) {
+    *p++ = ((len >> 7) & 0x7f) | (len > 0x3fff ? 0x80 : 0);
+    if (len > 0x3fff) *p++ = len >> 14;
+   }
+   memcpy(p, jpegs[tile], len);
+   p += len;
+  }
+ }
+ return p - start;
+}
+
+/* Blit for as long as the run goes on */
+static int blitter(void *data)
+{
+ tSDL_vnc *vnc = (tSDL_vnc *)data;
+ SDL_Surface *target;
+ SDL_Rect rect;
+
+ target = SDL_CreateRGBSurface(SDL_SWSURFACE, SCREEN_W, SCREEN_H, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+ if (!target) return 0;
+ while (blitting) {
+  vncBlitFramebuffer(vnc, target, &rect);
+  SDL_Delay(1);
+ }
+ SDL_FreeSurface(target);
+ return 0;
+}
+
+/* Run one mode, returns 0 if the stream did not decode */
+static int bench(const char *mode, unsigned char *stream, size_t len, int frames)
+{
+ tSDL_vnc vnc;
+ tSDL_vnc_stats stats;
+ SDL_Thread *thread;
+ Uint32 start, elapsed;
+ size_t pos;
+ int decoded = 0;
+
+ memset(&vnc, 0, sizeof(vnc));
+ if (!vncParserOpen(&vnc, SCREEN_W, SCREEN_H, NULL, (char *)mode)) {
+  fprintf(stderr, "Could not open a parser with mode %s.\n", mode);
+  return 0;
+ }
+ blitting = 1;
+ thread = SDL_CreateThread(blitter, &vnc);
+
+ start = SDL_GetTicks();
+ for (pos=0; pos<len; pos+=FEED) {
+  int result = vncParserFeed(&vnc, stream + pos, len - pos < FEED ? (int)(len - pos) : FEED);
+  if (result < 0) break;
+  decoded += result;
+ }
+ elapsed = SDL_GetTicks() - start;
+
+ blitting = 0;
+ if (thread) SDL_WaitThread(thread, NULL);
+ vncGetStats(&vnc, &stats);
+ vncDisconnect(&vnc);
+ if (decoded != frames) {
+  fprintf(stderr, "Mode %s decoded %i of %i frames.\n", mode, decoded, frames);
+  return 0;
+ }
+ if (elapsed == 0) elapsed = 1;
+
+ printf("%-16s %10.1f %10.1f %10lu %14.0f %14lu\n", mode, frames * 1000.0 / elapsed,
+        (double)frames * SCREEN_W * SCREEN_H / 1000.0 / elapsed, (unsigned long)stats.blits,
+        stats.blits ? (double)stats.blitwait / stats.blits : 0.0, (unsigned long)stats.blitwaitmax);
+ return 1;
+}
+
+int main(int argc, char *argv[])
+{
+ int frames = argc > 1 ? atoi(argv[1]) : 50;
+ unsigned char *stream, *p;
+ size_t maxupdate = 4;
+ unsigned int i;
+ int f;
+
+ if (frames < 1) frames = 1;
+ if (!make_tiles()) {
+  fprintf(stderr, "Could not encode JPEG tiles.\n");
+  exit(1);
+ }
+ for (i=0; i<TILES; i++) {
+  if (jpeglens[i] > maxupdate) maxupdate = jpeglens[i];
+ }
+ maxupdate = 4 + (SCREEN_W / TILE) * (SCREEN_H / TILE) * (16 + 4 + maxupdate);
+ stream = (unsigned char *)malloc(maxupdate * frames);
+ if (!stream) {
+  fprintf(stderr, "Out of memory for %i frames.\n", frames);
+  exit(1);
+ }
+ for (p=stream, f=0; f<frames; f++) p += make_update(p, f);
+
+ printf("%-16s %10s %10s %10s %14s %14s\n", "mode", "frames/s", "Mpixel/s", "blits", "blit wait us", "max wait us");
+ for (i=0; i<sizeof(modes)/sizeof(modes[0]); i++) {
+  if (!bench(modes[i], stream, p - stream, frames)) return 1;
+ }
+
+ free(stream);
+ for (i=0; i<TILES; i++) free(jpegs[i]);
+ return 0;
+}
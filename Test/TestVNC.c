@@ -42,7 +42,8 @@ int   vnc_framerate = 12;
 void Draw(SDL_Surface *screen, tSDL_vnc *vnc)
 {
  SDL_Event event; 
- SDL_Rect updateRect;
+ SDL_Rect updateRects[VNC_DAMAGERECTS];
+ int numrects;
  int inloop;
  Uint8 mousebuttons, buttonmask;
  int mousex, mousey;
@@ -131,9 +132,10 @@ void Draw(SDL_Surface *screen, tSDL_vnc *vnc)
    }
 
    /* Blit VNC screen */
-   if (vncBlitFramebuffer(vnc, screen, &updateRect) ) {
+   numrects = vncBlitFramebufferRects(vnc, screen, updateRects, VNC_DAMAGERECTS);
+   if (numrects > 0) {
     /* Display by updating changed parts of the display */
-    SDL_UpdateRect(screen,updateRect.x,updateRect.y,updateRect.w,updateRect.h);
+    SDL_UpdateRects(screen, numrects, updateRects);
    }
     
    /* Delay to limit rate */                   
@@ -157,8 +159,11 @@ void PrintUsage()
  fprintf (stderr,"  -port [i]           VNC port to connect to\n");
  fprintf (stderr,"                      (default: 5900)\n");
  fprintf (stderr,"  -method [s]         Method to use, first to last.\n");
- fprintf (stderr,"                      Implemented: hextile,rre,copyrect,raw,cursor\n");
- fprintf (stderr,"                      Missing/Problems: corre,zrle,tight,desktop\n");
+ fprintf (stderr,"                      Implemented: tight,zrle,hextile,rre,copyrect,raw,cursor,desktop\n");
+ fprintf (stderr,"                      compress=[0-9],quality=[0-9] (tight tuning)\n");
+ fprintf (stderr,"                      bpp=32|16|8,colormap (pixel format on the wire)\n");
+ fprintf (stderr,"                      auto (pick encoding and compression by measured cost)\n");
+ fprintf (stderr,"                      Missing/Problems: corre\n");
  fprintf (stderr,"                      (default: hextile,rre,copyrect,raw)\n");
  fprintf (stderr,"  -password [s]       VNC password to use\n");
  fprintf (stderr,"                      (default: none)\n");
@@ -0,0 +1,265 @@
+/*
+ * Cursor pseudo-encoding (-239) decoder
+ *
+ * Licensed under the LGPL - see LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
+
+#if defined(__SSE2__)
+#define CURSOR_SSE2
+#include <emmintrin.h>
+#endif
+
+/* Servers tend to switch between a handful of shapes (arrow, I-beam,
+   resize arrows), so recent ones are kept decoded */
+#define CURSOR_CACHE 4
+
+typedef struct tSDL_vnc_cursorShape {
+    uint64_t hash;                  // of size, pixels and mask; 0 = unused
+    int w, h;
+    SDL_Surface *surface;           // decoded RGBA image, at least w x h; only grows
+    unsigned long lastuse;
+} tSDL_vnc_cursorShape;
+
+typedef struct tSDL_vnc_cursor {
+    tSDL_vnc_cursorShape shapes[CURSOR_CACHE];
+    unsigned long clock;
+    unsigned long hits;             // updates served from the cache
+    unsigned long misses;           // updates that had to be decoded
+} tSDL_vnc_cursor;
+
+
+static tSDL_vnc_cursor * cursor_state(tSDL_vnc * vnc)
+{
+    if (!vnc->cursor) {
+        tSDL_vnc_cursor * c = (tSDL_vnc_cursor *)calloc(1, sizeof(tSDL_vnc_cursor));
+        if (!c) {
+            DBERROR("Out of memory allocating cursor cache.\n");
+            return NULL;
+        }
+        /* The blank image made at connect time becomes the first slot */
+        c->shapes[0].surface = vnc->cursorbuffer;
+        vnc->cursor = c;
+    }
+    return (tSDL_vnc_cursor *)vnc->cursor;
+}
+
+
+void cursor_free(tSDL_vnc * vnc)
+{
+    tSDL_vnc_cursor * c = (tSDL_vnc_cursor *)vnc->cursor;
+    int i;
+
+    if (c) {
+        for (i = 0; i < CURSOR_CACHE; i++) {
+            if (c->shapes[i].surface && c->shapes[i].surface != vnc->cursorbuffer) {
+                SDL_FreeSurface(c->shapes[i].surface);
+            }
+        }
+        free(c);
+        vnc->cursor = NULL;
+    }
+    if (vnc->cursorbuffer) {
+        SDL_FreeSurface(vnc->cursorbuffer);
+        vnc->cursorbuffer = NULL;
+    }
+}
+
+
+/* 64 bit multiply-xorshift hash, a word at a time */
+static uint64_t cursor_hash(const unsigned char * data, size_t len, int w, int h)
+{
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL ^ ((uint64_t)w << 32 | (uint32_t)h);
+    uint64_t word;
+
+    for (; len >= 8; len -= 8, data += 8) {
+        memcpy(&word, data, 8);
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    word = 0;
+    memcpy(&word, data, len);
+    hash = (hash ^ word ^ len) * prime;
+    hash ^= hash >> 32;
+    return hash ? hash : 1;
+}
+
+
+/* Colour of each pixel plus alpha from its bit in the mask (most
+   significant bit first), eight pixels per step */
+static void cursor_expand_row(uint32_t * dest, const uint32_t * src, const unsigned char * mask,
+                              int w, uint32_t color, uint32_t alpha)
+{
+    int x = 0;
+#ifdef CURSOR_SSE2
+    const __m128i bitslo = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+    const __m128i bitshi = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+    const __m128i vcolor = _mm_set1_epi32((int)color);
+    const __m128i valpha = _mm_set1_epi32((int)alpha);
+    for (; x + 8 <= w; x += 8) {
+        __m128i m = _mm_set1_epi32(mask[x >> 3]);
+        __m128i selectlo = _mm_cmpeq_epi32(_mm_and_si128(m, bitslo), bitslo);
+        __m128i selecthi = _mm_cmpeq_epi32(_mm_and_si128(m, bitshi), bitshi);
+        __m128i lo = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(src + x + 4));
+        lo = _mm_or_si128(_mm_and_si128(lo, vcolor), _mm_and_si128(selectlo, valpha));
+        hi = _mm_or_si128(_mm_and_si128(hi, vcolor), _mm_and_si128(selecthi, valpha));
+        _mm_storeu_si128((__m128i *)(dest + x), lo);
+        _mm_storeu_si128((__m128i *)(dest + x + 4), hi);
+    }
+#endif
+    for (; x < w; x++) {
+        dest[x] = (src[x] & color) | ((mask[x >> 3] & (0x80 >> (x & 7))) ? alpha : 0);
+    }
+}
+
+
+/* Decode into the least recently used slot, growing its image if the
+   cursor does not fit */
+static tSDL_vnc_cursorShape * cursor_decode(tSDL_vnc * vnc, tSDL_vnc_cursor * c, uint64_t hash,
+                                            int w, int h, const unsigned char * data)
+{
+    tSDL_vnc_cursorShape * shape = &c->shapes[0];
+    int i;
+
+    /* Never the image currently shown, which is the most recently used */
+    for (i = 1; i < CURSOR_CACHE; i++) {
+        if (c->shapes[i].lastuse < shape->lastuse) shape = &c->shapes[i];
+    }
+
+    SDL_Surface * surface = shape->surface;
+    if (!surface || surface->w < w || surface->h < h) {
+        int sw = surface && surface->w > w ? surface->w : w;
+        int sh = surface && surface->h > h ? surface->h : h;
+        SDL_Surface * grown = SDL_CreateRGBSurface(SDL_SWSURFACE, sw, sh, 32, vnc->rmask, vnc->gmask, vnc->bmask, vnc->amask);
+        if (!grown) {
+            DBERROR("Could not create %ix%i cursor image.\n", sw, sh);
+            return NULL;
+        }
+        SDL_SetAlpha(grown, SDL_SRCALPHA, 0);
+        CountAllocation(vnc, (size_t)grown->pitch * sh);
+        DBMESSAGE("Cursor image grown to %ix%i.\n", sw, sh);
+        /* The old image may still be on screen until the switch below */
+        if (surface && surface != vnc->cursorbuffer) SDL_FreeSurface(surface);
+        surface = shape->surface = grown;
+    }
+
+    const unsigned char * mask = data + w * h * vnc->bpp;
+    int maskpitch = (w + 7) / 8;
+    uint32_t color = vnc->rmask | vnc->gmask | vnc->bmask;
+    int y;
+    SDL_LockSurface(surface);
+    for (y = 0; y < h; y++) {
+        uint32_t * dest = (uint32_t *)((unsigned char *)surface->pixels + y * surface->pitch);
+        const uint32_t * src = (const uint32_t *)(data + y * w * 4);
+        if (vnc->bpp < 4) {
+            /* Smaller pixels are expanded first, the mask applied in place */
+            vnc_expand_pixels(vnc, dest, data + y * w * vnc->bpp, w);
+            src = dest;
+        }
+        cursor_expand_row(dest, src, mask + y * maskpitch, w, color, vnc->amask);
+    }
+    SDL_UnlockSurface(surface);
+
+    shape->hash = hash;
+    shape->w = w;
+    shape->h = h;
+    return shape;
+}
+
+
+/* Make shape the cursor image, with its hotspot at x,y */
+static void cursor_show(tSDL_vnc * vnc, tSDL_vnc_cursor * c, tSDL_vnc_cursorShape * shape, int x, int y)
+{
+    int i;
+
+    shape->lastuse = ++c->clock;
+    SDL_LockMutex(vnc->mutex);
+    SDL_Surface * previous = vnc->cursorbuffer;
+    vnc->cursorbuffer = shape->surface;
+    vnc->cursorhotspot.x = x;
+    vnc->cursorhotspot.y = y;
+    vnc->cursorhotspot.w = shape->w;
+    vnc->cursorhotspot.h = shape->h;
+    vnc->gotcursor = 1;
+    SDL_UnlockMutex(vnc->mutex);
+
+    /* An image replaced by a larger one while it was shown can go now */
+    for (i = 0; i < CURSOR_CACHE; i++) {
+        if (c->shapes[i].surface == previous) break;
+    }
+    if (i == CURSOR_CACHE && previous != vnc->cursorbuffer) SDL_FreeSurface(previous);
+}
+
+
+/* In colour map mode a palette change makes every decoded shape stale.
+   The one shown is decoded again from its data, which is still in the
+   scratch buffer; the others are decoded when they come back. */
+int cursor_recolor(tSDL_vnc * vnc)
+{
+    tSDL_vnc_cursor * c = (tSDL_vnc_cursor *)vnc->cursor;
+    tSDL_vnc_cursorShape * shown = NULL;
+    int i;
+
+    if (!c) return 1;
+    for (i = 0; i < CURSOR_CACHE; i++) {
+        if (c->shapes[i].hash && c->shapes[i].surface == vnc->cursorbuffer) shown = &c->shapes[i];
+        else c->shapes[i].hash = 0;
+    }
+    if (!shown) return 1;
+
+    uint64_t hash = shown->hash;
+    shown->hash = 0;
+    tSDL_vnc_cursorShape * shape = cursor_decode(vnc, c, hash, shown->w, shown->h,
+                                                 (const unsigned char *)vnc->scratch[SCRATCH_CURSOR]);
+    if (!shape) return 0;
+    cursor_show(vnc, c, shape, vnc->cursorhotspot.x, vnc->cursorhotspot.y);
+    return 1;
+}
+
+
+int ServerRectangle_Cursor(tSDL_vnc * vnc, tSDL_vnc_rect rect)
+{
+    DBMESSAGE("CURSOR pseudo-encoding.\n");
+
+    tSDL_vnc_cursor * c = cursor_state(vnc);
+    if (!c) return 0;
+
+    /* Pixels and mask arrive back to back; read both in one go */
+    int w = rect.width, h = rect.height;
+    if (w > VNC_MAXCURSOR || h > VNC_MAXCURSOR) {
+        DBERROR("Bad cursor size %ix%i.\n", w, h);
+        return 0;
+    }
+    int bytes_to_read = w * h * vnc->bpp + (w + 7) / 8 * h;
+    unsigned char * data = (unsigned char *)ScratchBuffer(vnc, SCRATCH_CURSOR, bytes_to_read);
+    if (!data) return 0;
+    CHECKED_READ(vnc, data, bytes_to_read, "cursor data");
+    DBMESSAGE("Read cursor data %u byte.\n", bytes_to_read);
+
+    uint64_t hash = cursor_hash(data, bytes_to_read, w, h);
+    tSDL_vnc_cursorShape * shape = NULL;
+    int i;
+    for (i = 0; i < CURSOR_CACHE; i++) {
+        if (c->shapes[i].hash == hash && c->shapes[i].w == w && c->shapes[i].h == h) {
+            shape = &c->shapes[i];
+            break;
+        }
+    }
+    if (shape) {
+        c->hits++;
+    } else {
+        c->misses++;
+        shape = cursor_decode(vnc, c, hash, w, h, data);
+        if (!shape) return 0;
+    }
+    cursor_show(vnc, c, shape, rect.x, rect.y);
+    return 1;
+}
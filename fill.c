@@ -0,0 +1,122 @@
+/*
+ * Solid rectangle fill kernels for 32bpp framebuffers
+ *
+ * Licensed under the LGPL - see LICENSE
+ *
+ */
+
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILL_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*tFillKernel)(uint32_t * dest, uint32_t pitch, int w, int h, uint32_t color);
+
+
+static void fill_rect_scalar(uint32_t * dest, uint32_t pitch, int w, int h, uint32_t color)
+{
+    int x;
+    for (; h > 0; h--, dest += pitch) {
+        for (x = 0; x < w; x++) dest[x] = color;
+    }
+}
+
+
+#ifdef FILL_X86
+
+__attribute__((target("sse2")))
+static void fill_rect_sse2(uint32_t * dest, uint32_t pitch, int w, int h, uint32_t color)
+{
+    __m128i v = _mm_set1_epi32((int)color);
+    int x;
+    for (; h > 0; h--, dest += pitch) {
+        for (x = 0; x + 4 <= w; x += 4) _mm_storeu_si128((__m128i *)(dest + x), v);
+        for (; x < w; x++) dest[x] = color;
+    }
+}
+
+
+__attribute__((target("avx2")))
+static void fill_rect_avx2(uint32_t * dest, uint32_t pitch, int w, int h, uint32_t color)
+{
+    __m256i v = _mm256_set1_epi32((int)color);
+    int x;
+    for (; h > 0; h--, dest += pitch) {
+        for (x = 0; x + 8 <= w; x += 8) _mm256_storeu_si256((__m256i *)(dest + x), v);
+        if (x + 4 <= w) {
+            _mm_storeu_si128((__m128i *)(dest + x), _mm256_castsi256_si128(v));
+            x += 4;
+        }
+        for (; x < w; x++) dest[x] = color;
+    }
+}
+
+#endif
+
+
+#ifdef FILL_X86
+
+/* Selected on first use. Decoder threads of several connections may get
+   there at once, so the pointer is only accessed atomically; they all
+   store the same kernel. */
+static tFillKernel fill_kernel;
+
+static tFillKernel fill_resolve(void)
+{
+    /* libgcc has detected the CPU by now; no __builtin_cpu_init(), which
+       would write its globals from whichever threads get here */
+    tFillKernel kernel = fill_rect_scalar;
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = fill_rect_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = fill_rect_sse2;
+    }
+    DBMESSAGE("Fill kernel: %s\n", kernel == fill_rect_scalar ? "scalar" : "SIMD");
+    __atomic_store_n(&fill_kernel, kernel, __ATOMIC_RELAXED);
+    return kernel;
+}
+
+static inline tFillKernel fill_get_kernel(void)
+{
+    tFillKernel kernel = __atomic_load_n(&fill_kernel, __ATOMIC_RELAXED);
+    return kernel ? kernel : fill_resolve();
+}
+
+#else
+
+static inline tFillKernel fill_get_kernel(void)
+{
+    return fill_rect_scalar;
+}
+
+#endif
+
+
+void vnc_fill_rect(uint32_t * dest, uint32_t pitch, int w, int h, uint32_t color)
+{
+    /* Narrow fills gain nothing from vectors and lose the call overhead */
+    if (w < 4) {
+        fill_rect_scalar(dest, pitch, w, h, color);
+    } else {
+        fill_get_kernel()(dest, pitch, w, h, color);
+    }
+}
+
+
+void vnc_fill_spans(uint32_t * base, uint32_t pitch, const tSDL_vnc_span * spans, int count)
+{
+    tFillKernel kernel = fill_get_kernel();
+    int i;
+    for (i = 0; i < count; i++) {
+        const tSDL_vnc_span * s = &spans[i];
+        uint32_t * dest = base + s->y * pitch + s->x;
+        if (s->w < 4) {
+            fill_rect_scalar(dest, pitch, s->w, s->h, s->color);
+        } else {
+            kernel(dest, pitch, s->w, s->h, s->color);
+        }
+    }
+}
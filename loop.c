@@ -0,0 +1,403 @@
+/*
+ * Event loop driving many connections from a few threads (Linux epoll)
+ *
+ * Licensed under the LGPL - see LICENSE
+ *
+ */
+
+#if defined(__linux__) && !defined(_POSIX_C_SOURCE)
+/* For CLOCK_MONOTONIC and pipe() in strict ISO C builds */
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define LOOP_MAXTHREADS 16
+#define LOOP_MAXEVENTS 64
+
+/* Each loop thread has an epoll set of its own and a connection stays on
+   the thread it was added to, so its parser (and its io_uring, whose
+   completions are tied to the thread that submitted) always runs on that
+   thread.
+
+   What an epoll event refers to: the kind of fd in the low bits, the slot
+   of the connection above them and the slot's generation in the upper
+   half, so events for a removed connection are recognized as stale. */
+#define SOURCE_SOCKET	0
+#define SOURCE_WAKEUP	1
+#define SOURCE_TIMER	2
+#define SOURCE_QUIT	3
+
+typedef struct tSDL_vnc_loopThread {
+    struct tSDL_vnc_loop *loop;
+    int epoll;
+    SDL_Thread *thread;
+    int nconns;                 // connections it drives
+} tSDL_vnc_loopThread;
+
+typedef struct tSDL_vnc_loopConn {
+    tSDL_vnc *vnc;
+    tSDL_vnc_loopThread *owner; // the thread handling all its events
+    int timer;                  // timerfd pacing update requests
+    uint32_t generation;
+    int users;                  // set while its thread handles an event
+    int finished;               // connection ended, fds left the epoll set
+    SDL_mutex *lock;            // one event at a time per connection
+} tSDL_vnc_loopConn;
+
+struct tSDL_vnc_loop {
+    int quit[2];                // pipe that stays readable once the loop stops
+    tSDL_vnc_loopThread threads[LOOP_MAXTHREADS];
+    int nthreads;
+    SDL_mutex *lock;            // guards conns, the users counts and nconns
+    SDL_cond *idle;             // signalled when a connection's users drop to 0
+    tSDL_vnc_loopConn **conns;
+    int nconns;
+    uint32_t generation;
+};
+
+
+static uint64_t loop_key(int slot, uint32_t generation, int source)
+{
+    return ((uint64_t)generation << 32) | ((uint32_t)slot << 2) | source;
+}
+
+
+static int loop_watch(tSDL_vnc_loopConn * conn, int op, int fd, uint64_t key)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    /* One shot, so a connection's fd is not reported again before its
+       event has been handled and it is re-armed */
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = key;
+    return epoll_ctl(conn->owner->epoll, op, fd, &event);
+}
+
+
+/* Arm the connection's timer for its next request deadline, or disarm it
+   when only traffic can create work, so idle connections stay asleep */
+static void loop_arm_timer(tSDL_vnc_loopConn * conn)
+{
+    struct itimerspec when;
+    uint64_t deadline = UpdateRequestDeadline(conn->vnc);
+
+    memset(&when, 0, sizeof(when));
+    if (deadline) {
+        when.it_value.tv_sec = deadline / 1000000;
+        when.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    }
+    timerfd_settime(conn->timer, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+
+static void loop_unwatch(tSDL_vnc_loopConn * conn)
+{
+    int epoll = conn->owner->epoll;
+    epoll_ctl(epoll, EPOLL_CTL_DEL, ServerDataFd(conn->vnc), NULL);
+    if (conn->vnc->wakeup[0] >= 0) epoll_ctl(epoll, EPOLL_CTL_DEL, conn->vnc->wakeup[0], NULL);
+    epoll_ctl(epoll, EPOLL_CTL_DEL, conn->timer, NULL);
+}
+
+
+/* Handle one event of a connection and re-arm its fd */
+static void loop_service(tSDL_vnc_loopConn * conn, int slot, int source)
+{
+    tSDL_vnc *vnc = conn->vnc;
+    int fd = -1;
+    int alive = 1;
+
+    SDL_LockMutex(conn->lock);
+    if (conn->finished) {
+        SDL_UnlockMutex(conn->lock);
+        return;
+    }
+
+    /* The first event starts receiving on this thread. If that sets up
+       io_uring, the ring fd takes the socket's place in the epoll set. */
+    if (!vnc->receiving) {
+        int uring = vnc->wanturing;
+        if (uring) epoll_ctl(conn->owner->epoll, EPOLL_CTL_DEL, vnc->socket, NULL);
+        alive = StartReceiving(vnc);
+        if (uring) loop_watch(conn, EPOLL_CTL_ADD, ServerDataFd(vnc), loop_key(slot, conn->generation, SOURCE_SOCKET));
+    }
+
+    if (alive) {
+        switch (source) {
+        case SOURCE_SOCKET:
+            fd = ServerDataFd(vnc);
+            /* The parser consumes everything received, nothing stays buffered */
+            alive = ServiceConnection(vnc, WAIT_SERVER);
+            break;
+        case SOURCE_WAKEUP:
+            fd = vnc->wakeup[0];
+            alive = ServiceConnection(vnc, WAIT_INPUT);
+            break;
+        default:
+            fd = conn->timer;
+            {
+                uint64_t expirations;
+                if (read(conn->timer, &expirations, sizeof(expirations)) < 0) {
+                    DBMESSAGE("Spurious timer event.\n");
+                }
+            }
+            alive = ServiceConnection(vnc, 0);
+            break;
+        }
+    }
+
+    if (alive) {
+        loop_arm_timer(conn);
+        loop_watch(conn, EPOLL_CTL_MOD, fd, loop_key(slot, conn->generation, source));
+    } else {
+        DBMESSAGE("Connection in loop slot %i finished.\n", slot);
+        vnc->reading = 0;
+        conn->finished = 1;
+        loop_unwatch(conn);
+    }
+    SDL_UnlockMutex(conn->lock);
+}
+
+
+static int loop_thread(void *data)
+{
+    tSDL_vnc_loopThread *thread = (tSDL_vnc_loopThread *) data;
+    tSDL_vnc_loop *loop = thread->loop;
+    struct epoll_event events[LOOP_MAXEVENTS];
+
+    for (;;) {
+        int n = epoll_wait(thread->epoll, events, LOOP_MAXEVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            DBERROR("epoll_wait failed.\n");
+            return 0;
+        }
+
+        int i;
+        for (i = 0; i < n; i++) {
+            uint64_t key = events[i].data.u64;
+            int source = key & 3;
+            int slot = (uint32_t)key >> 2;
+            uint32_t generation = key >> 32;
+
+            if (source == SOURCE_QUIT) return 0;
+
+            /* Look the connection up, it may have been removed meanwhile */
+            SDL_LockMutex(loop->lock);
+            tSDL_vnc_loopConn *conn = slot < loop->nconns ? loop->conns[slot] : NULL;
+            if (!conn || conn->generation != generation) {
+                SDL_UnlockMutex(loop->lock);
+                continue;
+            }
+            conn->users++;
+            SDL_UnlockMutex(loop->lock);
+
+            loop_service(conn, slot, source);
+
+            SDL_LockMutex(loop->lock);
+            if (--conn->users == 0) SDL_CondBroadcast(loop->idle);
+            SDL_UnlockMutex(loop->lock);
+        }
+    }
+}
+
+
+tSDL_vnc_loop *vncLoopCreate(int threads)
+{
+    tSDL_vnc_loop *loop = (tSDL_vnc_loop *) calloc(1, sizeof(tSDL_vnc_loop));
+    if (!loop) {
+        DBERROR("Out of memory allocating event loop.\n");
+        return NULL;
+    }
+    loop->quit[0] = loop->quit[1] = -1;
+    if (pipe(loop->quit) != 0) {
+        DBERROR("Could not create event loop.\n");
+        vncLoopDestroy(loop);
+        return NULL;
+    }
+    loop->lock = SDL_CreateMutex();
+    loop->idle = SDL_CreateCond();
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = SOURCE_QUIT;
+
+    if (threads < 1) threads = 1;
+    if (threads > LOOP_MAXTHREADS) threads = LOOP_MAXTHREADS;
+    for (loop->nthreads = 0; loop->nthreads < threads; loop->nthreads++) {
+        tSDL_vnc_loopThread *thread = &loop->threads[loop->nthreads];
+        thread->loop = loop;
+        thread->epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (thread->epoll < 0) break;
+        epoll_ctl(thread->epoll, EPOLL_CTL_ADD, loop->quit[0], &event);
+        thread->thread = SDL_CreateThread(loop_thread, thread);
+        if (!thread->thread) {
+            close(thread->epoll);
+            break;
+        }
+    }
+    if (loop->nthreads == 0) {
+        DBERROR("Could not start event loop threads.\n");
+        vncLoopDestroy(loop);
+        return NULL;
+    }
+    DBMESSAGE("Event loop running on %i threads.\n", loop->nthreads);
+    return loop;
+}
+
+
+int vncLoopAdd(tSDL_vnc_loop * loop, tSDL_vnc * vnc)
+{
+    if (!loop || !vnc || !vnc->reading) return 0;
+    if (vnc->thread) {
+        DBERROR("Connection already has a client thread; connect with \"nothread\".\n");
+        return 0;
+    }
+
+    tSDL_vnc_loopConn *conn = (tSDL_vnc_loopConn *) calloc(1, sizeof(tSDL_vnc_loopConn));
+    if (!conn) {
+        DBERROR("Out of memory adding connection to event loop.\n");
+        return 0;
+    }
+    conn->vnc = vnc;
+    conn->lock = SDL_CreateMutex();
+    conn->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (conn->timer < 0 || !conn->lock) {
+        DBERROR("Could not create timer for event loop connection.\n");
+        if (conn->timer >= 0) close(conn->timer);
+        if (conn->lock) SDL_DestroyMutex(conn->lock);
+        free(conn);
+        return 0;
+    }
+
+    SDL_LockMutex(loop->lock);
+    int slot;
+    for (slot = 0; slot < loop->nconns && loop->conns[slot]; slot++);
+    if (slot == loop->nconns) {
+        tSDL_vnc_loopConn **conns = (tSDL_vnc_loopConn **) realloc(loop->conns, (loop->nconns + 1) * sizeof(*conns));
+        if (!conns) {
+            SDL_UnlockMutex(loop->lock);
+            DBERROR("Out of memory adding connection to event loop.\n");
+            close(conn->timer);
+            SDL_DestroyMutex(conn->lock);
+            free(conn);
+            return 0;
+        }
+        loop->conns = conns;
+        loop->nconns++;
+    }
+    loop->conns[slot] = conn;
+    conn->generation = ++loop->generation;
+    /* The thread with the fewest connections takes it for good */
+    int i;
+    conn->owner = &loop->threads[0];
+    for (i = 1; i < loop->nthreads; i++) {
+        if (loop->threads[i].nconns < conn->owner->nconns) conn->owner = &loop->threads[i];
+    }
+    conn->owner->nconns++;
+    SDL_UnlockMutex(loop->lock);
+
+    /* Arm the timer before the fds go live, the loop thread may pick the
+       connection up right away */
+    loop_arm_timer(conn);
+    loop_watch(conn, EPOLL_CTL_ADD, ServerDataFd(vnc), loop_key(slot, conn->generation, SOURCE_SOCKET));
+    if (vnc->wakeup[0] >= 0) {
+        loop_watch(conn, EPOLL_CTL_ADD, vnc->wakeup[0], loop_key(slot, conn->generation, SOURCE_WAKEUP));
+    }
+    loop_watch(conn, EPOLL_CTL_ADD, conn->timer, loop_key(slot, conn->generation, SOURCE_TIMER));
+    /* Have its thread start receiving, with what came along with the
+       handshake and, if asked for, io_uring */
+    WakeClient(vnc);
+    return 1;
+}
+
+
+void vncLoopRemove(tSDL_vnc_loop * loop, tSDL_vnc * vnc)
+{
+    if (!loop || !vnc) return;
+
+    SDL_LockMutex(loop->lock);
+    int slot;
+    for (slot = 0; slot < loop->nconns; slot++) {
+        if (loop->conns[slot] && loop->conns[slot]->vnc == vnc) break;
+    }
+    if (slot == loop->nconns) {
+        SDL_UnlockMutex(loop->lock);
+        return;
+    }
+    tSDL_vnc_loopConn *conn = loop->conns[slot];
+    loop->conns[slot] = NULL;
+    /* Wait for its thread to finish an event it is handling */
+    while (conn->users > 0) SDL_CondWait(loop->idle, loop->lock);
+    conn->owner->nconns--;
+    SDL_UnlockMutex(loop->lock);
+
+    if (!conn->finished) loop_unwatch(conn);
+    close(conn->timer);
+    SDL_DestroyMutex(conn->lock);
+    free(conn);
+}
+
+
+void vncLoopDestroy(tSDL_vnc_loop * loop)
+{
+    int i;
+
+    if (!loop) return;
+    if (loop->quit[1] >= 0) {
+        char byte = 0;
+        if (write(loop->quit[1], &byte, 1) < 0) {
+            DBERROR("Could not stop event loop threads.\n");
+        }
+    }
+    for (i = 0; i < loop->nthreads; i++) SDL_WaitThread(loop->threads[i].thread, NULL);
+    for (i = 0; i < loop->nconns; i++) {
+        if (loop->conns[i]) vncLoopRemove(loop, loop->conns[i]->vnc);
+    }
+    free(loop->conns);
+    if (loop->idle) SDL_DestroyCond(loop->idle);
+    if (loop->lock) SDL_DestroyMutex(loop->lock);
+    if (loop->quit[0] >= 0) close(loop->quit[0]);
+    if (loop->quit[1] >= 0) close(loop->quit[1]);
+    for (i = 0; i < loop->nthreads; i++) close(loop->threads[i].epoll);
+    free(loop);
+}
+
+#else
+
+/* epoll and timerfd are Linux only; elsewhere every connection keeps its
+   own client thread */
+
+tSDL_vnc_loop *vncLoopCreate(int threads)
+{
+    DBERROR("Event loop not available on this platform.\n");
+    return NULL;
+}
+
+int vncLoopAdd(tSDL_vnc_loop * loop, tSDL_vnc * vnc)
+{
+    return 0;
+}
+
+void vncLoopRemove(tSDL_vnc_loop * loop, tSDL_vnc * vnc)
+{
+}
+
+void vncLoopDestroy(tSDL_vnc_loop * loop)
+{
+}
+
+#endif
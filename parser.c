@@ -0,0 +1,305 @@
+/*
+ * Push parser: server messages decoded from bytes handed in by a driver
+ *
+ * Licensed under the LGPL - see LICENSE
+ *
+ */
+
+/*
+ * The decoders are written as straight line code pulling their input
+ * through Recv(). Rather than turning each of them into a state machine,
+ * the message loop runs as a coroutine on its own stack: when Recv() runs
+ * out of fed data it switches back to the feeder, and the next feed
+ * resumes it exactly where it stopped, mid-rectangle or mid-tile. A
+ * parser is always fed from one thread (the client thread, the loop
+ * thread its connection is pinned to, or the application thread calling
+ * vncParserFeed), but blits run on others while it waits, so decoders
+ * hold vnc->mutex across a read only where blits must wait anyway. Outside
+ * doublebuffer mode a blit may run between two reads, so decoders only
+ * write the framebuffer under the mutex: the one read straight into it,
+ * of a full-width Raw rectangle, holds the mutex throughout.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
+
+#if defined(WIN32) || defined(WIN64)
+#include <windows.h>
+#else
+#include <ucontext.h>
+#endif
+
+#define PARSER_STACKSIZE (256 * 1024)
+
+typedef struct tSDL_vnc_parser {
+#if defined(WIN32) || defined(WIN64)
+    LPVOID caller, fiber;
+#else
+    ucontext_t caller, context;
+    void *stack;
+#endif
+    tSDL_vnc *vnc;
+    const unsigned char *data;  // fed bytes not consumed yet
+    size_t datalen;
+    unsigned char *want;        // rest of the read the parser is blocked on
+    size_t wantlen;
+    unsigned char *nextrow;     // for a read of rows (see ParserRecvRows()):
+    size_t rowlen, pitch;       // the rows still to come after want
+    int rowsleft;
+    int eof;                    // flag: the driver has no more data
+    int finished;               // flag: the message loop ended, the stream is dead
+} tSDL_vnc_parser;
+
+
+static void parser_run(tSDL_vnc_parser * p)
+{
+    while (HandleServerMessage(p->vnc));
+    DBMESSAGE("Parser finished.\n");
+    p->finished = 1;
+}
+
+
+static void parser_yield(tSDL_vnc_parser * p)
+{
+#if defined(WIN32) || defined(WIN64)
+    SwitchToFiber(p->caller);
+#else
+    swapcontext(&p->context, &p->caller);
+#endif
+}
+
+
+#if defined(WIN32) || defined(WIN64)
+
+static VOID CALLBACK parser_entry(LPVOID data)
+{
+    tSDL_vnc_parser *p = (tSDL_vnc_parser *) data;
+    parser_run(p);
+    /* A fiber must not return; park it for good */
+    for (;;) parser_yield(p);
+}
+
+#else
+
+/* makecontext() only passes ints, so the pointer comes in two halves */
+static void parser_entry(unsigned int hi, unsigned int lo)
+{
+    parser_run((tSDL_vnc_parser *)(((uintptr_t)hi << 16 << 16) | lo));
+    /* Returning resumes the caller through uc_link */
+}
+
+#endif
+
+
+int ParserCreate(tSDL_vnc * vnc)
+{
+    tSDL_vnc_parser *p = (tSDL_vnc_parser *) calloc(1, sizeof(tSDL_vnc_parser));
+    if (!p) {
+        DBERROR("Out of memory allocating parser.\n");
+        return 0;
+    }
+    p->vnc = vnc;
+
+#if defined(WIN32) || defined(WIN64)
+    p->fiber = CreateFiber(PARSER_STACKSIZE, parser_entry, p);
+    if (!p->fiber) {
+        DBERROR("Could not create parser fiber.\n");
+        free(p);
+        return 0;
+    }
+#else
+    uintptr_t self = (uintptr_t)p;
+    p->stack = malloc(PARSER_STACKSIZE);
+    if (!p->stack) {
+        DBERROR("Could not create parser context.\n");
+        free(p);
+        return 0;
+    }
+    if (getcontext(&p->context) != 0) {
+        DBERROR("Could not create parser context.\n");
+        free(p->stack);
+        free(p);
+        return 0;
+    }
+    p->context.uc_stack.ss_sp = p->stack;
+    p->context.uc_stack.ss_size = PARSER_STACKSIZE;
+    p->context.uc_link = &p->caller;
+    makecontext(&p->context, (void (*)(void))parser_entry, 2,
+                (unsigned int)(self >> 16 >> 16), (unsigned int)(self & 0xffffffffu));
+#endif
+
+    vnc->parser = p;
+    return 1;
+}
+
+
+void ParserFree(tSDL_vnc * vnc)
+{
+    tSDL_vnc_parser *p = vnc->parser;
+    if (!p) return;
+#if defined(WIN32) || defined(WIN64)
+    DeleteFiber(p->fiber);
+#else
+    free(p->stack);
+#endif
+    free(p);
+    vnc->parser = NULL;
+}
+
+
+/* Mark n bytes of the pending read as delivered, moving on to the next
+   row when one is complete */
+static void parser_advance(tSDL_vnc_parser * p, size_t n)
+{
+    while (n > 0 && p->wantlen > 0) {
+        size_t k = n < p->wantlen ? n : p->wantlen;
+        p->want += k;
+        p->wantlen -= k;
+        n -= k;
+        if (p->wantlen == 0 && p->rowsleft > 0) {
+            p->want = p->nextrow;
+            p->wantlen = p->rowlen;
+            p->nextrow += p->pitch;
+            p->rowsleft--;
+        }
+    }
+}
+
+
+/* Satisfy the pending read from fed bytes, waiting for the next feed
+   whenever they run out. Returns the number of bytes left unread, which
+   is only nonzero at the end of the stream. */
+static size_t parser_read(tSDL_vnc_parser * p)
+{
+    size_t missing;
+
+    while (p->wantlen > 0) {
+        if (p->datalen > 0) {
+            size_t n = p->datalen < p->wantlen ? p->datalen : p->wantlen;
+            memcpy(p->want, p->data, n);
+            p->data += n;
+            p->datalen -= n;
+            parser_advance(p, n);
+        } else if (p->eof) {
+            break;
+        } else {
+            uint64_t waited = MonotonicMicroseconds();
+            parser_yield(p);
+            vnc_count(&p->vnc->stats.recvwait, MonotonicMicroseconds() - waited);
+        }
+    }
+    missing = p->wantlen + p->rowsleft * p->rowlen;
+    p->wantlen = 0;
+    p->rowsleft = 0;
+    return missing;
+}
+
+
+/* Recv() once the parser is running. Short only at the end of the stream. */
+int ParserRecv(tSDL_vnc * vnc, void *buf, size_t len)
+{
+    tSDL_vnc_parser *p = vnc->parser;
+
+    vnc->recvrequests++;
+    vnc->recvconsumed += len;
+    p->want = buf;
+    p->wantlen = len;
+    return len - parser_read(p);
+}
+
+
+/* Read rows of rowlen bytes, pitch bytes apart, e.g. a rectangle straight
+   into the framebuffer. Returns the number of bytes read. */
+int ParserRecvRows(tSDL_vnc * vnc, unsigned char *dest, size_t pitch, size_t rowlen, int rows)
+{
+    tSDL_vnc_parser *p = vnc->parser;
+
+    if (rows <= 0) return 0;
+    if (pitch == rowlen) return ParserRecv(vnc, dest, rowlen * rows);
+
+    vnc->recvrequests++;
+    vnc->recvconsumed += rowlen * rows;
+    p->want = dest;
+    p->wantlen = rowlen;
+    p->nextrow = dest + pitch;
+    p->rowlen = rowlen;
+    p->pitch = pitch;
+    p->rowsleft = rows - 1;
+    return rowlen * rows - parser_read(p);
+}
+
+
+/* Where the read the parser is blocked on continues, at most max pieces
+   of it, so a driver can receive into them directly. Returns the number
+   of pieces, 0 when the parser is not waiting for data. */
+int ParserTargets(tSDL_vnc * vnc, tSDL_vnc_iov * iov, int max)
+{
+    tSDL_vnc_parser *p = vnc->parser;
+    unsigned char *row = p->nextrow;
+    int rows = p->rowsleft;
+    int n = 0;
+
+    if (p->wantlen == 0 || max <= 0) return 0;
+    iov[n].base = p->want;
+    iov[n].len = p->wantlen;
+    for (n++; n < max && rows > 0; n++, rows--, row += p->pitch) {
+        iov[n].base = row;
+        iov[n].len = p->rowlen;
+    }
+    return n;
+}
+
+
+/*
+  Run the parser over new input: direct bytes the driver already stored
+  through ParserTargets(), then len bytes of data (0 meaning end of
+  stream). Returns once everything is consumed, 0 if the stream turned out
+  to be broken.
+*/
+int ParserFill(tSDL_vnc * vnc, size_t direct, const void *data, size_t len)
+{
+    tSDL_vnc_parser *p = vnc->parser;
+
+    if (p->finished) return 0;
+    parser_advance(p, direct);
+    p->data = data;
+    p->datalen = len;
+    if (direct == 0 && len == 0) p->eof = 1;
+
+#if defined(WIN32) || defined(WIN64)
+    if (!IsThreadAFiber()) ConvertThreadToFiber(NULL);
+    p->caller = GetCurrentFiber();
+    SwitchToFiber(p->fiber);
+#else
+    swapcontext(&p->caller, &p->context);
+#endif
+
+    p->data = NULL;
+    p->datalen = 0;
+    return !p->finished;
+}
+
+
+int vncParserFeed(tSDL_vnc * vnc, const void *data, int len)
+{
+    if (!vnc->parser || vnc->thread) {
+        DBERROR("Connection is not driven by the application.\n");
+        return -1;
+    }
+    if (len < 0) return -1;
+    if (!vnc->fed) {
+        SDL_LockMutex(vnc->mutex);
+        vnc->fed = 1;
+        SDL_UnlockMutex(vnc->mutex);
+    }
+
+    unsigned int frames = vnc->frameseq;
+    if (!ParserFill(vnc, 0, data, len)) {
+        vnc->reading = 0;
+        return -1;
+    }
+    return (int)(vnc->frameseq - frames);
+}
@@ -0,0 +1,223 @@
+/*
+ * Pixel formats: what is requested from the server and how its pixels
+ * become framebuffer colours
+ *
+ * Licensed under the LGPL - see LICENSE
+ *
+ */
+
+/*
+ * The framebuffer is always 32bpp. Smaller wire formats are expanded
+ * through tables indexed by the bytes of a pixel: every bit of a
+ * component lands in fixed bits of the 8 bit result (the component is
+ * scaled by repeating its bits), so the colours of the separate bytes
+ * can simply be ORed together. Two tables of 256 entries cover 16bpp
+ * and stay in L1.
+ */
+
+#include <string.h>
+
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
+
+
+/* Format to request for bpp bits per pixel: 32 (depth 24), 16 (RGB565)
+   or 8 (BGR233). Little endian, fields in host byte order. */
+void PixelFormatFor(int bpp, tSDL_vnc_pixelFormat * pf)
+{
+    memset(pf, 0, sizeof(*pf));
+    pf->bigendian = 0;
+    pf->truecolor = 1;
+    if (bpp == 16) {
+        pf->bpp = 16;
+        pf->depth = 16;
+        pf->redmax = 31;
+        pf->greenmax = 63;
+        pf->bluemax = 31;
+        pf->redshift = 11;
+        pf->greenshift = 5;
+        pf->blueshift = 0;
+    } else if (bpp == 8) {
+        pf->bpp = 8;
+        pf->depth = 8;
+        pf->redmax = 7;
+        pf->greenmax = 7;
+        pf->bluemax = 3;
+        pf->redshift = 0;
+        pf->greenshift = 3;
+        pf->blueshift = 6;
+    } else {
+        pf->bpp = 32;
+        pf->depth = 24;             // lets ZRLE and Tight send 3-byte pixels
+        pf->redmax = 255;
+        pf->greenmax = 255;
+        pf->bluemax = 255;
+        /* FIXME: These depends on endianness; these values work for
+           little endian */
+        pf->redshift = 16;
+        pf->greenshift = 8;
+        pf->blueshift = 0;
+    }
+}
+
+
+static int mask_shift(uint32_t mask)
+{
+    int shift = 0;
+    while (mask && !(mask & 1)) {
+        mask >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+
+static int max_bits(uint32_t max)
+{
+    int bits = 0;
+    while (max & 1) {
+        max >>= 1;
+        bits++;
+    }
+    return bits;
+}
+
+
+/* Scale a component of bits bits to 8 bits by repeating its bits. Only
+   shifts and ORs, so scaling parts of a component and ORing the results
+   gives the same as scaling all of it. */
+static uint32_t scale_component(uint32_t value, int bits)
+{
+    if (bits <= 0) return 0;
+    if (bits >= 8) return value >> (bits - 8);
+    uint32_t scaled = value << (8 - bits);
+    int filled;
+    for (filled = bits; filled < 8; filled += bits) scaled |= scaled >> bits;
+    return scaled & 0xff;
+}
+
+
+/* Fill vnc->pixellut for the true colour format in vnc->pixelformat;
+   needs the framebuffer masks. Nothing to do for 32bpp. In colour map
+   mode the first table is the palette, black until the server sets it. */
+void PixelFormatTables(tSDL_vnc * vnc)
+{
+    tSDL_vnc_pixelFormat * pf = &vnc->pixelformat;
+    int rbits = max_bits(pf->redmax), gbits = max_bits(pf->greenmax), bbits = max_bits(pf->bluemax);
+    int rshift = mask_shift(vnc->rmask), gshift = mask_shift(vnc->gmask), bshift = mask_shift(vnc->bmask);
+    int byte, v;
+
+    if (vnc->bpp == 4) return;
+    memset(vnc->pixellut, 0, sizeof(vnc->pixellut));
+    if (!pf->truecolor) return;
+    for (byte = 0; byte < vnc->bpp; byte++) {
+        for (v = 0; v < 256; v++) {
+            uint32_t bits = (uint32_t)v << (byte * 8);
+            vnc->pixellut[byte][v] =
+                (scale_component((bits >> pf->redshift) & pf->redmax, rbits) << rshift) |
+                (scale_component((bits >> pf->greenshift) & pf->greenmax, gbits) << gshift) |
+                (scale_component((bits >> pf->blueshift) & pf->bluemax, bbits) << bshift);
+        }
+    }
+}
+
+
+/* Convert count pixels of the wire format to framebuffer colours. dest
+   may overlap src as long as it does not start after it, which allows
+   expanding a row in place when it was read into the end of its space. */
+void vnc_expand_pixels(tSDL_vnc * vnc, uint32_t * dest, const unsigned char * src, int count)
+{
+    const uint32_t * lo = vnc->pixellut[0];
+    const uint32_t * hi = vnc->pixellut[1];
+    int i;
+
+    switch (vnc->bpp) {
+    case 1:
+        for (i = 0; i < count; i++) dest[i] = lo[src[i]];
+        break;
+    case 2:
+        for (i = 0; i < count; i++, src += 2) dest[i] = lo[src[0]] | hi[src[1]];
+        break;
+    default:
+        memmove(dest, src, count * 4);
+        break;
+    }
+}
+
+
+#define COLORMAP_HASH 1024
+
+/*
+  Install count palette colours from index first on. The framebuffer
+  holds the colours of the old palette, so its pixels are recoloured in
+  place through a table from old to new colour; changed is set to the
+  area that changed. Returns 0 if that is impossible because two indices
+  had the same old colour but now differ; the server then has to send
+  the picture again.
+*/
+int ColormapUpdate(tSDL_vnc * vnc, int first, int count, const uint32_t * colors, SDL_Rect * changed)
+{
+    uint32_t * palette = vnc->pixellut[0];
+    uint32_t keys[COLORMAP_HASH], values[COLORMAP_HASH];
+    unsigned char used[COLORMAP_HASH];
+    int i, x, y, differs = 0;
+
+    changed->w = changed->h = 0;
+    if (first >= 256) return 1;
+    if (first + count > 256) count = 256 - first;
+
+    for (i = 0; i < count; i++) differs |= palette[first + i] != colors[i];
+    if (!differs) return 1;
+
+    /* Old colour -> new colour for every index */
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < 256; i++) {
+        uint32_t old = palette[i];
+        uint32_t next = (i >= first && i < first + count) ? colors[i - first] : old;
+        unsigned int h = (old * 0x9e3779b1u) >> 22;
+        while (used[h] && keys[h] != old) h = (h + 1) & (COLORMAP_HASH - 1);
+        if (used[h] && values[h] != next) {
+            memcpy(palette + first, colors, count * sizeof(uint32_t));
+            return 0;
+        }
+        used[h] = 1;
+        keys[h] = old;
+        values[h] = next;
+    }
+    memcpy(palette + first, colors, count * sizeof(uint32_t));
+
+    SDL_Surface * fb = vnc->framebuffer;
+    uint32_t pitch = fb->pitch / 4;
+    int x1 = fb->w, y1 = fb->h, x2 = -1, y2 = -1;
+    uint32_t last = 0, lastvalue = 0;
+    int lastvalid = 0;
+    SDL_LockSurface(fb);
+    for (y = 0; y < fb->h; y++) {
+        uint32_t * row = (uint32_t *)fb->pixels + y * pitch;
+        for (x = 0; x < fb->w; x++) {
+            uint32_t pixel = row[x];
+            if (!lastvalid || pixel != last) {
+                unsigned int h = (pixel * 0x9e3779b1u) >> 22;
+                while (used[h] && keys[h] != pixel) h = (h + 1) & (COLORMAP_HASH - 1);
+                last = pixel;
+                lastvalue = used[h] ? values[h] : pixel;
+                lastvalid = 1;
+            }
+            if (lastvalue != pixel) {
+                row[x] = lastvalue;
+                if (x < x1) x1 = x;
+                if (x > x2) x2 = x;
+                if (y < y1) y1 = y;
+                y2 = y;
+            }
+        }
+    }
+    SDL_UnlockSurface(fb);
+    if (x2 >= 0) {
+        changed->x = x1;
+        changed->y = y1;
+        changed->w = x2 - x1 + 1;
+        changed->h = y2 - y1 + 1;
+    }
+    return 1;
+}
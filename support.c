@@ -7,73 +7,86 @@
  */
 
 
-#include "SDL_vnc.h"
-
-#ifdef DEBUG
-	#define DBMESSAGE 	printf
-#else
-	#define DBMESSAGE 	//
-#endif
+#include <string.h>
 
-#define CHECKED_READ(vnc, dest, len, message) { \
-    int result = Recv(vnc->socket, dest, len, 0); \
-    if (result!=len) { \
-    printf("Error reading %s. Got %i of %i bytes.\n", message, result, len); \
-    return 0; \
-    } \
-    }
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
 
-void vnc_to_sdl_rect(tSDL_vnc_rect * src, SDL_Rect * dest);
-void GrowUpdateRegion(tSDL_vnc *vnc, SDL_Rect *trec);
 
+/* Rows of a Raw rectangle staged at a time when blits read the
+   framebuffer itself */
+#define RAW_STAGEBYTES (64 * 1024)
 
+/* Read a Raw rectangle. In doublebuffer mode blits copy from the front
+   buffers, so the rectangle is read straight into the framebuffer: rows
+   narrower than the framebuffer are scattered into place by the same
+   reads, and smaller pixels land at the end of their row and are expanded
+   in place. Otherwise a blit may look at the framebuffer between two
+   reads: a full-width rectangle is still read in place, but under the
+   lock as it always was, and narrower rows are received into a staging
+   buffer and copied (or expanded) under the lock, a batch at a time. */
 int read_raw(tSDL_vnc * vnc, tSDL_vnc_rect rect) {
     SDL_Rect trec;
     vnc_to_sdl_rect(&rect, &trec);
-    SDL_LockMutex(vnc->mutex);
-    SDL_LockSurface(vnc->framebuffer);
-    
+
     uint32_t pitch = vnc->framebuffer->pitch/4;
     uint32_t * dest = (uint32_t *)vnc->framebuffer->pixels + (rect.y * pitch) + rect.x;
-    uint32_t len = rect.width * rect.height * 4;
-
-    DBMESSAGE("Reading %ld bytes straight into buffer", len);
-    CHECKED_READ(vnc, dest, len, "framebuffer");
-
-    GrowUpdateRegion(vnc,&trec);
-    SDL_UnlockSurface(vnc->framebuffer);
-    SDL_UnlockMutex(vnc->mutex);
-    return 1;
-}
-
+    int bpp = vnc->bpp;
+    int rowlen = rect.width * bpp;
+    int len = rowlen * rect.height;
+    int y;
 
-void blit_raw(tSDL_vnc * vnc, tSDL_vnc_rect rect)
-{
-    SDL_Rect trec;
-    vnc_to_sdl_rect(&rect, &trec);
-    SDL_LockMutex(vnc->mutex);
-    SDL_LockSurface(vnc->framebuffer);
+    if (vnc->doublebuffer || rect.width == pitch) {
+        unsigned char * wire = (unsigned char *)dest + rect.width * (4 - bpp);
+        int locked = !vnc->doublebuffer;
 
-    uint32_t * src  = vnc->rawbuffer;
-    uint32_t srcpitch = rect.width;
-    uint32_t len = srcpitch * 4;
-    uint32_t pitch = vnc->framebuffer->pitch/4;
-    uint32_t * dest = (uint32_t *)vnc->framebuffer->pixels + (rect.y * pitch) + rect.x;
+        if (locked) {
+            SDL_LockMutex(vnc->mutex);
+            SDL_LockSurface(vnc->framebuffer);
+        }
+        DBMESSAGE("Reading %d bytes straight into buffer", len);
+        int result = RecvRows(vnc, wire, pitch * 4, rowlen, rect.height);
+        if (result == len && bpp < 4) {
+            for (y = 0; y < rect.height; y++, dest += pitch, wire += pitch * 4) {
+                vnc_expand_pixels(vnc, dest, wire, rect.width);
+            }
+        }
+        if (locked) {
+            SDL_UnlockSurface(vnc->framebuffer);
+            SDL_UnlockMutex(vnc->mutex);
+        }
+        if (result != len) {
+            DBERROR("Error reading framebuffer. Got %i of %i bytes.\n", result, len);
+            return 0;
+        }
+    } else if (len > 0) {
+        int batch = rowlen < RAW_STAGEBYTES ? RAW_STAGEBYTES / rowlen : 1;
+        if (batch > rect.height) batch = rect.height;
+        unsigned char * stage = (unsigned char *)ScratchBuffer(vnc, SCRATCH_RAW, (size_t)batch * rowlen);
+        if (!stage) return 0;
 
-    if (srcpitch == pitch) {
-        /* full screen, or at least full width */
-        memcpy(dest, src, len * rect.height);
-    } else {
-        uint32_t * end = dest + (pitch*rect.height);
-        
-        while (dest < end) {
-            memcpy(dest, src, len);
-            dest += pitch;
-            src  += srcpitch;
+        for (y = 0; y < rect.height; y += batch) {
+            int rows = rect.height - y < batch ? rect.height - y : batch;
+            int result = Recv(vnc, stage, rows * rowlen);
+            if (result != rows * rowlen) {
+                DBERROR("Error reading framebuffer. Got %i of %i bytes.\n", y * rowlen + (result > 0 ? result : 0), len);
+                return 0;
+            }
+            SDL_LockMutex(vnc->mutex);
+            int i;
+            for (i = 0; i < rows; i++, dest += pitch) {
+                if (bpp == 4) {
+                    memcpy(dest, stage + i * rowlen, rowlen);
+                } else {
+                    vnc_expand_pixels(vnc, dest, stage + i * rowlen, rect.width);
+                }
+            }
+            SDL_UnlockMutex(vnc->mutex);
         }
     }
+
+    SDL_LockMutex(vnc->mutex);
     GrowUpdateRegion(vnc,&trec);
-    SDL_UnlockSurface(vnc->framebuffer);
     SDL_UnlockMutex(vnc->mutex);
+    return 1;
 }
-
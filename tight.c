@@ -0,0 +1,741 @@
+/*
+ * Tight (encoding 7) decoder
+ *
+ * Licensed under the LGPL - see LICENSE
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <zlib.h>
+#include <jpeglib.h>
+
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
+
+#define TIGHT_STREAMS 4
+#define TIGHT_MIN_TO_COMPRESS 12
+
+#define TIGHT_FILL 0x08
+#define TIGHT_JPEG 0x09
+
+#define TIGHT_FILTER_COPY 0
+#define TIGHT_FILTER_PALETTE 1
+#define TIGHT_FILTER_GRADIENT 2
+
+#define TIGHT_MAX_THREADS 16
+#define TIGHT_MAX_WIDTH 2048
+
+
+#define TIGHT_JOB_QUEUED 0
+#define TIGHT_JOB_RUNNING 1
+#define TIGHT_JOB_DONE 2
+
+/* One Tight rectangle, as read off the wire but not yet decoded */
+typedef struct tSDL_vnc_tightRect {
+    tSDL_vnc_rect rect;
+    uint8_t control;                // compression control byte
+    int stream;                     // zlib stream, or -1 if data is not compressed
+    uint8_t filter;
+    int tpixel;                     // bytes per TPIXEL: 3 for 32bpp, else the pixel size
+    int palettesize;
+    uint32_t palette[256];          // palette (or fill colour) in framebuffer format
+    unsigned char *data;            // zlib, raw filter or JPEG data
+    uint32_t datalen;
+    uint32_t datasize;              // allocated size of data
+    uint32_t *pixels;               // decoded rectangle, before it is copied into the framebuffer
+    uint32_t pixelssize;            // allocated size of pixels in bytes
+    int state;                      // TIGHT_JOB_* when decoded by the worker pool
+    int result;
+} tSDL_vnc_tightRect;
+
+typedef struct tSDL_vnc_tight {
+    z_stream stream[TIGHT_STREAMS];
+    int streamready[TIGHT_STREAMS];
+    unsigned char *out[TIGHT_STREAMS];  // inflated data, one buffer per stream
+    uint32_t outsize[TIGHT_STREAMS];
+    tSDL_vnc_tightRect current;
+
+    // Worker pool for parallel decoding (vnc->decodethreads > 0)
+    SDL_Thread *workers[TIGHT_MAX_THREADS];
+    int nworkers;
+    SDL_mutex *lock;                // protects everything below
+    SDL_cond *wake;                 // signalled when a job may be runnable
+    SDL_cond *idle;                 // signalled when a job finishes
+    int quit;
+    tSDL_vnc_tightRect **jobs;      // jobs of the current update, reused
+    int njobs;                      // jobs queued in the current update
+    int jobsalloc;
+    int pending;                    // jobs not yet done
+    int lanebusy[TIGHT_STREAMS];    // a worker is inflating on this stream
+    uint64_t decodetime;            // time the workers spent on jobs since the last flush (us)
+    int failed;
+    tSDL_vnc *vnc;
+} tSDL_vnc_tight;
+
+
+static tSDL_vnc_tight * tight_state(tSDL_vnc * vnc)
+{
+    if (!vnc->tight) {
+        vnc->tight = calloc(1, sizeof(tSDL_vnc_tight));
+        if (!vnc->tight) DBERROR("Out of memory allocating Tight state.\n");
+        else ((tSDL_vnc_tight *)vnc->tight)->vnc = vnc;
+    }
+    return (tSDL_vnc_tight *)vnc->tight;
+}
+
+
+void tight_free(tSDL_vnc * vnc)
+{
+    tSDL_vnc_tight * t = (tSDL_vnc_tight *)vnc->tight;
+    int i;
+    if (!t) return;
+    if (t->lock) {
+        SDL_LockMutex(t->lock);
+        t->quit = 1;
+        SDL_CondBroadcast(t->wake);
+        SDL_UnlockMutex(t->lock);
+        for (i = 0; i < t->nworkers; i++) SDL_WaitThread(t->workers[i], NULL);
+        SDL_DestroyCond(t->wake);
+        SDL_DestroyCond(t->idle);
+        SDL_DestroyMutex(t->lock);
+    }
+    for (i = 0; i < t->jobsalloc; i++) {
+        free(t->jobs[i]->data);
+        free(t->jobs[i]->pixels);
+        free(t->jobs[i]);
+    }
+    free(t->jobs);
+    for (i = 0; i < TIGHT_STREAMS; i++) {
+        if (t->streamready[i]) inflateEnd(&t->stream[i]);
+        free(t->out[i]);
+    }
+    free(t->current.data);
+    free(t->current.pixels);
+    free(t);
+    vnc->tight = NULL;
+}
+
+
+/* Make sure a buffer holds at least size bytes; buffers only grow */
+static int tight_reserve(tSDL_vnc * vnc, unsigned char ** buffer, uint32_t * allocated, uint32_t size)
+{
+    if (size <= *allocated) return 1;
+    unsigned char * grown = realloc(*buffer, size);
+    if (!grown) {
+        DBERROR("Out of memory for Tight buffer (%u bytes).\n", size);
+        return 0;
+    }
+    *buffer = grown;
+    *allocated = size;
+    CountAllocation(vnc, size);
+    return 1;
+}
+
+
+/* A TPIXEL is RGB for 32bpp with depth 24, otherwise a whole pixel */
+static inline uint32_t tight_tpixel(const tSDL_vnc * vnc, const unsigned char * p, int tpixel)
+{
+    if (tpixel == 3) return (p[0] << 16) | (p[1] << 8) | p[2];
+    return vnc_pixel(vnc, p, tpixel);
+}
+
+
+/* 7 bits in each of the first two bytes, with the top bit saying another
+   byte follows; the third byte carries a full 8 bits (bits 14-21) */
+static int tight_read_compact_length(tSDL_vnc * vnc, uint32_t * length)
+{
+    uint8_t b;
+    int shift;
+    *length = 0;
+    for (shift = 0; shift < 21; shift += 7) {
+        CHECKED_READ(vnc, &b, 1, "Tight compact length");
+        if (shift == 14) {
+            *length |= (uint32_t)b << shift;
+            break;
+        }
+        *length |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    return 1;
+}
+
+
+static void tight_reset_streams(tSDL_vnc_tight * t, uint8_t mask)
+{
+    int i;
+    for (i = 0; i < TIGHT_STREAMS; i++) {
+        if ((mask & (1 << i)) && t->streamready[i]) {
+            DBMESSAGE("Resetting Tight stream %i.\n", i);
+            inflateReset(&t->stream[i]);
+        }
+    }
+}
+
+
+/* Size of the filtered (uncompressed) pixel data of a basic rectangle */
+static uint32_t tight_filtered_size(tSDL_vnc_tightRect * r)
+{
+    uint32_t w = r->rect.width, h = r->rect.height;
+    if (r->filter == TIGHT_FILTER_PALETTE) {
+        return r->palettesize == 2 ? ((w + 7) / 8) * h : w * h;
+    }
+    return w * h * r->tpixel;
+}
+
+
+/* Read everything belonging to a Tight rectangle from the network */
+static int tight_read(tSDL_vnc * vnc, tSDL_vnc_rect rect, tSDL_vnc_tightRect * r)
+{
+    unsigned char tpixel[3 * 256];
+    uint8_t b;
+
+    r->rect = rect;
+    r->stream = -1;
+    r->filter = TIGHT_FILTER_COPY;
+    r->tpixel = vnc->bpp == 4 ? 3 : vnc->bpp;
+    r->palettesize = 0;
+    r->datalen = 0;
+
+    CHECKED_READ(vnc, &r->control, 1, "Tight control");
+    uint8_t type = r->control >> 4;
+
+    if (type == TIGHT_FILL) {
+        CHECKED_READ(vnc, tpixel, r->tpixel, "Tight fill colour");
+        r->palette[0] = tight_tpixel(vnc, tpixel, r->tpixel);
+        return 1;
+    }
+
+    if (type == TIGHT_JPEG) {
+        if (tight_read_compact_length(vnc, &r->datalen) == 0) return 0;
+        if (tight_reserve(vnc, &r->data, &r->datasize, r->datalen) == 0) return 0;
+        CHECKED_READ(vnc, r->data, (int)r->datalen, "Tight JPEG data");
+        return 1;
+    }
+
+    if (type & 0x08) {
+        DBERROR("Invalid Tight compression control 0x%02x.\n", r->control);
+        return 0;
+    }
+
+    /* Basic compression */
+    if (type & 0x04) {
+        CHECKED_READ(vnc, &r->filter, 1, "Tight filter");
+    }
+    if (r->filter == TIGHT_FILTER_PALETTE) {
+        CHECKED_READ(vnc, &b, 1, "Tight palette size");
+        r->palettesize = b + 1;
+        CHECKED_READ(vnc, tpixel, r->palettesize * r->tpixel, "Tight palette");
+        int i;
+        for (i = 0; i < r->palettesize; i++) r->palette[i] = tight_tpixel(vnc, tpixel + i * r->tpixel, r->tpixel);
+    } else if (r->filter == TIGHT_FILTER_GRADIENT && !vnc->pixelformat.truecolor) {
+        DBERROR("Tight gradient filter in colour map mode.\n");
+        return 0;
+    } else if (r->filter == TIGHT_FILTER_GRADIENT && r->tpixel < 3 && rect.width > TIGHT_MAX_WIDTH) {
+        DBERROR("Tight gradient rectangle too wide (%u).\n", rect.width);
+        return 0;
+    } else if (r->filter != TIGHT_FILTER_COPY && r->filter != TIGHT_FILTER_GRADIENT) {
+        DBERROR("Invalid Tight filter %u.\n", r->filter);
+        return 0;
+    }
+
+    uint32_t size = tight_filtered_size(r);
+    if (size < TIGHT_MIN_TO_COMPRESS) {
+        r->datalen = size;
+    } else {
+        r->stream = type & 0x03;
+        if (tight_read_compact_length(vnc, &r->datalen) == 0) return 0;
+    }
+    if (tight_reserve(vnc, &r->data, &r->datasize, r->datalen) == 0) return 0;
+    CHECKED_READ(vnc, r->data, (int)r->datalen, "Tight data");
+    return 1;
+}
+
+
+/* Inflate the data of a basic rectangle into the buffer of its stream */
+static unsigned char * tight_inflate(tSDL_vnc_tight * t, tSDL_vnc_tightRect * r)
+{
+    int s = r->stream;
+    uint32_t size = tight_filtered_size(r);
+
+    if (s < 0) return r->data;
+
+    if (!t->streamready[s]) {
+        memset(&t->stream[s], 0, sizeof(z_stream));
+        if (inflateInit(&t->stream[s]) != Z_OK) {
+            DBERROR("Could not initialize Tight zlib stream %i.\n", s);
+            return NULL;
+        }
+        t->streamready[s] = 1;
+    }
+    if (tight_reserve(t->vnc, &t->out[s], &t->outsize[s], size) == 0) return NULL;
+
+    z_stream * zs = &t->stream[s];
+    zs->next_in = r->data;
+    zs->avail_in = r->datalen;
+    zs->next_out = t->out[s];
+    zs->avail_out = size;
+    /* All input has to go through the stream, including the server's
+       trailing sync flush, or the next rectangle on it will not decode */
+    unsigned char overflow[64];
+    int overflowing = 0;
+    while (zs->avail_in > 0) {
+        if (zs->avail_out == 0 && !overflowing) {
+            zs->next_out = overflow;
+            zs->avail_out = sizeof(overflow);
+            overflowing = 1;
+        }
+        int result = inflate(zs, Z_SYNC_FLUSH);
+        if (result == Z_BUF_ERROR) break;
+        if (result != Z_OK && result != Z_STREAM_END) {
+            DBERROR("Tight inflate error %i on stream %i.\n", result, s);
+            return NULL;
+        }
+    }
+    if (!overflowing && zs->avail_out > 0) {
+        DBERROR("Tight data short by %u bytes.\n", zs->avail_out);
+        return NULL;
+    }
+    if (overflowing && zs->avail_out != sizeof(overflow)) {
+        DBERROR("Tight data on stream %i longer than expected.\n", s);
+        return NULL;
+    }
+    return t->out[s];
+}
+
+
+static void tight_filter_copy(tSDL_vnc * vnc, tSDL_vnc_tightRect * r, const unsigned char * src, uint32_t * dest, uint32_t pitch)
+{
+    int w = r->rect.width, h = r->rect.height;
+    int x, y;
+    if (r->tpixel < 3) {
+        for (y = 0; y < h; y++, dest += pitch, src += w * r->tpixel) vnc_expand_pixels(vnc, dest, src, w);
+        return;
+    }
+    for (y = 0; y < h; y++, dest += pitch) {
+        for (x = 0; x < w; x++, src += 3) dest[x] = tight_tpixel(vnc, src, 3);
+    }
+}
+
+
+static void tight_filter_palette(tSDL_vnc_tightRect * r, const unsigned char * src, uint32_t * dest, uint32_t pitch)
+{
+    int w = r->rect.width, h = r->rect.height;
+    int x, y;
+    if (r->palettesize == 2) {
+        for (y = 0; y < h; y++, dest += pitch) {
+            for (x = 0; x < w; x++) {
+                dest[x] = r->palette[(src[x >> 3] >> (7 - (x & 7))) & 1];
+            }
+            src += (w + 7) / 8;
+        }
+    } else {
+        for (y = 0; y < h; y++, dest += pitch, src += w) {
+            for (x = 0; x < w; x++) dest[x] = r->palette[src[x]];
+        }
+    }
+}
+
+
+/* The gradient filter predicts each component from the left, upper and
+   upper-left neighbours; the first row and column see zeros outside */
+static void tight_filter_gradient(const unsigned char * src, uint32_t * dest, uint32_t pitch, int w, int h)
+{
+    int x, y, c;
+    for (y = 0; y < h; y++, dest += pitch) {
+        const uint32_t * above = y ? dest - pitch : NULL;
+        uint8_t pix[3] = { 0, 0, 0 };
+        for (x = 0; x < w; x++, src += 3) {
+            uint32_t up = above ? above[x] : 0;
+            uint32_t upleft = (above && x) ? above[x - 1] : 0;
+            for (c = 0; c < 3; c++) {
+                int shift = 16 - c * 8;
+                int est = ((up >> shift) & 0xff) + pix[c] - ((upleft >> shift) & 0xff);
+                if (est < 0) est = 0;
+                if (est > 255) est = 255;
+                pix[c] = (uint8_t)(est + src[c]);
+            }
+            dest[x] = (pix[0] << 16) | (pix[1] << 8) | pix[2];
+        }
+    }
+}
+
+
+/* The same for smaller pixels, on the components of the pixel format
+   itself. The framebuffer only has the expanded colours, so the previous
+   row is kept as it came. */
+static void tight_filter_gradient_pixels(tSDL_vnc * vnc, tSDL_vnc_tightRect * r, const unsigned char * src,
+                                         uint32_t * dest, uint32_t pitch)
+{
+    const tSDL_vnc_pixelFormat * pf = &vnc->pixelformat;
+    const int shift[3] = { pf->redshift, pf->greenshift, pf->blueshift };
+    const int max[3] = { pf->redmax, pf->greenmax, pf->bluemax };
+    uint16_t rows[2][TIGHT_MAX_WIDTH];
+    int w = r->rect.width, h = r->rect.height;
+    int x, y, c;
+
+    for (y = 0; y < h; y++, dest += pitch, src += w * r->tpixel) {
+        const uint16_t * above = y ? rows[(y - 1) & 1] : NULL;
+        uint16_t * row = rows[y & 1];
+        int pix[3] = { 0, 0, 0 };
+        for (x = 0; x < w; x++) {
+            uint32_t diff = r->tpixel == 1 ? src[x] : src[x * 2] | (src[x * 2 + 1] << 8);
+            uint32_t up = above ? above[x] : 0;
+            uint32_t upleft = (above && x) ? above[x - 1] : 0;
+            uint32_t value = 0;
+            for (c = 0; c < 3; c++) {
+                int est = (int)((up >> shift[c]) & max[c]) + pix[c] - (int)((upleft >> shift[c]) & max[c]);
+                if (est < 0) est = 0;
+                if (est > max[c]) est = max[c];
+                pix[c] = (est + (int)(diff >> shift[c])) & max[c];
+                value |= (uint32_t)pix[c] << shift[c];
+            }
+            row[x] = (uint16_t)value;
+            dest[x] = vnc->pixellut[0][value & 0xff] | vnc->pixellut[1][value >> 8];
+        }
+    }
+}
+
+
+typedef struct tSDL_vnc_jpegError {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+} tSDL_vnc_jpegError;
+
+static void tight_jpeg_error(j_common_ptr cinfo)
+{
+    tSDL_vnc_jpegError * err = (tSDL_vnc_jpegError *)cinfo->err;
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    DBERROR("Tight JPEG error: %s\n", message);
+    longjmp(err->jump, 1);
+}
+
+
+/* Decode JPEG data straight into the rows of the rectangle */
+static int tight_jpeg(tSDL_vnc_tightRect * r, uint32_t * dest, uint32_t pitch)
+{
+    struct jpeg_decompress_struct cinfo;
+    tSDL_vnc_jpegError err;
+    JSAMPROW rows[16];
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = tight_jpeg_error;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return 0;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, r->data, r->datalen);
+    jpeg_read_header(&cinfo, TRUE);
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    cinfo.out_color_space = JCS_EXT_XRGB;
+#else
+    cinfo.out_color_space = JCS_EXT_BGRX;
+#endif
+    jpeg_start_decompress(&cinfo);
+    if (cinfo.output_width != r->rect.width || cinfo.output_height != r->rect.height) {
+        DBERROR("Tight JPEG size %ux%u does not match rectangle.\n", cinfo.output_width, cinfo.output_height);
+        jpeg_destroy_decompress(&cinfo);
+        return 0;
+    }
+    while (cinfo.output_scanline < cinfo.output_height) {
+        unsigned int i, n = cinfo.output_height - cinfo.output_scanline;
+        if (n > 16) n = 16;
+        for (i = 0; i < n; i++) rows[i] = (JSAMPROW)(dest + (cinfo.output_scanline + i) * pitch);
+        jpeg_read_scanlines(&cinfo, rows, n);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return 1;
+}
+
+
+/* Decode the pixels of a rectangle into rows pitch pixels apart */
+static int tight_pixels(tSDL_vnc * vnc, tSDL_vnc_tightRect * r, const unsigned char * src, uint32_t * dest, uint32_t pitch)
+{
+    uint8_t type = r->control >> 4;
+    int w = r->rect.width, h = r->rect.height;
+
+    if (type == TIGHT_FILL) {
+        int x, y;
+        for (y = 0; y < h; y++, dest += pitch) {
+            for (x = 0; x < w; x++) dest[x] = r->palette[0];
+        }
+    } else if (type == TIGHT_JPEG) {
+        return tight_jpeg(r, dest, pitch);
+    } else if (r->filter == TIGHT_FILTER_PALETTE) {
+        tight_filter_palette(r, src, dest, pitch);
+    } else if (r->filter == TIGHT_FILTER_GRADIENT) {
+        if (r->tpixel < 3) tight_filter_gradient_pixels(vnc, r, src, dest, pitch);
+        else tight_filter_gradient(src, dest, pitch, w, h);
+    } else {
+        tight_filter_copy(vnc, r, src, dest, pitch);
+    }
+    return 1;
+}
+
+
+/* Decode a rectangle read by tight_read() into the framebuffer. The lock
+   is only held to put the result in place, so workers decode side by side
+   and blits are not held up by a JPEG decode. In doublebuffer mode blits
+   read the front buffers and nothing else writes the framebuffer until
+   the jobs are flushed, so it is decoded into directly; otherwise the
+   rectangle is decoded into the job's own buffer and copied under the
+   lock. Fills are cheap enough to do under the lock. */
+static int tight_decode(tSDL_vnc * vnc, tSDL_vnc_tight * t, tSDL_vnc_tightRect * r)
+{
+    const unsigned char * src = NULL;
+    uint8_t type = r->control >> 4;
+    int result = 1;
+
+    if (!RectInFramebuffer(vnc, &r->rect)) return 0;
+
+    if (type != TIGHT_FILL && type != TIGHT_JPEG) {
+        src = tight_inflate(t, r);
+        if (!src) return 0;
+    }
+
+    SDL_Rect trec;
+    vnc_to_sdl_rect(&r->rect, &trec);
+    uint32_t pitch = vnc->framebuffer->pitch / 4;
+    uint32_t * dest = (uint32_t *)vnc->framebuffer->pixels + r->rect.y * pitch + r->rect.x;
+    int w = r->rect.width, h = r->rect.height;
+
+    if (vnc->doublebuffer) {
+        result = tight_pixels(vnc, r, src, dest, pitch);
+        SDL_LockMutex(vnc->mutex);
+        SDL_LockSurface(vnc->framebuffer);
+    } else if (type == TIGHT_FILL) {
+        SDL_LockMutex(vnc->mutex);
+        SDL_LockSurface(vnc->framebuffer);
+        result = tight_pixels(vnc, r, src, dest, pitch);
+    } else {
+        if (tight_reserve(vnc, (unsigned char **)&r->pixels, &r->pixelssize, (uint32_t)w * h * 4) == 0) return 0;
+        result = tight_pixels(vnc, r, src, r->pixels, w);
+        SDL_LockMutex(vnc->mutex);
+        SDL_LockSurface(vnc->framebuffer);
+        if (result) {
+            int y;
+            for (y = 0; y < h; y++, dest += pitch) memcpy(dest, r->pixels + y * w, w * 4);
+        }
+    }
+
+    GrowUpdateRegion(vnc, &trec);
+    SDL_UnlockSurface(vnc->framebuffer);
+    SDL_UnlockMutex(vnc->mutex);
+    return result;
+}
+
+
+/* ---- Parallel decoding ----
+
+   Rectangles of an update are read off the wire into jobs and decoded by
+   a worker pool. Jobs inflating on the same zlib stream must run in
+   order, so each stream is a lane that at most one worker owns at a
+   time; fill, JPEG and uncompressed jobs have no lane and run anywhere.
+*/
+
+static inline int tight_lane(tSDL_vnc_tightRect * r)
+{
+    uint8_t type = r->control >> 4;
+    if (type == TIGHT_FILL || type == TIGHT_JPEG) return -1;
+    return r->stream;
+}
+
+
+/* Pick the first job that may run now. Called with t->lock held. */
+static tSDL_vnc_tightRect * tight_next_job(tSDL_vnc_tight * t)
+{
+    int seen[TIGHT_STREAMS] = { 0, 0, 0, 0 };
+    int i;
+    for (i = 0; i < t->njobs; i++) {
+        tSDL_vnc_tightRect * r = t->jobs[i];
+        int lane = tight_lane(r);
+        if (r->state != TIGHT_JOB_QUEUED) continue;
+        if (lane < 0) return r;
+        if (!t->lanebusy[lane] && !seen[lane]) return r;
+        seen[lane] = 1;
+    }
+    return NULL;
+}
+
+
+static int tight_worker(void * data)
+{
+    tSDL_vnc_tight * t = (tSDL_vnc_tight *)data;
+
+    SDL_LockMutex(t->lock);
+    while (!t->quit) {
+        tSDL_vnc_tightRect * r = tight_next_job(t);
+        if (!r) {
+            SDL_CondWait(t->wake, t->lock);
+            continue;
+        }
+        int lane = tight_lane(r);
+        r->state = TIGHT_JOB_RUNNING;
+        if (lane >= 0) t->lanebusy[lane] = 1;
+        SDL_UnlockMutex(t->lock);
+
+        uint64_t start = MonotonicMicroseconds();
+        r->result = tight_decode(t->vnc, t, r);
+        uint64_t elapsed = MonotonicMicroseconds() - start;
+
+        SDL_LockMutex(t->lock);
+        t->decodetime += elapsed;
+        r->state = TIGHT_JOB_DONE;
+        if (lane >= 0) t->lanebusy[lane] = 0;
+        if (!r->result) t->failed = 1;
+        t->pending--;
+        SDL_CondBroadcast(t->wake);
+        SDL_CondSignal(t->idle);
+    }
+    SDL_UnlockMutex(t->lock);
+    return 0;
+}
+
+
+static int tight_start_pool(tSDL_vnc * vnc, tSDL_vnc_tight * t)
+{
+    t->vnc = vnc;
+    t->lock = SDL_CreateMutex();
+    t->wake = SDL_CreateCond();
+    t->idle = SDL_CreateCond();
+    if (!t->lock || !t->wake || !t->idle) {
+        DBERROR("Could not create Tight worker synchronisation.\n");
+        return 0;
+    }
+    int n = vnc->decodethreads < TIGHT_MAX_THREADS ? vnc->decodethreads : TIGHT_MAX_THREADS;
+    for (t->nworkers = 0; t->nworkers < n; t->nworkers++) {
+        t->workers[t->nworkers] = SDL_CreateThread(tight_worker, t);
+        if (!t->workers[t->nworkers]) {
+            DBERROR("Could not start Tight worker thread.\n");
+            break;
+        }
+    }
+    DBMESSAGE("Started %i Tight worker threads.\n", t->nworkers);
+    return t->nworkers > 0;
+}
+
+
+/* Wait until every queued job is decoded. Returns 0 if any job failed.
+   The rectangles were counted when they were read; the time the workers
+   took to decode them is charged to Tight here. When the caller is itself
+   timed as a rectangle (inrect), the wait is part of that time already and
+   only the rest is added. */
+static int tight_wait(tSDL_vnc * vnc, tSDL_vnc_tight * t, int inrect)
+{
+    uint64_t start = MonotonicMicroseconds();
+
+    SDL_LockMutex(t->lock);
+    while (t->pending > 0) SDL_CondWait(t->idle, t->lock);
+    int result = !t->failed;
+    uint64_t decodetime = t->decodetime;
+    t->failed = 0;
+    t->njobs = 0;
+    t->decodetime = 0;
+    SDL_UnlockMutex(t->lock);
+
+    if (inrect) {
+        uint64_t waited = MonotonicMicroseconds() - start;
+        decodetime = decodetime > waited ? decodetime - waited : 0;
+    }
+    if (decodetime > 0) CountDecodeTime(vnc, 7, decodetime);
+    return result;
+}
+
+
+int tight_flush(tSDL_vnc * vnc)
+{
+    tSDL_vnc_tight * t = (tSDL_vnc_tight *)vnc->tight;
+    if (!t || !t->lock) return 1;
+    return tight_wait(vnc, t, 0);
+}
+
+
+static inline int tight_overlaps(tSDL_vnc_rect * a, tSDL_vnc_rect * b)
+{
+    return a->x < b->x + b->width && b->x < a->x + a->width &&
+           a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+
+/* Read a rectangle into a new job and hand it to the worker pool */
+static int tight_queue(tSDL_vnc * vnc, tSDL_vnc_tight * t, tSDL_vnc_rect rect)
+{
+    int i;
+
+    if (!t->lock && tight_start_pool(vnc, t) == 0) return 0;
+
+    SDL_LockMutex(t->lock);
+    if (t->njobs == t->jobsalloc) {
+        tSDL_vnc_tightRect ** jobs = realloc(t->jobs, (t->jobsalloc + 16) * sizeof(tSDL_vnc_tightRect *));
+        if (!jobs) {
+            SDL_UnlockMutex(t->lock);
+            DBERROR("Out of memory for Tight jobs.\n");
+            return 0;
+        }
+        t->jobs = jobs;
+        for (i = t->jobsalloc; i < t->jobsalloc + 16; i++) {
+            t->jobs[i] = calloc(1, sizeof(tSDL_vnc_tightRect));
+            if (!t->jobs[i]) break;
+        }
+        CountAllocation(vnc, (i - t->jobsalloc) * sizeof(tSDL_vnc_tightRect));
+        t->jobsalloc = i;
+        if (t->njobs == t->jobsalloc) {
+            SDL_UnlockMutex(t->lock);
+            DBERROR("Out of memory for Tight jobs.\n");
+            return 0;
+        }
+    }
+    tSDL_vnc_tightRect * r = t->jobs[t->njobs];
+    SDL_UnlockMutex(t->lock);
+
+    /* The slot is not visible to the workers until njobs is raised */
+    if (tight_read(vnc, rect, r) == 0) return 0;
+
+    /* Stream resets and overlapping rectangles need everything before
+       them decoded first, so the result matches serial decoding */
+    int drain = (r->control & 0x0f) != 0;
+    SDL_LockMutex(t->lock);
+    for (i = 0; !drain && i < t->njobs; i++) {
+        drain = t->jobs[i]->state != TIGHT_JOB_DONE && tight_overlaps(&t->jobs[i]->rect, &r->rect);
+    }
+    SDL_UnlockMutex(t->lock);
+    if (drain) {
+        int slot = t->njobs;
+        if (tight_wait(vnc, t, 1) == 0) return 0;
+        /* Flushing empties the job list; keep this job's slot at the front */
+        SDL_LockMutex(t->lock);
+        t->jobs[slot] = t->jobs[0];
+        t->jobs[0] = r;
+        SDL_UnlockMutex(t->lock);
+        tight_reset_streams(t, r->control & 0x0f);
+    }
+
+    SDL_LockMutex(t->lock);
+    r->state = TIGHT_JOB_QUEUED;
+    r->result = 0;
+    t->njobs++;
+    t->pending++;
+    SDL_CondSignal(t->wake);
+    SDL_UnlockMutex(t->lock);
+    return 1;
+}
+
+
+int ServerRectangle_Tight(tSDL_vnc * vnc, tSDL_vnc_rect rect)
+{
+    DBMESSAGE("Tight encoding.\n");
+
+    tSDL_vnc_tight * t = tight_state(vnc);
+    if (!t) return 0;
+
+    if (vnc->decodethreads > 0) return tight_queue(vnc, t, rect);
+
+    if (tight_read(vnc, rect, &t->current) == 0) return 0;
+    tight_reset_streams(t, t->current.control & 0x0f);
+    return tight_decode(vnc, t, &t->current);
+}
@@ -0,0 +1,323 @@
+/*
+ * Encoding tuner: picks the preferred encoding and compression level from
+ * measured bandwidth, round trip time and decode cost (auto mode)
+ *
+ * Licensed under the LGPL - see LICENSE
+ *
+ */
+
+/*
+ * Every rectangle of a real encoding is timed, less the time spent
+ * waiting for its data, and counted in bytes and pixels. Once a second
+ * the samples are folded into running estimates of decode time and wire
+ * size per pixel for each encoding. The estimates start out at typical
+ * values, so encodings the server has not used yet can be compared too.
+ * The cost of an encoding is its decode time plus the time its bytes
+ * spend on the link: on a LAN that favours encodings that are cheap to
+ * decode, on a slow link the ones that compress well. The cheapest one
+ * goes to the front of a new SetEncodings once it clearly beats the
+ * current one and the previous change has settled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
+
+#define TUNER_INTERVAL 1000000      // us between evaluations
+#define TUNER_SETTLE 3000000        // us a choice is kept at least
+#define TUNER_MARGIN 0.8            // a new encoding has to cost less than this share of the current one
+#define TUNER_MINBYTES 16384        // smallest update that says something about the link
+#define TUNER_MINTIME 1000          // us; shortest one, anything faster was buffered already
+#define TUNER_MINPIXELS 4096        // fewest pixels per interval to update an estimate
+#define TUNER_LAN 2000              // us; round trips below this are a local network
+
+/* Typical decode time (us per pixel) and size (share of the raw pixel
+   size) of desktop content */
+static const struct {
+    int32_t encoding;
+    const char *name;
+    double decode;
+    double wire;
+} tuner_priors[VNC_TUNER_ENCODINGS] = {
+    { 0, "raw", 0.002, 1.0 },
+    { 2, "rre", 0.004, 0.4 },
+    { 5, "hextile", 0.004, 0.3 },
+    { 16, "zrle", 0.010, 0.08 },
+    { 7, "tight", 0.012, 0.06 },
+};
+
+typedef struct tSDL_vnc_tunerSamples {
+    uint64_t us;                    // decode time since the last evaluation
+    uint64_t bytes;
+    uint64_t pixels;
+} tSDL_vnc_tunerSamples;
+
+typedef struct tSDL_vnc_tuner {
+    tSDL_vnc_tunerState state;      // what vncTunerState() reports; under vnc->mutex
+    tSDL_vnc_tunerSamples samples[VNC_TUNER_ENCODINGS];
+    int userquality;                // quality= from the mode, -1 if none
+    uint64_t lastevaluation;
+    uint64_t lastswitch;
+    double levelbandwidth;          // bandwidth the levels were chosen for
+    uint64_t updatestart;           // timing of the update being decoded
+    uint64_t updatewait;
+    unsigned long updatebytes;
+    int pending;                    // flag: message holds a SetEncodings to send
+    unsigned char message[4 + 4 * VNC_MAXENCODINGS];
+    int messagelen;
+} tSDL_vnc_tuner;
+
+
+static int tuner_index(int32_t encoding)
+{
+    int i;
+    for (i = 0; i < VNC_TUNER_ENCODINGS; i++) {
+        if (tuner_priors[i].encoding == encoding) return i;
+    }
+    return -1;
+}
+
+
+static const char * tuner_name(int32_t encoding)
+{
+    int i = tuner_index(encoding);
+    return i < 0 ? "?" : tuner_priors[i].name;
+}
+
+
+/* Set up the tuner for the encodings the mode asked for (vnc->encodings);
+   only those are ever requested */
+int TunerCreate(tSDL_vnc * vnc)
+{
+    tSDL_vnc_tuner * t = (tSDL_vnc_tuner *)calloc(1, sizeof(tSDL_vnc_tuner));
+    int i, n;
+
+    if (!t) {
+        DBERROR("Out of memory allocating encoding tuner.\n");
+        return 0;
+    }
+    t->state.enabled = 1;
+    t->state.encoding = -1;
+    t->state.compress = -1;
+    t->state.quality = -1;
+    t->userquality = -1;
+    for (i = 0; i < VNC_TUNER_ENCODINGS; i++) {
+        t->state.encodings[i].encoding = tuner_priors[i].encoding;
+        t->state.encodings[i].decode = tuner_priors[i].decode;
+        t->state.encodings[i].wire = tuner_priors[i].wire * vnc->bpp;
+    }
+    for (i = 0; i < vnc->encodingcount; i++) {
+        int32_t encoding = vnc->encodings[i];
+        if ((n = tuner_index(encoding)) >= 0) {
+            t->state.encodings[n].allowed = 1;
+            if (t->state.encoding < 0) t->state.encoding = encoding;
+        } else if (encoding >= -256 && encoding <= -247) {
+            t->state.compress = encoding + 256;
+        } else if (encoding >= -32 && encoding <= -23) {
+            t->state.quality = t->userquality = encoding + 32;
+        }
+    }
+    strcpy(t->state.reason, "initial");
+    t->lastevaluation = t->lastswitch = MonotonicMicroseconds();
+    vnc->tuner = t;
+    return 1;
+}
+
+
+void TunerFree(tSDL_vnc * vnc)
+{
+    free(vnc->tuner);
+    vnc->tuner = NULL;
+}
+
+
+/* A rectangle of encoding took us of decoding for its pixels and bytes */
+void TunerRect(tSDL_vnc * vnc, int32_t encoding, int pixels, unsigned long bytes, uint64_t us)
+{
+    tSDL_vnc_tuner * t = (tSDL_vnc_tuner *)vnc->tuner;
+    int i = tuner_index(encoding);
+
+    if (i < 0) return;
+    t->samples[i].us += us;
+    t->samples[i].bytes += bytes;
+    t->samples[i].pixels += pixels;
+}
+
+
+void TunerUpdateStart(tSDL_vnc * vnc)
+{
+    tSDL_vnc_tuner * t = (tSDL_vnc_tuner *)vnc->tuner;
+
+    t->updatestart = MonotonicMicroseconds();
+    t->updatewait = vnc_counter(&vnc->stats.recvwait);
+    t->updatebytes = vnc->recvconsumed;
+}
+
+
+/* The SetEncodings for the current choice: it first, then the rest of the
+   mode's list, with the compression and quality levels at the end */
+static void tuner_compose(tSDL_vnc * vnc, tSDL_vnc_tuner * t)
+{
+    unsigned char * m = t->message;
+    int32_t list[VNC_MAXENCODINGS];
+    int i, n = 0;
+
+    list[n++] = t->state.encoding;
+    for (i = 0; i < vnc->encodingcount && n < VNC_MAXENCODINGS - 2; i++) {
+        int32_t encoding = vnc->encodings[i];
+        if (encoding == t->state.encoding) continue;
+        if (encoding >= -256 && encoding <= -247) continue;
+        if (encoding >= -32 && encoding <= -23) continue;
+        list[n++] = encoding;
+    }
+    if (t->state.compress >= 0) list[n++] = -256 + t->state.compress;
+    if (t->state.quality >= 0) list[n++] = -32 + t->state.quality;
+
+    m[0] = 2;
+    m[1] = 0;
+    m[2] = n >> 8;
+    m[3] = n & 0xff;
+    for (i = 0; i < n; i++) {
+        m[4 + i * 4] = (list[i] >> 24) & 0xff;
+        m[5 + i * 4] = (list[i] >> 16) & 0xff;
+        m[6 + i * 4] = (list[i] >> 8) & 0xff;
+        m[7 + i * 4] = list[i] & 0xff;
+    }
+    t->messagelen = 4 + n * 4;
+    t->pending = 1;
+}
+
+
+/* Estimated cost of an encoding in us per pixel */
+static double tuner_cost(tSDL_vnc_tuner * t, int i)
+{
+    return t->state.encodings[i].decode + t->state.encodings[i].wire * 1000000.0 / t->state.bandwidth;
+}
+
+
+static void tuner_evaluate(tSDL_vnc * vnc, tSDL_vnc_tuner * t, uint64_t now)
+{
+    tSDL_vnc_tunerState * s = &t->state;
+    int i, best = -1, current = tuner_index(s->encoding);
+
+    for (i = 0; i < VNC_TUNER_ENCODINGS; i++) {
+        tSDL_vnc_tunerSamples * sample = &t->samples[i];
+        tSDL_vnc_tunerEncoding * e = &s->encodings[i];
+        if (sample->pixels < TUNER_MINPIXELS) continue;
+        double decode = (double)sample->us / sample->pixels;
+        double wire = (double)sample->bytes / sample->pixels;
+        if (e->measured) {
+            e->decode = 0.75 * e->decode + 0.25 * decode;
+            e->wire = 0.75 * e->wire + 0.25 * wire;
+        } else {
+            e->decode = decode;
+            e->wire = wire;
+        }
+        e->measured += sample->pixels;
+        memset(sample, 0, sizeof(*sample));
+    }
+    if (s->bandwidth <= 0 || current < 0) return;
+
+    for (i = 0; i < VNC_TUNER_ENCODINGS; i++) {
+        if (s->encodings[i].allowed && (best < 0 || tuner_cost(t, i) < tuner_cost(t, best))) best = i;
+    }
+
+    /* Compress harder the slower the link; JPEG quality only drops on a
+       really slow one, and only if the mode enabled JPEG */
+    int compress = s->bandwidth >= 50e6 || (s->rtt > 0 && s->rtt < TUNER_LAN && s->bandwidth >= 10e6) ? 1 :
+                   s->bandwidth >= 10e6 ? 3 : s->bandwidth >= 1e6 ? 6 : 9;
+    int quality = t->userquality;
+    if (quality >= 0 && s->bandwidth < 1e6) quality = quality > 3 ? quality - 3 : 0;
+
+    /* Levels alone only change once the bandwidth has moved a lot, or a
+       link right at a threshold would flip them back and forth */
+    int switching = best != current && tuner_cost(t, best) < TUNER_MARGIN * tuner_cost(t, current);
+    int relevel = (compress != s->compress || quality != s->quality) &&
+                  (t->levelbandwidth <= 0 || s->bandwidth > 2 * t->levelbandwidth || 2 * s->bandwidth < t->levelbandwidth);
+    if (!switching && !relevel) return;
+    if (now - t->lastswitch < TUNER_SETTLE) return;
+
+    if (switching) {
+        snprintf(s->reason, sizeof(s->reason), "%s -> %s (%.4f -> %.4f us/px), compress %i, quality %i at %.0f kB/s, rtt %lu us",
+                 tuner_name(s->encoding), tuner_name(tuner_priors[best].encoding),
+                 tuner_cost(t, current), tuner_cost(t, best),
+                 compress, quality, s->bandwidth / 1000, (unsigned long)s->rtt);
+    } else {
+        snprintf(s->reason, sizeof(s->reason), "%s kept, compress %i -> %i, quality %i -> %i at %.0f kB/s, rtt %lu us",
+                 tuner_name(s->encoding), s->compress, compress, s->quality, quality,
+                 s->bandwidth / 1000, (unsigned long)s->rtt);
+    }
+    DBMESSAGE("Tuner: %s\n", s->reason);
+    if (switching) s->encoding = tuner_priors[best].encoding;
+    s->compress = compress;
+    s->quality = quality;
+    s->switches++;
+    t->lastswitch = now;
+    t->levelbandwidth = s->bandwidth;
+    tuner_compose(vnc, t);
+}
+
+
+/* End of an update: fold its timing into the link estimates, and every
+   TUNER_INTERVAL reconsider the choice of encoding */
+void TunerUpdateEnd(tSDL_vnc * vnc)
+{
+    tSDL_vnc_tuner * t = (tSDL_vnc_tuner *)vnc->tuner;
+    tSDL_vnc_tunerState * s = &t->state;
+    uint64_t now = MonotonicMicroseconds();
+    uint64_t elapsed = now - t->updatestart;
+    uint64_t wait = vnc_counter(&vnc->stats.recvwait) - t->updatewait;
+    unsigned long bytes = vnc->recvconsumed - t->updatebytes;
+
+    SDL_LockMutex(vnc->mutex);
+    /* An update that mostly waited for data ran at the speed of the link;
+       one that did not shows the link is at least that fast. The first
+       one arrived while the connection was still being set up. */
+    if (bytes >= TUNER_MINBYTES && elapsed >= TUNER_MINTIME && vnc->frameseq > 1) {
+        double rate = bytes * 1000000.0 / elapsed;
+        if (wait * 2 >= elapsed) s->bandwidth = s->bandwidth > 0 ? 0.75 * s->bandwidth + 0.25 * rate : rate;
+        else if (rate > s->bandwidth) s->bandwidth = rate;
+    }
+    if (vnc->fencertmin > 0) {
+        s->rtt = vnc->fencertmin;
+    } else if (vnc->requestlatencylast > 0 && (s->rtt == 0 || vnc->requestlatencylast < s->rtt)) {
+        s->rtt = vnc->requestlatencylast;
+    }
+    if (now - t->lastevaluation >= TUNER_INTERVAL) {
+        t->lastevaluation = now;
+        tuner_evaluate(vnc, t, now);
+    }
+    SDL_UnlockMutex(vnc->mutex);
+}
+
+
+/* Take a SetEncodings the tuner decided on, to be sent before the next
+   update request. Returns its length, 0 if there is none. */
+int TunerPendingEncodings(tSDL_vnc * vnc, unsigned char * message)
+{
+    tSDL_vnc_tuner * t = (tSDL_vnc_tuner *)vnc->tuner;
+    int len;
+
+    SDL_LockMutex(vnc->mutex);
+    len = t->pending ? t->messagelen : 0;
+    memcpy(message, t->message, len);
+    t->pending = 0;
+    SDL_UnlockMutex(vnc->mutex);
+    return len;
+}
+
+
+int vncTunerState(tSDL_vnc * vnc, tSDL_vnc_tunerState * state)
+{
+    tSDL_vnc_tuner * t = (tSDL_vnc_tuner *)vnc->tuner;
+
+    memset(state, 0, sizeof(*state));
+    if (!t) return 0;
+    SDL_LockMutex(vnc->mutex);
+    *state = t->state;
+    SDL_UnlockMutex(vnc->mutex);
+    return 1;
+}
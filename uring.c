@@ -0,0 +1,270 @@
+/*
+ * io_uring receive backend (Linux)
+ *
+ * Licensed under the LGPL - see LICENSE
+ *
+ */
+
+/*
+ * One multishot recv stays armed on the socket and the kernel picks a
+ * buffer for each chunk from a ring of provided buffers. The ring fd
+ * becomes readable when completions are waiting; drivers wait on it
+ * instead of the socket (see ServerDataFd()). Talks to the kernel
+ * directly, no liburing needed.
+ *
+ * This is not the fast path: every byte is copied from the provided
+ * buffers into the parser, where recv()/readv() receive large rectangles
+ * straight into place, and the driver still waits in select() or epoll
+ * for each batch of completions. Test/BenchRecv.c measures no gain over
+ * recv(), so it is only used when the mode asks for it, and it keeps few
+ * buffers pinned per connection.
+ */
+
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+/* For syscall() and MAP_ANONYMOUS in strict ISO C builds */
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+/* Multishot recv with provided buffer rings needs Linux 6.0 headers */
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 4
+#define URING_BUFFERS 4			// power of two
+#define URING_BUFSIZE VNC_RECVBUFSIZE
+#define URING_GROUP 0
+
+typedef struct tSDL_vnc_uring {
+    int fd;
+    void *rings;                // SQ and CQ rings, one mapping
+    size_t ringssize;
+    struct io_uring_sqe *sqes;
+    size_t sqessize;
+    unsigned *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufring;  // buffers handed to the kernel
+    size_t bufringsize;
+    unsigned char *buffers;
+    uint16_t buftail;
+} tSDL_vnc_uring;
+
+
+/* Give buffer bid back to the kernel */
+static void uring_recycle(tSDL_vnc_uring * u, int bid)
+{
+    struct io_uring_buf *buf = &u->bufring->bufs[u->buftail & (URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(u->buffers + bid * URING_BUFSIZE);
+    buf->len = URING_BUFSIZE;
+    buf->bid = bid;
+    u->buftail++;
+    vnc_atomic_store(&u->bufring->tail, u->buftail);
+}
+
+
+static int uring_enter(tSDL_vnc_uring * u, unsigned submit)
+{
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, u->fd, submit, 0, 0, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+
+/* Queue the multishot recv; it stays active until the kernel drops it */
+static int uring_arm(tSDL_vnc * vnc, tSDL_vnc_uring * u)
+{
+    unsigned tail = *u->sqtail;
+    unsigned index = tail & *u->sqmask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = vnc->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    u->sqarray[index] = index;
+    vnc_atomic_store(u->sqtail, tail + 1);
+
+    vnc_count(&vnc->stats.recvcalls, 1);
+    if (uring_enter(u, 1) != 1) {
+        DBERROR("Could not submit io_uring receive: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+
+void UringFree(tSDL_vnc * vnc)
+{
+    tSDL_vnc_uring *u = vnc->uring;
+    if (!u) return;
+    /* Closing the ring cancels the recv still armed on it */
+    if (u->fd >= 0) close(u->fd);
+    if (u->rings) munmap(u->rings, u->ringssize);
+    if (u->sqes) munmap(u->sqes, u->sqessize);
+    if (u->bufring) munmap(u->bufring, u->bufringsize);
+    free(u->buffers);
+    free(u);
+    vnc->uring = NULL;
+}
+
+
+int UringCreate(tSDL_vnc * vnc)
+{
+    struct io_uring_params params;
+    tSDL_vnc_uring *u = (tSDL_vnc_uring *) calloc(1, sizeof(tSDL_vnc_uring));
+    if (!u) return 0;
+    vnc->uring = u;
+
+    /* Room for a completion per buffer, so the recv never overflows the
+       completion queue */
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 2 * URING_BUFFERS;
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (u->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        DBMESSAGE("io_uring not available.\n");
+        UringFree(vnc);
+        return 0;
+    }
+
+    size_t sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->ringssize = sqsize > cqsize ? sqsize : cqsize;
+    u->rings = mmap(NULL, u->ringssize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->rings == MAP_FAILED || u->sqes == MAP_FAILED) {
+        if (u->rings == MAP_FAILED) u->rings = NULL;
+        if (u->sqes == MAP_FAILED) u->sqes = NULL;
+        DBERROR("Could not map io_uring rings.\n");
+        UringFree(vnc);
+        return 0;
+    }
+    unsigned char *rings = u->rings;
+    u->sqtail = (unsigned *)(rings + params.sq_off.tail);
+    u->sqmask = (unsigned *)(rings + params.sq_off.ring_mask);
+    u->sqarray = (unsigned *)(rings + params.sq_off.array);
+    u->cqhead = (unsigned *)(rings + params.cq_off.head);
+    u->cqtail = (unsigned *)(rings + params.cq_off.tail);
+    u->cqmask = (unsigned *)(rings + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    /* The buffer ring must be page aligned, hence its own mapping */
+    u->bufringsize = URING_BUFFERS * sizeof(struct io_uring_buf);
+    u->bufring = mmap(NULL, u->bufringsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buffers = malloc(URING_BUFFERS * URING_BUFSIZE);
+    if (u->bufring == MAP_FAILED || !u->buffers) {
+        if (u->bufring == MAP_FAILED) u->bufring = NULL;
+        DBERROR("Out of memory for io_uring buffers.\n");
+        UringFree(vnc);
+        return 0;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)u->bufring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_GROUP;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        DBMESSAGE("io_uring provided buffer rings not available.\n");
+        UringFree(vnc);
+        return 0;
+    }
+    int i;
+    for (i = 0; i < URING_BUFFERS; i++) uring_recycle(u, i);
+
+    if (!uring_arm(vnc, u)) {
+        UringFree(vnc);
+        return 0;
+    }
+    DBMESSAGE("Receiving through io_uring, %i buffers of %i bytes.\n", URING_BUFFERS, URING_BUFSIZE);
+    return 1;
+}
+
+
+int UringFd(tSDL_vnc * vnc)
+{
+    tSDL_vnc_uring *u = vnc->uring;
+    return u ? u->fd : -1;
+}
+
+
+/* Run the parser over every completed receive, in order. Returns 0 at
+   the end of the stream or on an error. */
+int UringReceive(tSDL_vnc * vnc)
+{
+    tSDL_vnc_uring *u = vnc->uring;
+    unsigned head = *u->cqhead;
+    unsigned tail = vnc_atomic_load(u->cqtail);
+    int rearm = 0;
+    int result = 1;
+
+    while (result && head != tail) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cqmask];
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        head++;
+
+        if (!(flags & IORING_CQE_F_MORE)) rearm = 1;
+        if (res > 0) {
+            int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            vnc_count(&vnc->stats.bytesreceived, res);
+            result = ParserFill(vnc, 0, u->buffers + bid * URING_BUFSIZE, res);
+            uring_recycle(u, bid);
+        } else if (res == 0) {
+            DBMESSAGE("Server closed the connection.\n");
+            result = 0;
+        } else if (res != -ENOBUFS) {
+            /* Out of buffers only stops the recv; they are all back by now */
+            DBERROR("io_uring receive failed: %s\n", strerror(-res));
+            result = 0;
+        }
+    }
+    vnc_atomic_store(u->cqhead, head);
+
+    if (result && rearm) result = uring_arm(vnc, u);
+    return result;
+}
+
+#else
+
+/* No io_uring: every read goes through recv()/readv() */
+
+int UringCreate(tSDL_vnc * vnc)
+{
+    return 0;
+}
+
+void UringFree(tSDL_vnc * vnc)
+{
+}
+
+int UringFd(tSDL_vnc * vnc)
+{
+    return -1;
+}
+
+int UringReceive(tSDL_vnc * vnc)
+{
+    return 0;
+}
+
+#endif
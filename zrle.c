@@ -0,0 +1,336 @@
+/*
+ * ZRLE (encoding 16) decoder
+ *
+ * Licensed under the LGPL - see LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "SDL_vnc.h"
+#include "SDL_vnc_internal.h"
+
+#define ZRLE_TILE 64
+#define ZRLE_OUTBUFSIZE 16384
+/* Worst case of a tile: the subencoding byte, a 127 entry palette and a
+   plain RLE run of length one (cpixel plus length byte) per pixel */
+#define ZRLE_TILEMAX (1 + 127 * 4 + ZRLE_TILE * ZRLE_TILE * 5)
+
+/* ZRLE always uses a single zlib stream for the whole connection */
+typedef struct tSDL_vnc_zrle {
+    tSDL_vnc *vnc;
+    z_stream stream;
+    unsigned char *in;              // compressed data of the current rectangle
+    uint32_t insize;                // allocated size of in
+    unsigned char out[ZRLE_OUTBUFSIZE]; // inflated data not yet consumed
+    uint32_t outpos;
+    uint32_t outlen;
+} tSDL_vnc_zrle;
+
+
+static tSDL_vnc_zrle * zrle_state(tSDL_vnc * vnc)
+{
+    tSDL_vnc_zrle * z = (tSDL_vnc_zrle *)vnc->zrle;
+    if (z) return z;
+
+    z = (tSDL_vnc_zrle *)calloc(1, sizeof(tSDL_vnc_zrle));
+    if (!z) {
+        DBERROR("Out of memory allocating ZRLE state.\n");
+        return NULL;
+    }
+    if (inflateInit(&z->stream) != Z_OK) {
+        DBERROR("Could not initialize ZRLE zlib stream.\n");
+        free(z);
+        return NULL;
+    }
+    z->vnc = vnc;
+    vnc->zrle = z;
+    return z;
+}
+
+
+void zrle_free(tSDL_vnc * vnc)
+{
+    tSDL_vnc_zrle * z = (tSDL_vnc_zrle *)vnc->zrle;
+    if (!z) return;
+    inflateEnd(&z->stream);
+    free(z->in);
+    free(z);
+    vnc->zrle = NULL;
+}
+
+
+/* Inflate more data into the output buffer. Returns 0 if the rectangle
+   data is exhausted or corrupt. */
+static int zrle_fill(tSDL_vnc_zrle * z)
+{
+    if (z->outpos < z->outlen) {
+        memmove(z->out, z->out + z->outpos, z->outlen - z->outpos);
+    }
+    z->outlen -= z->outpos;
+    z->outpos = 0;
+
+    z->stream.next_out = z->out + z->outlen;
+    z->stream.avail_out = ZRLE_OUTBUFSIZE - z->outlen;
+    int result = inflate(&z->stream, Z_SYNC_FLUSH);
+    if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+        DBERROR("ZRLE inflate error %i.\n", result);
+        return 0;
+    }
+    uint32_t got = (ZRLE_OUTBUFSIZE - z->outlen) - z->stream.avail_out;
+    if (got == 0) {
+        DBERROR("ZRLE data ended early.\n");
+        return 0;
+    }
+    z->outlen += got;
+    return 1;
+}
+
+
+/* Make sure at least len bytes of inflated data are available */
+static inline int zrle_need(tSDL_vnc_zrle * z, uint32_t len)
+{
+    while (z->outlen - z->outpos < len) {
+        if (zrle_fill(z) == 0) return 0;
+    }
+    return 1;
+}
+
+
+/* A CPIXEL is 3 bytes for 32bpp with depth 24, otherwise a whole pixel */
+VNC_INLINE uint32_t zrle_cpixel(tSDL_vnc_zrle * z, const unsigned char * p, const int cpixel)
+{
+    if (cpixel == 3) return p[0] | (p[1] << 8) | (p[2] << 16);
+    return vnc_pixel(z->vnc, p, cpixel);
+}
+
+
+/* Read count CPIXELs into dest */
+VNC_INLINE int zrle_read_cpixels(tSDL_vnc_zrle * z, uint32_t * dest, int count, const int cpixel)
+{
+    while (count > 0) {
+        int n = (ZRLE_OUTBUFSIZE / 3) < count ? (ZRLE_OUTBUFSIZE / 3) : count;
+        if (zrle_need(z, n * cpixel) == 0) return 0;
+        const unsigned char * src = z->out + z->outpos;
+        int i;
+        for (i = 0; i < n; i++, src += cpixel) dest[i] = zrle_cpixel(z, src, cpixel);
+        z->outpos += n * cpixel;
+        dest += n;
+        count -= n;
+    }
+    return 1;
+}
+
+
+static inline int zrle_read_byte(tSDL_vnc_zrle * z, uint8_t * value)
+{
+    if (zrle_need(z, 1) == 0) return 0;
+    *value = z->out[z->outpos++];
+    return 1;
+}
+
+
+/* Run lengths are a sequence of bytes, terminated by one that is not 255 */
+static int zrle_read_runlength(tSDL_vnc_zrle * z, uint32_t * length)
+{
+    uint8_t b;
+    *length = 1;
+    do {
+        if (zrle_read_byte(z, &b) == 0) return 0;
+        *length += b;
+    } while (b == 255);
+    return 1;
+}
+
+
+/* Decode a single tile straight into the framebuffer at dest */
+VNC_INLINE int zrle_tile(tSDL_vnc_zrle * z, uint32_t * dest, uint32_t pitch, int tw, int th, const int cpixel)
+{
+    uint32_t palette[128];
+    uint8_t subencoding;
+    int x, y;
+
+    if (zrle_read_byte(z, &subencoding) == 0) return 0;
+
+    if (subencoding == 0) {
+        /* Raw */
+        for (y = 0; y < th; y++, dest += pitch) {
+            if (zrle_read_cpixels(z, dest, tw, cpixel) == 0) return 0;
+        }
+        return 1;
+    }
+
+    if (subencoding == 1) {
+        /* Solid */
+        if (zrle_read_cpixels(z, palette, 1, cpixel) == 0) return 0;
+        for (y = 0; y < th; y++, dest += pitch) {
+            for (x = 0; x < tw; x++) dest[x] = palette[0];
+        }
+        return 1;
+    }
+
+    if (subencoding <= 16) {
+        /* Packed palette */
+        int bits = subencoding == 2 ? 1 : (subencoding <= 4 ? 2 : 4);
+        uint8_t mask = (1 << bits) - 1;
+        if (zrle_read_cpixels(z, palette, subencoding, cpixel) == 0) return 0;
+        uint32_t rowbytes = (tw * bits + 7) / 8;
+        for (y = 0; y < th; y++, dest += pitch) {
+            if (zrle_need(z, rowbytes) == 0) return 0;
+            const unsigned char * src = z->out + z->outpos;
+            int shift = 8;
+            for (x = 0; x < tw; x++) {
+                shift -= bits;
+                dest[x] = palette[(*src >> shift) & mask];
+                if (shift == 0) {
+                    shift = 8;
+                    src++;
+                }
+            }
+            z->outpos += rowbytes;
+        }
+        return 1;
+    }
+
+    if (subencoding == 128 || subencoding >= 130) {
+        /* Plain RLE or palette RLE */
+        int use_palette = subencoding >= 130;
+        if (use_palette && zrle_read_cpixels(z, palette, subencoding - 128, cpixel) == 0) return 0;
+
+        uint32_t * end = dest + (th - 1) * pitch + tw;
+        x = 0;
+        while (dest + x < end) {
+            uint32_t color;
+            uint32_t length = 1;
+            if (use_palette) {
+                uint8_t index;
+                if (zrle_read_byte(z, &index) == 0) return 0;
+                color = palette[index & 127];
+                if ((index & 128) && zrle_read_runlength(z, &length) == 0) return 0;
+            } else {
+                if (zrle_read_cpixels(z, &color, 1, cpixel) == 0) return 0;
+                if (zrle_read_runlength(z, &length) == 0) return 0;
+            }
+            /* Runs continue across row boundaries of the tile */
+            while (length > 0) {
+                if (dest + x >= end) {
+                    DBERROR("ZRLE run exceeds tile.\n");
+                    return 0;
+                }
+                dest[x++] = color;
+                length--;
+                if (x == tw) {
+                    x = 0;
+                    dest += pitch;
+                }
+            }
+        }
+        return 1;
+    }
+
+    DBERROR("Invalid ZRLE subencoding %u.\n", subencoding);
+    return 0;
+}
+
+
+/* All tiles of a rectangle; one copy per CPIXEL size */
+VNC_INLINE int zrle_tiles(tSDL_vnc_zrle * z, uint32_t * base, uint32_t pitch, tSDL_vnc_rect rect, const int cpixel)
+{
+    int result = 1;
+    int tx, ty;
+    for (ty = 0; result && ty < rect.height; ty += ZRLE_TILE) {
+        int th = rect.height - ty < ZRLE_TILE ? rect.height - ty : ZRLE_TILE;
+        for (tx = 0; result && tx < rect.width; tx += ZRLE_TILE) {
+            int tw = rect.width - tx < ZRLE_TILE ? rect.width - tx : ZRLE_TILE;
+            result = zrle_tile(z, base + ty * pitch + tx, pitch, tw, th, cpixel);
+        }
+    }
+    return result;
+}
+
+
+int ServerRectangle_ZRLE(tSDL_vnc * vnc, tSDL_vnc_rect rect)
+{
+    uint32_t length;
+    DBMESSAGE("ZRLE encoding.\n");
+
+    tSDL_vnc_zrle * z = zrle_state(vnc);
+    if (!z) return 0;
+
+    CHECKED_READ(vnc, &length, 4, "ZRLE length");
+    length = swap_32(length);
+
+    /* No honest server sends more than zlib's worst case for the largest
+       tile stream the rectangle can decode to */
+    uint64_t tiles = (uint64_t)((rect.width + ZRLE_TILE - 1) / ZRLE_TILE) * ((rect.height + ZRLE_TILE - 1) / ZRLE_TILE);
+    uint64_t bound = tiles * ZRLE_TILEMAX;
+    bound += (bound >> 12) + (bound >> 14) + (bound >> 25) + 64;
+    if (length > bound) {
+        DBERROR("ZRLE data too long (%u bytes) for a %ix%i rectangle.\n", length, rect.width, rect.height);
+        return 0;
+    }
+
+    /* Pull in the whole rectangle before touching the framebuffer, so the
+       mutex is never held while waiting on the network */
+    if (length > z->insize) {
+        unsigned char * in = realloc(z->in, length);
+        if (!in) {
+            DBERROR("Out of memory for ZRLE data (%u bytes).\n", length);
+            return 0;
+        }
+        z->in = in;
+        z->insize = length;
+        CountAllocation(vnc, length);
+    }
+    CHECKED_READ(vnc, z->in, (int)length, "ZRLE data");
+
+    if (!RectInFramebuffer(vnc, &rect)) return 0;
+
+    z->stream.next_in = z->in;
+    z->stream.avail_in = length;
+    z->outpos = z->outlen = 0;
+
+    SDL_Rect trec;
+    vnc_to_sdl_rect(&rect, &trec);
+    SDL_LockMutex(vnc->mutex);
+    SDL_LockSurface(vnc->framebuffer);
+
+    uint32_t pitch = vnc->framebuffer->pitch / 4;
+    uint32_t * base = (uint32_t *)vnc->framebuffer->pixels + rect.y * pitch + rect.x;
+    int result;
+    switch (vnc->bpp) {
+    case 1:
+        result = zrle_tiles(z, base, pitch, rect, 1);
+        break;
+    case 2:
+        result = zrle_tiles(z, base, pitch, rect, 2);
+        break;
+    default:
+        result = zrle_tiles(z, base, pitch, rect, 3);
+        break;
+    }
+
+    GrowUpdateRegion(vnc, &trec);
+    SDL_UnlockSurface(vnc->framebuffer);
+    SDL_UnlockMutex(vnc->mutex);
+
+    if (!result) return 0;
+
+    /* Feed any trailing input (the server's sync flush) through the
+       stream so its state stays in step with the server */
+    while (z->stream.avail_in > 0) {
+        z->outpos = z->outlen = 0;
+        z->stream.next_out = z->out;
+        z->stream.avail_out = ZRLE_OUTBUFSIZE;
+        int zresult = inflate(&z->stream, Z_SYNC_FLUSH);
+        if (zresult != Z_OK && zresult != Z_BUF_ERROR) {
+            DBERROR("ZRLE inflate error %i.\n", zresult);
+            return 0;
+        }
+        if (zresult == Z_BUF_ERROR) break;
+    }
+    DBMESSAGE("Decoded ZRLE rectangle from %u bytes.\n", length);
+    return 1;
+}